@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#include <glib-object.h>
+#include <jansson.h>
+
+#include <rpcsyncwerk.h>
+
+#include "bench-common.h"
+
+/* BenchObject */
+
+G_DEFINE_TYPE (BenchObject, bench_object, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_ID,
+    PROP_NAME,
+    PROP_SIZE,
+    PROP_FLAG,
+    PROP_SCORE,
+    N_PROPERTIES
+};
+
+static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
+
+static void bench_object_set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec)
+{
+    BenchObject *self = BENCH_OBJECT (object);
+    switch (property_id) {
+        case PROP_ID:
+            self->id = g_value_get_int64 (value);
+            break;
+        case PROP_NAME:
+            g_free (self->name);
+            self->name = g_value_dup_string (value);
+            break;
+        case PROP_SIZE:
+            self->size = g_value_get_int (value);
+            break;
+        case PROP_FLAG:
+            self->flag = g_value_get_boolean (value);
+            break;
+        case PROP_SCORE:
+            self->score = g_value_get_double (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void bench_object_get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec)
+{
+    BenchObject *self = BENCH_OBJECT (object);
+    switch (property_id) {
+        case PROP_ID:
+            g_value_set_int64 (value, self->id);
+            break;
+        case PROP_NAME:
+            g_value_set_string (value, self->name);
+            break;
+        case PROP_SIZE:
+            g_value_set_int (value, self->size);
+            break;
+        case PROP_FLAG:
+            g_value_set_boolean (value, self->flag);
+            break;
+        case PROP_SCORE:
+            g_value_set_double (value, self->score);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void bench_object_finalize (GObject *object)
+{
+    BenchObject *self = BENCH_OBJECT (object);
+    g_free (self->name);
+    G_OBJECT_CLASS (bench_object_parent_class)->finalize (object);
+}
+
+static void bench_object_class_init (BenchObjectClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->set_property = bench_object_set_property;
+    gobject_class->get_property = bench_object_get_property;
+    gobject_class->finalize = bench_object_finalize;
+
+    obj_properties[PROP_ID] = g_param_spec_int64 ("id", "", "", G_MININT64, G_MAXINT64, 0, G_PARAM_READWRITE);
+    obj_properties[PROP_NAME] = g_param_spec_string ("name", "", "", NULL, G_PARAM_READWRITE);
+    obj_properties[PROP_SIZE] = g_param_spec_int ("size", "", "", G_MININT, G_MAXINT, 0, G_PARAM_READWRITE);
+    obj_properties[PROP_FLAG] = g_param_spec_boolean ("flag", "", "", FALSE, G_PARAM_READWRITE);
+    obj_properties[PROP_SCORE] = g_param_spec_double ("score", "", "", -G_MAXDOUBLE, G_MAXDOUBLE, 0, G_PARAM_READWRITE);
+    g_object_class_install_properties (gobject_class, N_PROPERTIES, obj_properties);
+}
+
+static void bench_object_init (BenchObject *self)
+{
+}
+
+/* Payloads */
+
+char *
+bench_make_string (int len)
+{
+    char *str = g_malloc (len + 1);
+    int i;
+
+    /* include a few characters that need escaping */
+    for (i = 0; i < len; i++)
+        str[i] = (i % 16 == 15) ? '"' : 'a' + i % 26;
+    str[len] = '\0';
+    return str;
+}
+
+GObject *
+bench_make_object (int i)
+{
+    BenchObject *obj = g_object_new (BENCH_TYPE_OBJECT, NULL);
+
+    obj->id = (gint64)i * 1000003;
+    obj->name = g_strdup_printf ("/library/folder-%d/file name %d.txt", i % 10, i);
+    obj->size = i * 7;
+    obj->flag = (i % 2) == 0;
+    obj->score = i / 3.0;
+    return (GObject *)obj;
+}
+
+GList *
+bench_make_objlist (int n)
+{
+    GList *ret = NULL;
+    int i;
+
+    for (i = n - 1; i >= 0; i--)
+        ret = g_list_prepend (ret, bench_make_object (i));
+    return ret;
+}
+
+json_t *
+bench_make_json (int n_keys)
+{
+    json_t *object = json_object ();
+    int i;
+
+    for (i = 0; i < n_keys; i++) {
+        char key[32];
+        snprintf (key, sizeof(key), "key-%d", i);
+        if (i % 2)
+            json_object_set_new (object, key, json_integer (i));
+        else
+            json_object_set_new (object, key, json_string ("some \"quoted\" value"));
+    }
+    return object;
+}
+
+/* RPC functions */
+
+int
+bench_int (int x, GError **error)
+{
+    return x;
+}
+
+char *
+bench_string (const char *str, GError **error)
+{
+    return g_strdup (str);
+}
+
+GObject *
+bench_object (int i, GError **error)
+{
+    return bench_make_object (i);
+}
+
+GList *
+bench_objlist (int n, GError **error)
+{
+    return bench_make_objlist (n);
+}
+
+json_t *
+bench_json (const json_t *obj, GError **error)
+{
+    return json_deep_copy ((json_t *)obj);
+}
+
+#include "rpcsyncwerk-signature.h"
+#include "rpcsyncwerk-marshal.h"
+
+const BenchMarshal bench_marshals[] = {
+    { "marshal_int__int", marshal_int__int, bench_int },
+    { "marshal_string__string", marshal_string__string, bench_string },
+    { "marshal_object__int", marshal_object__int, bench_object },
+    { "marshal_objlist__int", marshal_objlist__int, bench_objlist },
+    { "marshal_json__json", marshal_json__json, bench_json },
+    { NULL },
+};
+
+void
+bench_start_rpc_service (void)
+{
+    rpcsyncwerk_server_init (register_marshals);
+    rpcsyncwerk_create_service (BENCH_SERVICE);
+
+    rpcsyncwerk_server_register_function_static (BENCH_SERVICE, bench_int, "bench_int",
+                                                 RPCSYNCWERK_SIGNATURE_INT__INT);
+    rpcsyncwerk_server_register_function_static (BENCH_SERVICE, bench_string, "bench_string",
+                                                 RPCSYNCWERK_SIGNATURE_STRING__STRING);
+    rpcsyncwerk_server_register_function_static (BENCH_SERVICE, bench_object, "bench_object",
+                                                 RPCSYNCWERK_SIGNATURE_OBJECT__INT);
+    rpcsyncwerk_server_register_function_static (BENCH_SERVICE, bench_objlist, "bench_objlist",
+                                                 RPCSYNCWERK_SIGNATURE_OBJLIST__INT);
+    rpcsyncwerk_server_register_function_static (BENCH_SERVICE, bench_json, "bench_json",
+                                                 RPCSYNCWERK_SIGNATURE_JSON__JSON);
+}
+
+void
+bench_init (void)
+{
+    /* let the allocation counters see every allocation */
+    g_setenv ("G_SLICE", "always-malloc", TRUE);
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init ();
+#endif
+}
+
+gint64
+bench_now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Allocation counting */
+
+#if defined(__GLIBC__)
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static guint64 alloc_count;
+static guint64 alloc_bytes;
+
+static inline void
+count_alloc (size_t size)
+{
+    __atomic_fetch_add (&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *
+malloc (size_t size)
+{
+    count_alloc (size);
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size)
+{
+    count_alloc (n * size);
+    return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    count_alloc (size);
+    return __libc_realloc (ptr, size);
+}
+
+gboolean
+bench_alloc_counting_supported (void)
+{
+    return TRUE;
+}
+
+void
+bench_alloc_snapshot (BenchAllocStats *stats)
+{
+    stats->count = __atomic_load_n (&alloc_count, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n (&alloc_bytes, __ATOMIC_RELAXED);
+}
+
+#else
+
+gboolean
+bench_alloc_counting_supported (void)
+{
+    return FALSE;
+}
+
+void
+bench_alloc_snapshot (BenchAllocStats *stats)
+{
+    stats->count = 0;
+    stats->bytes = 0;
+}
+
+#endif  /* defined(__GLIBC__) */
+
+/* Reporting */
+
+static int
+cmp_gint64 (const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double
+percentile_us (const gint64 *sorted, gsize n, double p)
+{
+    gsize i = (gsize)(p * (n - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+void
+bench_print_latency (gint64 *samples, gsize n)
+{
+    if (n == 0)
+        return;
+
+    qsort (samples, n, sizeof(gint64), cmp_gint64);
+    printf ("latency (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+            percentile_us (samples, n, 0.50),
+            percentile_us (samples, n, 0.99),
+            percentile_us (samples, n, 0.999),
+            samples[n - 1] / 1000.0);
+}
+
+void
+bench_print_allocs (const BenchAllocStats *before,
+                    const BenchAllocStats *after, guint64 n_ops)
+{
+    if (!bench_alloc_counting_supported ()) {
+        printf ("allocations: not counted on this platform\n");
+        return;
+    }
+    if (n_ops == 0)
+        return;
+
+    printf ("allocations/op: %.1f  bytes/op: %.1f\n",
+            (double)(after->count - before->count) / n_ops,
+            (double)(after->bytes - before->bytes) / n_ops);
+}
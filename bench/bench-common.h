@@ -0,0 +1,86 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <jansson.h>
+
+#include <rpcsyncwerk-server.h>
+
+/* Object returned by the object and objlist benchmarks, with one property
+ * of each common type. */
+
+#define BENCH_TYPE_OBJECT           (bench_object_get_type ())
+#define BENCH_OBJECT(obj)           (G_TYPE_CHECK_INSTANCE_CAST ((obj), BENCH_TYPE_OBJECT, BenchObject))
+
+typedef struct _BenchObject      BenchObject;
+typedef struct _BenchObjectClass BenchObjectClass;
+
+struct _BenchObject {
+    GObject parent;
+    gint64 id;
+    gchar *name;
+    int size;
+    gboolean flag;
+    double score;
+};
+
+struct _BenchObjectClass {
+    GObjectClass parent_class;
+};
+
+GType bench_object_get_type (void);
+
+#define BENCH_SERVICE "bench"
+
+/* Must be called first thing in main(). */
+void bench_init (void);
+
+/* Initialize the rpc server and register the bench functions:
+ *   int bench_int (int)              echoes its argument
+ *   string bench_string (string)     echoes its argument
+ *   object bench_object (int)        returns one BenchObject
+ *   objlist bench_objlist (int n)    returns n BenchObjects
+ *   json bench_json (json)           echoes its argument
+ */
+void bench_start_rpc_service (void);
+
+int bench_int (int x, GError **error);
+char *bench_string (const char *str, GError **error);
+GObject *bench_object (int i, GError **error);
+GList *bench_objlist (int n, GError **error);
+json_t *bench_json (const json_t *obj, GError **error);
+
+/* The generated marshals, which are static in rpcsyncwerk-marshal.h. */
+typedef struct {
+    const char *name;
+    RpcsyncwerkMarshalFunc marshal;
+    void *func;
+} BenchMarshal;
+
+extern const BenchMarshal bench_marshals[];
+
+char *bench_make_string (int len);
+GObject *bench_make_object (int i);
+GList *bench_make_objlist (int n);
+json_t *bench_make_json (int n_keys);
+
+gint64 bench_now_ns (void);
+
+/* Process wide allocation counters. Only available with glibc, where
+ * malloc() and friends are wrapped by the bench programs. */
+typedef struct {
+    guint64 count;
+    guint64 bytes;
+} BenchAllocStats;
+
+gboolean bench_alloc_counting_supported (void);
+void bench_alloc_snapshot (BenchAllocStats *stats);
+
+/* Sorts @samples (in ns) and prints p50/p99/p999/max in us. */
+void bench_print_latency (gint64 *samples, gsize n);
+
+void bench_print_allocs (const BenchAllocStats *before,
+                         const BenchAllocStats *after, guint64 n_ops);
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * Microbenchmarks for the layers on every call path: building the call on
+ * the client, dispatching it on the server, the generated marshals, GObject
+ * (de)serialization and parsing the result on the client.
+ *
+ * Each benchmark runs a fixed number of iterations, a few rounds, and
+ * reports the best round in ns/op together with allocations and bytes
+ * allocated per op.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib-object.h>
+#include <jansson.h>
+
+#include <rpcsyncwerk.h>
+
+#include "bench-common.h"
+
+static int payload_size = 100;
+static int n_rounds = 3;
+static double scale = 1.0;
+static char *filter = NULL;
+
+static GOptionEntry entries[] = {
+    { "size", 's', 0, G_OPTION_ARG_INT, &payload_size,
+      "String length, objlist length or json keys", "N" },
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &n_rounds, "Rounds per benchmark", "N" },
+    { "scale", 0, 0, G_OPTION_ARG_DOUBLE, &scale, "Multiply the iteration counts", "X" },
+    { "filter", 'f', 0, G_OPTION_ARG_STRING, &filter,
+      "Only run benchmarks whose name contains this string", "STR" },
+    { NULL },
+};
+
+typedef void (*BenchFunc) (gpointer arg);
+
+static void
+run_bench (const char *name, BenchFunc func, gpointer arg, guint64 iterations)
+{
+    BenchAllocStats before, after;
+    double best_ns = 0;
+    guint64 i;
+    int round;
+
+    if (filter && !strstr (name, filter))
+        return;
+
+    iterations = (guint64)(iterations * scale);
+    if (iterations == 0)
+        iterations = 1;
+
+    for (i = 0; i < iterations / 10 + 1; i++)
+        func (arg);
+
+    for (round = 0; round < n_rounds; round++) {
+        bench_alloc_snapshot (&before);
+        gint64 start = bench_now_ns ();
+        for (i = 0; i < iterations; i++)
+            func (arg);
+        double ns = (double)(bench_now_ns () - start) / iterations;
+        bench_alloc_snapshot (&after);
+
+        if (round == 0 || ns < best_ns)
+            best_ns = ns;
+    }
+
+    printf ("%-40s %10" G_GUINT64_FORMAT " %12.1f ns/op", name, iterations, best_ns);
+    if (bench_alloc_counting_supported ())
+        printf (" %10.1f allocs/op %12.1f B/op",
+                (double)(after.count - before.count) / iterations,
+                (double)(after.bytes - before.bytes) / iterations);
+    printf ("\n");
+}
+
+/* Client side: a transport returning a canned response, so only building
+ * the call and parsing the result are measured. */
+
+typedef struct {
+    const char *response;
+    gsize len;
+} CannedResponse;
+
+static char *
+canned_send (void *arg, const gchar *fcall_str, size_t fcall_len, size_t *ret_len)
+{
+    CannedResponse *resp = arg;
+
+    *ret_len = resp->len;
+    return g_memdup (resp->response, resp->len);
+}
+
+static RpcsyncwerkClient *int_client;
+static RpcsyncwerkClient *objlist_client;
+
+static void
+bench_client_call_int (gpointer arg)
+{
+    rpcsyncwerk_client_call__int (int_client, "bench_int", NULL,
+                                  3, "string", "/library/folder/file.txt",
+                                  "int", 42, "string", "some \"quoted\" string");
+}
+
+static void
+bench_client_call_objlist (gpointer arg)
+{
+    GList *ret = rpcsyncwerk_client_call__objlist (objlist_client, "bench_objlist",
+                                                   BENCH_TYPE_OBJECT, NULL,
+                                                   1, "int", payload_size);
+    GList *ptr;
+
+    for (ptr = ret; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (ret);
+}
+
+/* Server side */
+
+typedef struct {
+    char *fcall;
+    gsize len;
+} ServerCall;
+
+static void
+bench_server_call (gpointer arg)
+{
+    ServerCall *call = arg;
+    gsize ret_len;
+
+    g_free (rpcsyncwerk_server_call_function (BENCH_SERVICE, call->fcall,
+                                              call->len, &ret_len));
+}
+
+typedef struct {
+    const BenchMarshal *marshal;
+    json_t *params;
+} MarshalCall;
+
+static void
+bench_marshal (gpointer arg)
+{
+    MarshalCall *call = arg;
+    gsize ret_len;
+
+    g_free (call->marshal->marshal (call->marshal->func, call->params, &ret_len));
+}
+
+/* Serialization */
+
+static void
+bench_serialize (gpointer arg)
+{
+    json_decref (json_gobject_serialize (arg));
+}
+
+static void
+bench_serialize_dump (gpointer arg)
+{
+    json_t *object = json_gobject_serialize (arg);
+    free (json_dumps (object, JSON_COMPACT));
+    json_decref (object);
+}
+
+static GString *serialize_buffer;
+
+static void
+bench_serialize_to_buffer (gpointer arg)
+{
+    g_string_truncate (serialize_buffer, 0);
+    json_gobject_serialize_to_buffer (arg, serialize_buffer);
+}
+
+static void
+bench_deserialize (gpointer arg)
+{
+    g_object_unref (json_gobject_deserialize (BENCH_TYPE_OBJECT, arg));
+}
+
+static char *
+make_fcall (const char *fname, json_t *params, gsize *len)
+{
+    json_t *array = json_array ();
+    char *ret;
+
+    json_array_append_new (array, json_string (fname));
+    json_array_extend (array, params);
+    ret = json_dumps (array, JSON_COMPACT);
+    json_decref (array);
+
+    *len = strlen (ret);
+    return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    int i;
+
+    bench_init ();
+
+    context = g_option_context_new ("- microbenchmarks of the rpc layers");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        fprintf (stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    bench_start_rpc_service ();
+
+    /* parameters of the bench functions, in the order of bench_marshals */
+    static const char *rpc_names[] = {
+        "bench_int", "bench_string", "bench_object", "bench_objlist", "bench_json",
+    };
+    char *string_payload = bench_make_string (payload_size);
+    json_t *json_payload = bench_make_json (payload_size);
+    json_t *params[5];
+    params[0] = json_pack ("[i]", 42);
+    params[1] = json_pack ("[s]", string_payload);
+    params[2] = json_pack ("[i]", 42);
+    params[3] = json_pack ("[i]", payload_size);
+    params[4] = json_pack ("[O]", json_payload);
+
+    /* iterations for each marshal, roughly 0.1-0.5s each */
+    guint64 iterations[5] = {
+        500000, 200000, 200000, MAX(2000, 2000000 / (payload_size + 1)),
+        MAX(2000, 2000000 / (payload_size + 1)),
+    };
+
+    printf ("size=%d rounds=%d scale=%.2f\n", payload_size, n_rounds, scale);
+
+    /* client */
+    CannedResponse int_resp = { "{\"ret\":1}", strlen ("{\"ret\":1}") };
+    int_client = rpcsyncwerk_client_new ();
+    int_client->send = canned_send;
+    int_client->arg = &int_resp;
+    run_bench ("client fcall_to_str + fret__int", bench_client_call_int, NULL, 500000);
+
+    CannedResponse objlist_resp;
+    objlist_resp.response = bench_marshals[3].marshal (bench_marshals[3].func,
+                                                       params[3], &objlist_resp.len);
+    objlist_client = rpcsyncwerk_client_new ();
+    objlist_client->send = canned_send;
+    objlist_client->arg = &objlist_resp;
+    run_bench ("client fret__objlist", bench_client_call_objlist, NULL, iterations[3]);
+
+    /* server */
+    for (i = 0; bench_marshals[i].name; i++) {
+        char name[128];
+        ServerCall call;
+
+        call.fcall = make_fcall (rpc_names[i], params[i], &call.len);
+        snprintf (name, sizeof(name), "server call_function %s", rpc_names[i]);
+        run_bench (name, bench_server_call, &call, iterations[i]);
+        free (call.fcall);
+    }
+
+    for (i = 0; bench_marshals[i].name; i++) {
+        char name[128];
+        json_t *array = json_array ();
+        MarshalCall call = { &bench_marshals[i], array };
+
+        /* marshals skip element 0, the function name */
+        json_array_append_new (array, json_null ());
+        json_array_extend (array, params[i]);
+
+        snprintf (name, sizeof(name), "server %s", bench_marshals[i].name);
+        run_bench (name, bench_marshal, &call, iterations[i]);
+        json_decref (array);
+    }
+
+    /* serialization */
+    GObject *obj = bench_make_object (12345);
+    json_t *serialized = json_gobject_serialize (obj);
+    serialize_buffer = g_string_new (NULL);
+
+    run_bench ("json_gobject_serialize", bench_serialize, obj, 500000);
+    run_bench ("json_gobject_serialize + json_dumps", bench_serialize_dump, obj, 500000);
+    run_bench ("json_gobject_serialize_to_buffer", bench_serialize_to_buffer, obj, 500000);
+    run_bench ("json_gobject_deserialize", bench_deserialize, serialized, 500000);
+
+    return 0;
+}
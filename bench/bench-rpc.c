@@ -0,0 +1,326 @@
+/*
+ * End-to-end benchmark of the named pipe transport.
+ *
+ * Starts a named pipe server in-process, drives it from a number of client
+ * threads and reports calls/sec, latency percentiles and allocations per
+ * call (client and server side together).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+#include <jansson.h>
+
+#include <rpcsyncwerk.h>
+#include <rpcsyncwerk-named-pipe-transport.h>
+#include <rpcsyncwerk-loopback-transport.h>
+
+#include "bench-common.h"
+
+static int n_threads = 4;
+static int n_calls = 10000;
+static int n_warmup = 1000;
+static int payload_size = 100;
+static char *payload_name = "int";
+static char *mode_name = "threaded";
+static int n_io_threads = 0;
+static int n_pool_workers = 0;
+static gboolean pipelined = FALSE;
+static gboolean shared_client = FALSE;
+static int shm_ring_size = 0;
+static int shm_spin_us = 0;
+static int memfd_threshold = 0;
+static int pool_connections = 0;
+
+static GOptionEntry entries[] = {
+    { "threads", 't', 0, G_OPTION_ARG_INT, &n_threads, "Number of client threads", "N" },
+    { "calls", 'n', 0, G_OPTION_ARG_INT, &n_calls, "Calls per thread", "N" },
+    { "warmup", 'w', 0, G_OPTION_ARG_INT, &n_warmup, "Warmup calls per thread", "N" },
+    { "payload", 'p', 0, G_OPTION_ARG_STRING, &payload_name,
+      "Payload: int, string, object, objlist or json", "TYPE" },
+    { "size", 's', 0, G_OPTION_ARG_INT, &payload_size,
+      "String length, objlist length or json keys", "N" },
+    { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode_name, "Server mode: threaded, epoll, io_uring or loopback (in process, no server)", "MODE" },
+    { "io-threads", 0, 0, G_OPTION_ARG_INT, &n_io_threads, "I/O threads in epoll and io_uring modes", "N" },
+    { "pool", 0, 0, G_OPTION_ARG_INT, &n_pool_workers, "Dispatch pool workers, 0 for none", "N" },
+    { "pipelined", 0, 0, G_OPTION_ARG_NONE, &pipelined, "Use pipelined clients", NULL },
+    { "shared", 0, 0, G_OPTION_ARG_NONE, &shared_client,
+      "Share one pipelined client between all threads", NULL },
+    { "client-pool", 0, 0, G_OPTION_ARG_INT, &pool_connections,
+      "Share a pool of this many connections between all threads", "N" },
+    { "shm", 0, 0, G_OPTION_ARG_INT, &shm_ring_size,
+      "Use a shared memory channel with rings of this size", "BYTES" },
+    { "spin", 0, 0, G_OPTION_ARG_INT, &shm_spin_us,
+      "Spin before sleeping on the shared memory channel", "US" },
+    { "memfd", 0, 0, G_OPTION_ARG_INT, &memfd_threshold,
+      "Pass responses of at least this size in a memfd (pipelined clients)", "BYTES" },
+    { NULL },
+};
+
+typedef enum {
+    PAYLOAD_INT,
+    PAYLOAD_STRING,
+    PAYLOAD_OBJECT,
+    PAYLOAD_OBJLIST,
+    PAYLOAD_JSON,
+} PayloadType;
+
+static PayloadType payload_type;
+static char *string_payload;
+static json_t *json_payload;
+
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int n_ready;
+static gboolean started;
+
+typedef struct {
+    RpcsyncwerkClient *client;
+    gint64 *latencies;
+    int n_errors;
+} BenchThread;
+
+static gboolean
+do_call (RpcsyncwerkClient *client, int i)
+{
+    GError *error = NULL;
+    gboolean ok = TRUE;
+
+    switch (payload_type) {
+    case PAYLOAD_INT:
+        ok = rpcsyncwerk_client_call__int (client, "bench_int", &error,
+                                           1, "int", i) == i;
+        break;
+    case PAYLOAD_STRING: {
+        char *ret = rpcsyncwerk_client_call__string (client, "bench_string", &error,
+                                                     1, "string", string_payload);
+        ok = ret != NULL;
+        g_free (ret);
+        break;
+    }
+    case PAYLOAD_OBJECT: {
+        GObject *ret = rpcsyncwerk_client_call__object (client, "bench_object",
+                                                        BENCH_TYPE_OBJECT, &error,
+                                                        1, "int", i);
+        ok = ret != NULL;
+        if (ret)
+            g_object_unref (ret);
+        break;
+    }
+    case PAYLOAD_OBJLIST: {
+        GList *ret = rpcsyncwerk_client_call__objlist (client, "bench_objlist",
+                                                       BENCH_TYPE_OBJECT, &error,
+                                                       1, "int", payload_size);
+        GList *ptr;
+        ok = g_list_length (ret) == (guint)payload_size;
+        for (ptr = ret; ptr; ptr = ptr->next)
+            g_object_unref (ptr->data);
+        g_list_free (ret);
+        break;
+    }
+    case PAYLOAD_JSON: {
+        json_t *ret = rpcsyncwerk_client_call__json (client, "bench_json", &error,
+                                                     1, "json", json_payload);
+        ok = ret != NULL;
+        json_decref (ret);
+        break;
+    }
+    }
+
+    if (error) {
+        g_warning ("rpc call failed: %s\n", error->message);
+        g_error_free (error);
+        ok = FALSE;
+    }
+    return ok;
+}
+
+static void *
+bench_thread (void *arg)
+{
+    BenchThread *thread = arg;
+    int i;
+
+    for (i = 0; i < n_warmup; i++)
+        do_call (thread->client, i);
+
+    pthread_mutex_lock (&start_lock);
+    n_ready++;
+    pthread_cond_broadcast (&start_cond);
+    while (!started)
+        pthread_cond_wait (&start_cond, &start_lock);
+    pthread_mutex_unlock (&start_lock);
+
+    for (i = 0; i < n_calls; i++) {
+        gint64 start = bench_now_ns ();
+        if (!do_call (thread->client, i))
+            thread->n_errors++;
+        thread->latencies[i] = bench_now_ns () - start;
+    }
+
+    return NULL;
+}
+
+static RpcsyncwerkClient *
+create_client (const char *path)
+{
+    if (!path)
+        return rpcsyncwerk_client_with_loopback_transport (BENCH_SERVICE);
+
+    if (pool_connections > 0) {
+        RpcsyncwerkNamedPipeClientPool *pool =
+            rpcsyncwerk_create_named_pipe_client_pool (path, pool_connections);
+        rpcsyncwerk_named_pipe_client_pool_set_pipelined (pool, pipelined);
+        if (shm_ring_size > 0)
+            rpcsyncwerk_named_pipe_client_pool_set_shared_memory (pool, shm_ring_size, shm_spin_us);
+        return rpcsyncwerk_client_with_named_pipe_pool (pool, BENCH_SERVICE);
+    }
+
+    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client (path);
+
+    rpcsyncwerk_named_pipe_client_set_pipelined (pipe_client, pipelined);
+    if (shm_ring_size > 0)
+        rpcsyncwerk_named_pipe_client_set_shared_memory (pipe_client, shm_ring_size, shm_spin_us);
+    if (rpcsyncwerk_named_pipe_client_connect (pipe_client) < 0) {
+        fprintf (stderr, "failed to connect to %s\n", path);
+        exit (1);
+    }
+    return rpcsyncwerk_client_with_named_pipe_transport (pipe_client, BENCH_SERVICE);
+}
+
+static int
+parse_payload (const char *name)
+{
+    static const char *names[] = { "int", "string", "object", "objlist", "json" };
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(names); i++) {
+        if (strcmp (name, names[i]) == 0) {
+            payload_type = (PayloadType)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    RpcsyncwerkNamedPipeServerMode mode = RPCSYNCWERK_NAMED_PIPE_SERVER_THREADED;
+    gboolean loopback = FALSE;
+    BenchThread *threads;
+    pthread_t *tids;
+    int i;
+
+    bench_init ();
+
+    context = g_option_context_new ("- benchmark the named pipe transport");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        fprintf (stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (parse_payload (payload_name) < 0) {
+        fprintf (stderr, "unknown payload type %s\n", payload_name);
+        return 1;
+    }
+    if (strcmp (mode_name, "threaded") == 0) {
+        mode = RPCSYNCWERK_NAMED_PIPE_SERVER_THREADED;
+    } else if (strcmp (mode_name, "epoll") == 0) {
+        mode = RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL;
+    } else if (strcmp (mode_name, "io_uring") == 0) {
+        mode = RPCSYNCWERK_NAMED_PIPE_SERVER_IO_URING;
+    } else if (strcmp (mode_name, "loopback") == 0) {
+        loopback = TRUE;
+    } else {
+        fprintf (stderr, "unknown server mode %s\n", mode_name);
+        return 1;
+    }
+    if (shared_client)
+        pipelined = TRUE;
+    if (n_threads < 1 || n_calls < 1) {
+        fprintf (stderr, "need at least one thread and one call\n");
+        return 1;
+    }
+
+    string_payload = bench_make_string (payload_size);
+    json_payload = bench_make_json (payload_size);
+
+    /* server, the loopback clients call the functions directly */
+    char *path = NULL;
+    bench_start_rpc_service ();
+    if (!loopback) {
+        path = g_strdup_printf ("/tmp/rpcsyncwerk-bench-%d.sock", (int)getpid ());
+        RpcsyncwerkNamedPipeServer *server = rpcsyncwerk_create_named_pipe_server (path);
+        if (n_pool_workers > 0)
+            rpcsyncwerk_named_pipe_server_set_dispatch_pool (server, n_pool_workers, 0);
+        if (memfd_threshold > 0)
+            rpcsyncwerk_named_pipe_server_set_memfd_threshold (server, memfd_threshold);
+        if (rpcsyncwerk_named_pipe_server_start_with_mode (server, mode, n_io_threads) < 0) {
+            fprintf (stderr, "failed to start named pipe server\n");
+            return 1;
+        }
+    }
+
+    /* clients */
+    threads = g_new0 (BenchThread, n_threads);
+    tids = g_new0 (pthread_t, n_threads);
+    RpcsyncwerkClient *shared = (shared_client || pool_connections > 0) ? create_client (path) : NULL;
+    for (i = 0; i < n_threads; i++) {
+        threads[i].client = shared ? shared : create_client (path);
+        threads[i].latencies = g_new0 (gint64, n_calls);
+        pthread_create (&tids[i], NULL, bench_thread, &threads[i]);
+    }
+
+    pthread_mutex_lock (&start_lock);
+    while (n_ready < n_threads)
+        pthread_cond_wait (&start_cond, &start_lock);
+
+    BenchAllocStats allocs_before, allocs_after;
+    bench_alloc_snapshot (&allocs_before);
+    gint64 start = bench_now_ns ();
+
+    started = TRUE;
+    pthread_cond_broadcast (&start_cond);
+    pthread_mutex_unlock (&start_lock);
+
+    for (i = 0; i < n_threads; i++)
+        pthread_join (tids[i], NULL);
+
+    gint64 elapsed = bench_now_ns () - start;
+    bench_alloc_snapshot (&allocs_after);
+
+    /* report */
+    guint64 total = (guint64)n_threads * n_calls;
+    gint64 *latencies = g_new (gint64, total);
+    int n_errors = 0;
+    for (i = 0; i < n_threads; i++) {
+        memcpy (latencies + (gsize)i * n_calls, threads[i].latencies, n_calls * sizeof(gint64));
+        n_errors += threads[i].n_errors;
+    }
+
+    printf ("payload=%s size=%d threads=%d mode=%s io-threads=%d pool=%d pipelined=%s shared=%s "
+            "client-pool=%d shm=%d memfd=%d\n",
+            payload_name, payload_size, n_threads, mode_name, n_io_threads,
+            n_pool_workers, pipelined ? "yes" : "no", shared_client ? "yes" : "no",
+            pool_connections, shm_ring_size, memfd_threshold);
+    printf ("calls: %" G_GUINT64_FORMAT "  errors: %d  time: %.3f s  calls/sec: %.1f\n",
+            total, n_errors, elapsed / 1e9, total / (elapsed / 1e9));
+    bench_print_latency (latencies, total);
+    bench_print_allocs (&allocs_before, &allocs_after, total);
+    printf ("\n");
+
+    if (path)
+        g_unlink (path);
+    return n_errors ? 1 : 0;
+}
@@ -0,0 +1,12 @@
+"""
+Define RPC functions needed to generate
+"""
+
+# [ <ret-type>, [<arg_types>] ]
+func_table = [
+    [ "int", ["int"] ],
+    [ "string", ["string"] ],
+    [ "object", ["int"] ],
+    [ "objlist", ["int"] ],
+    [ "json", ["json"] ],
+]
@@ -25,6 +25,13 @@ rpcsyncwerk_client_fret__objlist (GType gtype, char *data,
 static json_t *
 rpcsyncwerk_client_fret__json (char *data, size_t len, GError **error);
 
+static void
+ret_from_object (json_t *object, const char *ret_type, GType gtype,
+                 void *ret_ptr, GError **error);
+
+static int
+handle_ret_common (char *data, size_t len, json_t **object, GError **error);
+
 
 static void clean_objlist(GList *list)
 {
@@ -50,6 +57,12 @@ rpcsyncwerk_client_free (RpcsyncwerkClient *client)
     g_free (client);
 }
 
+void
+rpcsyncwerk_client_set_timeout (RpcsyncwerkClient *client, int timeout_ms)
+{
+    client->timeout_ms = MAX(timeout_ms, 0);
+}
+
 char *
 rpcsyncwerk_client_transport_send (RpcsyncwerkClient *client,
                               const gchar *fcall_str,
@@ -60,8 +73,34 @@ rpcsyncwerk_client_transport_send (RpcsyncwerkClient *client,
                         fcall_len, ret_len);
 }
 
+/* Send the call, giving up after @timeout_ms if the transport supports
+ * deadlines. Sets @error when there is no response. */
 static char *
-fcall_to_str (const char *fname, int n_params, va_list args, gsize *len)
+client_send (RpcsyncwerkClient *client, const gchar *fcall_str,
+             size_t fcall_len, size_t *ret_len, int timeout_ms,
+             GError **error)
+{
+    gboolean timed_out = FALSE;
+    char *fret;
+
+    if (timeout_ms > 0 && client->send_with_deadline)
+        fret = client->send_with_deadline (client->arg, fcall_str, fcall_len, ret_len,
+                                           g_get_monotonic_time () + (gint64)timeout_ms * 1000,
+                                           &timed_out);
+    else
+        fret = client->send (client->arg, fcall_str, fcall_len, ret_len);
+
+    if (!fret) {
+        if (timed_out)
+            g_set_error (error, DFT_DOMAIN, TIMEOUT_ERROR_CODE, TIMEOUT_ERROR);
+        else
+            g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
+    }
+    return fret;
+}
+
+static json_t *
+fcall_to_array (const char *fname, int n_params, va_list args)
 {
     json_t *array;
     
@@ -83,10 +122,21 @@ fcall_to_str (const char *fname, int n_params, va_list args, gsize *len)
             json_array_add_json_or_null_element (array, (const json_t *)value);
         else {
             g_warning ("unrecognized parameter type %s\n", type);
+            json_decref (array);
             return NULL;
         }
     }
 
+    return array;
+}
+
+static char *
+fcall_to_str (const char *fname, int n_params, va_list args, gsize *len)
+{
+    json_t *array = fcall_to_array (fname, n_params, args);
+    if (!array)
+        return NULL;
+
     char *data = json_dumps (array,JSON_COMPACT);
     *len = strlen (data);
     json_decref(array);
@@ -94,31 +144,24 @@ fcall_to_str (const char *fname, int n_params, va_list args, gsize *len)
     return data;
 }
 
-void
-rpcsyncwerk_client_call (RpcsyncwerkClient *client, const char *fname,
-                    const char *ret_type, GType gobject_type,
-                    void *ret_ptr, GError **error,
-                    int n_params, ...)
+static void
+client_call_v (RpcsyncwerkClient *client, const char *fname,
+               const char *ret_type, GType gobject_type,
+               void *ret_ptr, int timeout_ms, GError **error,
+               int n_params, va_list args)
 {
-    g_return_if_fail (fname != NULL);
-    g_return_if_fail (ret_type != NULL);
-
-    va_list args;
     gsize len, ret_len;
     char *fstr;
 
-    va_start (args, n_params);
     fstr = fcall_to_str (fname, n_params, args, &len);
-    va_end (args);
     if (!fstr) {
         g_set_error (error, DFT_DOMAIN, 0, "Invalid Parameter");
         return;
     }
  
-    char *fret = rpcsyncwerk_client_transport_send (client, fstr, len, &ret_len);
+    char *fret = client_send (client, fstr, len, &ret_len, timeout_ms, error);
     if (!fret) {
         g_free (fstr);
-        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
         return;
     }
 
@@ -127,7 +170,7 @@ rpcsyncwerk_client_call (RpcsyncwerkClient *client, const char *fname,
     else if (strcmp(ret_type, "int64") == 0)
         *((gint64 *)ret_ptr) = rpcsyncwerk_client_fret__int64 (fret, ret_len, error);
     else if (strcmp(ret_type, "string") == 0)
-        *((char **)ret_ptr) = rpcsyncwerk_client_fret__string (fret, len, error);
+        *((char **)ret_ptr) = rpcsyncwerk_client_fret__string (fret, ret_len, error);
     else if (strcmp(ret_type, "object") == 0)
         *((GObject **)ret_ptr) = rpcsyncwerk_client_fret__object (gobject_type, fret,
                                                              ret_len, error);
@@ -143,6 +186,40 @@ rpcsyncwerk_client_call (RpcsyncwerkClient *client, const char *fname,
     g_free (fret);
 }
 
+void
+rpcsyncwerk_client_call (RpcsyncwerkClient *client, const char *fname,
+                    const char *ret_type, GType gobject_type,
+                    void *ret_ptr, GError **error,
+                    int n_params, ...)
+{
+    g_return_if_fail (fname != NULL);
+    g_return_if_fail (ret_type != NULL);
+
+    va_list args;
+
+    va_start (args, n_params);
+    client_call_v (client, fname, ret_type, gobject_type, ret_ptr,
+                   client->timeout_ms, error, n_params, args);
+    va_end (args);
+}
+
+void
+rpcsyncwerk_client_call_with_timeout (RpcsyncwerkClient *client, const char *fname,
+                                      const char *ret_type, GType gobject_type,
+                                      void *ret_ptr, int timeout_ms, GError **error,
+                                      int n_params, ...)
+{
+    g_return_if_fail (fname != NULL);
+    g_return_if_fail (ret_type != NULL);
+
+    va_list args;
+
+    va_start (args, n_params);
+    client_call_v (client, fname, ret_type, gobject_type, ret_ptr,
+                   timeout_ms, error, n_params, args);
+    va_end (args);
+}
+
 int
 rpcsyncwerk_client_call__int (RpcsyncwerkClient *client, const char *fname,
                          GError **error, int n_params, ...)
@@ -161,10 +238,9 @@ rpcsyncwerk_client_call__int (RpcsyncwerkClient *client, const char *fname,
         return 0;
     }
  
-    char *fret = rpcsyncwerk_client_transport_send (client, fstr, len, &ret_len);
+    char *fret = client_send (client, fstr, len, &ret_len, client->timeout_ms, error);
     if (!fret) {
         g_free (fstr);
-        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
         return 0;
     }
 
@@ -192,10 +268,9 @@ rpcsyncwerk_client_call__int64 (RpcsyncwerkClient *client, const char *fname,
         return 0;
     }
  
-    char *fret = rpcsyncwerk_client_transport_send (client, fstr, len, &ret_len);
+    char *fret = client_send (client, fstr, len, &ret_len, client->timeout_ms, error);
     if (!fret) {
         g_free (fstr);
-        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
         return 0;
     }
 
@@ -223,10 +298,9 @@ rpcsyncwerk_client_call__string (RpcsyncwerkClient *client, const char *fname,
         return NULL;
     }
  
-    char *fret = rpcsyncwerk_client_transport_send (client, fstr, len, &ret_len);
+    char *fret = client_send (client, fstr, len, &ret_len, client->timeout_ms, error);
     if (!fret) {
         g_free (fstr);
-        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
         return NULL;
     }
 
@@ -256,10 +330,9 @@ rpcsyncwerk_client_call__object (RpcsyncwerkClient *client, const char *fname,
         return NULL;
     }
  
-    char *fret = rpcsyncwerk_client_transport_send (client, fstr, len, &ret_len);
+    char *fret = client_send (client, fstr, len, &ret_len, client->timeout_ms, error);
     if (!fret) {
         g_free (fstr);
-        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
         return NULL;
     }
 
@@ -290,10 +363,9 @@ rpcsyncwerk_client_call__objlist (RpcsyncwerkClient *client, const char *fname,
         return NULL;
     }
 
-    char *fret = rpcsyncwerk_client_transport_send (client, fstr, len, &ret_len);
+    char *fret = client_send (client, fstr, len, &ret_len, client->timeout_ms, error);
     if (!fret) {
         g_free (fstr);
-        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
         return NULL;
     }
 
@@ -321,10 +393,9 @@ rpcsyncwerk_client_call__json (RpcsyncwerkClient *client, const char *fname,
         return NULL;
     }
 
-    char *fret = rpcsyncwerk_client_transport_send (client, fstr, len, &ret_len);
+    char *fret = client_send (client, fstr, len, &ret_len, client->timeout_ms, error);
     if (!fret) {
         g_free (fstr);
-        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
         return NULL;
     }
 
@@ -335,6 +406,277 @@ rpcsyncwerk_client_call__json (RpcsyncwerkClient *client, const char *fname,
 }
 
 
+struct _RpcsyncwerkClientObjStream {
+    RpcsyncwerkClient *client;
+    GType gtype;
+    /* the response with the current chunk in its "ret" array */
+    json_t *chunk;
+    size_t pos;
+    /* 0 once the server has sent the last chunk */
+    gint64 id;
+};
+
+/* Make the response @fret the current chunk of @stream. */
+static int
+obj_stream_load_chunk (RpcsyncwerkClientObjStream *stream, char *fret,
+                       size_t ret_len, GError **error)
+{
+    json_t *object;
+
+    if (handle_ret_common (fret, ret_len, &object, error) < 0) {
+        stream->id = 0;
+        return -1;
+    }
+
+    if (stream->chunk)
+        json_decref (stream->chunk);
+    stream->chunk = object;
+    stream->pos = 0;
+    stream->id = json_integer_value (json_object_get (object, "stream"));
+    return 0;
+}
+
+RpcsyncwerkClientObjStream *
+rpcsyncwerk_client_call__objstream (RpcsyncwerkClient *client, const char *fname,
+                               GType object_type,
+                               GError **error, int n_params, ...)
+{
+    g_return_val_if_fail (fname != NULL, NULL);
+    g_return_val_if_fail (object_type != 0, NULL);
+
+    va_list args;
+    gsize len, ret_len;
+    char *fstr;
+
+    va_start (args, n_params);
+    fstr = fcall_to_str (fname, n_params, args, &len);
+    va_end (args);
+    if (!fstr) {
+        g_set_error (error, DFT_DOMAIN, 0, "Invalid Parameter");
+        return NULL;
+    }
+
+    char *fret = client_send (client, fstr, len, &ret_len, client->timeout_ms, error);
+    g_free (fstr);
+    if (!fret)
+        return NULL;
+
+    RpcsyncwerkClientObjStream *stream = g_new0 (RpcsyncwerkClientObjStream, 1);
+    stream->client = client;
+    stream->gtype = object_type;
+    if (obj_stream_load_chunk (stream, fret, ret_len, error) < 0) {
+        g_free (stream);
+        stream = NULL;
+    }
+    g_free (fret);
+    return stream;
+}
+
+/* Send a request about the stream on the server. */
+static char *
+obj_stream_send (RpcsyncwerkClientObjStream *stream, gboolean close,
+                 size_t *ret_len, GError **error)
+{
+    char *request, *fret;
+
+    request = g_strdup_printf ("{\"stream\":%" G_GINT64_FORMAT "%s}", stream->id,
+                               close ? ",\"close\":true" : "");
+    fret = client_send (stream->client, request, strlen(request), ret_len,
+                        stream->client->timeout_ms, error);
+    g_free (request);
+    return fret;
+}
+
+GObject *
+rpcsyncwerk_client_obj_stream_next (RpcsyncwerkClientObjStream *stream, GError **error)
+{
+    json_t *items;
+    size_t ret_len;
+    char *fret;
+
+    while (1) {
+        items = json_object_get (stream->chunk, "ret");
+        if (stream->pos < json_array_size (items)) {
+            GObject *obj = json_gobject_deserialize (stream->gtype,
+                                                     json_array_get (items, stream->pos++));
+            if (obj == NULL)
+                g_set_error (error, DFT_DOMAIN, 503,
+                             "Invalid data: object stream contains null");
+            return obj;
+        }
+
+        if (stream->id == 0)
+            return NULL;
+
+        /* Drop the consumed chunk before pulling the next one. */
+        json_decref (stream->chunk);
+        stream->chunk = NULL;
+
+        fret = obj_stream_send (stream, FALSE, &ret_len, error);
+        if (!fret) {
+            stream->id = 0;
+            return NULL;
+        }
+        int ret = obj_stream_load_chunk (stream, fret, ret_len, error);
+        g_free (fret);
+        if (ret < 0)
+            return NULL;
+    }
+}
+
+void
+rpcsyncwerk_client_obj_stream_free (RpcsyncwerkClientObjStream *stream)
+{
+    size_t ret_len;
+
+    if (!stream)
+        return;
+
+    /* Let the server free the rest of the stream now. */
+    if (stream->id != 0)
+        g_free (obj_stream_send (stream, TRUE, &ret_len, NULL));
+
+    if (stream->chunk)
+        json_decref (stream->chunk);
+    g_free (stream);
+}
+
+typedef struct {
+    const char *ret_type;
+    GType gtype;
+    void *ret_ptr;
+    GError **error;
+} BatchCall;
+
+struct _RpcsyncwerkBatch {
+    /* the serialized calls, sent as one array */
+    json_t *calls;
+    /* where to store the results, a BatchCall for each call */
+    GArray *results;
+};
+
+RpcsyncwerkBatch *
+rpcsyncwerk_batch_new ()
+{
+    RpcsyncwerkBatch *batch = g_new0 (RpcsyncwerkBatch, 1);
+
+    batch->calls = json_array ();
+    batch->results = g_array_new (FALSE, FALSE, sizeof(BatchCall));
+    return batch;
+}
+
+void
+rpcsyncwerk_batch_free (RpcsyncwerkBatch *batch)
+{
+    if (!batch)
+        return;
+
+    json_decref (batch->calls);
+    g_array_free (batch->results, TRUE);
+    g_free (batch);
+}
+
+int
+rpcsyncwerk_batch_add (RpcsyncwerkBatch *batch, const char *fname,
+                       const char *ret_type, GType gobject_type,
+                       void *ret_ptr, GError **error,
+                       int n_params, ...)
+{
+    g_return_val_if_fail (fname != NULL, -1);
+    g_return_val_if_fail (ret_type != NULL, -1);
+
+    va_list args;
+    json_t *array;
+    BatchCall call;
+
+    va_start (args, n_params);
+    array = fcall_to_array (fname, n_params, args);
+    va_end (args);
+    if (!array)
+        return -1;
+
+    json_array_append_new (batch->calls, array);
+    call.ret_type = ret_type;
+    call.gtype = gobject_type;
+    call.ret_ptr = ret_ptr;
+    call.error = error;
+    g_array_append_val (batch->results, call);
+
+    return 0;
+}
+
+/* Fail all calls of @batch with @error. */
+static void
+batch_set_error (RpcsyncwerkBatch *batch, const GError *error)
+{
+    guint i;
+
+    for (i = 0; i < batch->results->len; i++) {
+        BatchCall *call = &g_array_index (batch->results, BatchCall, i);
+        g_set_error (call->error, error->domain, error->code, "%s", error->message);
+    }
+}
+
+int
+rpcsyncwerk_client_call_batch (RpcsyncwerkClient *client, RpcsyncwerkBatch *batch,
+                               GError **error)
+{
+    GError *batch_error = NULL;
+    gsize ret_len;
+    json_t *object = NULL;
+    json_t *rets;
+    json_error_t jerror;
+    guint i;
+
+    if (batch->results->len == 0)
+        return 0;
+
+    char *fstr = json_dumps (batch->calls, JSON_COMPACT);
+    char *fret = client_send (client, fstr, strlen(fstr), &ret_len,
+                              client->timeout_ms, &batch_error);
+    g_free (fstr);
+    if (!fret)
+        goto error;
+
+    object = json_loadb (fret, ret_len, 0, &jerror);
+    g_free (fret);
+    if (!object) {
+        setjetoge (&jerror, &batch_error);
+        goto error;
+    }
+
+    /* The whole batch failed, e.g. the service doesn't exist. */
+    if (json_object_get (object, "err_code")) {
+        g_set_error (&batch_error, DFT_DOMAIN,
+                     json_integer_value (json_object_get (object, "err_code")), "%s",
+                     json_string_value (json_object_get (object, "err_msg")));
+        goto error;
+    }
+
+    rets = json_object_get (object, "ret");
+    if (json_array_size (rets) != batch->results->len) {
+        g_set_error (&batch_error, DFT_DOMAIN, 503,
+                     "Invalid data: wrong number of results in batch");
+        goto error;
+    }
+
+    for (i = 0; i < batch->results->len; i++) {
+        BatchCall *call = &g_array_index (batch->results, BatchCall, i);
+        ret_from_object (json_array_get (rets, i), call->ret_type, call->gtype,
+                         call->ret_ptr, call->error);
+    }
+
+    json_decref (object);
+    return 0;
+
+error:
+    batch_set_error (batch, batch_error);
+    g_propagate_error (error, batch_error);
+    if (object)
+        json_decref (object);
+    return -1;
+}
+
 
 typedef struct {
     RpcsyncwerkClient *client;
@@ -392,7 +734,7 @@ rpcsyncwerk_client_generic_callback (char *retstr, size_t len,
             json_decref ((json_t *)result);
         }
     }
-    // g_free (data);
+    g_free (data);
 
     return 0;
 }
@@ -425,7 +767,10 @@ rpcsyncwerk_client_async_call_v (RpcsyncwerkClient *client,
 
     ret = client->async_send (client->async_arg, fstr, len, data);
 
-    g_free(data);
+    /* on success, the transport keeps data until it calls
+     * rpcsyncwerk_client_generic_callback(), which frees it */
+    if (ret < 0)
+        g_free(data);
     g_free(fstr);
 
     return ret;
@@ -545,6 +890,66 @@ rpcsyncwerk_client_async_call__json (RpcsyncwerkClient *client,
 }
 
 
+/* Returns -1 and sets @error if the response @object carries an error. */
+static int
+ret_object_error (json_t *object, GError **error)
+{
+    int err_code;
+    const char *err_msg;
+
+    if (!json_object_get (object, "err_code"))
+        return 0;
+
+    err_code = json_integer_value(json_object_get (object, "err_code"));
+    err_msg = json_string_value(json_object_get (object, "err_msg"));
+    g_set_error (error, DFT_DOMAIN,
+                 err_code, "%s", err_msg);
+    return -1;
+}
+
+static GObject *
+object_from_ret (GType gtype, json_t *member)
+{
+    if (json_is_null(member))
+        return NULL;
+
+    return json_gobject_deserialize(gtype, member);
+}
+
+static GList *
+objlist_from_ret (GType gtype, const json_t *array, GError **error)
+{
+    GList *ret = NULL;
+
+    if (json_is_null(array))
+        return NULL;
+
+    g_assert (array);
+
+    int i;
+    for (i = 0; i < json_array_size(array); i++) {
+        json_t *member = json_array_get (array, i);
+        GObject *obj = json_gobject_deserialize(gtype, member);
+        if (obj == NULL) {
+            g_set_error (error, DFT_DOMAIN, 503, 
+                         "Invalid data: object list contains null");
+            clean_objlist(ret);
+            return NULL;
+        }
+        ret = g_list_prepend (ret, obj);
+    }
+    return g_list_reverse(ret);
+}
+
+static json_t *
+json_from_ret (const json_t *ret_obj)
+{
+    if (!ret_obj || json_is_null(ret_obj))
+        return NULL;
+
+    return json_deep_copy(ret_obj);
+}
+
 /*
  * Returns -1 if error happens in parsing data or data contains error
  * message. In this case, the calling function should simply return
@@ -556,8 +961,6 @@ rpcsyncwerk_client_async_call__json (RpcsyncwerkClient *client,
 static int
 handle_ret_common (char *data, size_t len, json_t **object, GError **error)
 {
-    int err_code;
-    const char *err_msg;
     json_error_t jerror;
 
     g_return_val_if_fail (object != 0, -1);
@@ -569,11 +972,7 @@ handle_ret_common (char *data, size_t len, json_t **object, GError **error)
         return -1;
     }
 
-    if (json_object_get (*object, "err_code")) {
-        err_code = json_integer_value(json_object_get (*object, "err_code"));
-        err_msg = json_string_value(json_object_get (*object, "err_msg"));
-        g_set_error (error, DFT_DOMAIN,
-                     err_code, "%s", err_msg);
+    if (ret_object_error (*object, error) < 0) {
         json_decref (*object);
         return -1;
     }
@@ -633,16 +1032,9 @@ rpcsyncwerk_client_fret__object (GType gtype, char *data, size_t len, GError **e
 {
     json_t  *object = NULL;
     GObject *ret = NULL;
-    json_t  *member;
 
     if (handle_ret_common(data, len, &object, error) == 0) {
-        member = json_object_get (object, "ret");
-        if (json_is_null(member)) {
-            json_decref(object);
-            return NULL;
-        }
-        
-        ret = json_gobject_deserialize(gtype, member);
+        ret = object_from_ret (gtype, json_object_get (object, "ret"));
         json_decref(object);
         return ret;
     }
@@ -657,29 +1049,9 @@ rpcsyncwerk_client_fret__objlist (GType gtype, char *data, size_t len, GError **
     GList  *ret = NULL;
 
     if (handle_ret_common(data, len, &object, error) == 0) {
-        const json_t *array = json_object_get (object, "ret");
-        if (json_is_null(array)) {
-            json_decref(object);
-            return NULL;
-        }
-
-        g_assert (array);
-
-        int i;
-        for (i = 0; i < json_array_size(array); i++) {
-            json_t *member = json_array_get (array, i);
-            GObject *obj = json_gobject_deserialize(gtype, member);
-            if (obj == NULL) {
-                g_set_error (error, DFT_DOMAIN, 503, 
-                             "Invalid data: object list contains null");
-                clean_objlist(ret);
-                json_decref(object);
-                return NULL;
-            }
-            ret = g_list_prepend (ret, obj);
-        }
+        ret = objlist_from_ret (gtype, json_object_get (object, "ret"), error);
         json_decref(object);
-        return g_list_reverse(ret);
+        return ret;
     }
     return NULL;
 }
@@ -690,17 +1062,34 @@ rpcsyncwerk_client_fret__json (char *data, size_t len, GError **error)
     json_t *object = NULL;
 
     if (handle_ret_common(data, len, &object, error) == 0) {
-        const json_t *ret_obj = json_object_get (object, "ret");
-        if (!ret_obj || json_is_null(ret_obj)) {
-            json_decref(object);
-            return NULL;
-        }
-
-        g_assert (ret_obj);
-        json_t *ret = json_deep_copy(ret_obj);
-
+        json_t *ret = json_from_ret (json_object_get (object, "ret"));
         json_decref(object);
         return ret;
     }
     return NULL;
 }
+
+/* Store the result of the response @object of a call in @ret_ptr, as
+ * client_call_v() does. */
+static void
+ret_from_object (json_t *object, const char *ret_type, GType gtype,
+                 void *ret_ptr, GError **error)
+{
+    gboolean failed = (ret_object_error (object, error) < 0);
+    json_t *member = json_object_get (object, "ret");
+
+    if (strcmp(ret_type, "int") == 0)
+        *((int *)ret_ptr) = failed ? -1 : json_integer_value (member);
+    else if (strcmp(ret_type, "int64") == 0)
+        *((gint64 *)ret_ptr) = failed ? -1 : json_integer_value (member);
+    else if (strcmp(ret_type, "string") == 0)
+        *((char **)ret_ptr) = failed ? NULL : g_strdup (json_string_value (member));
+    else if (strcmp(ret_type, "object") == 0)
+        *((GObject **)ret_ptr) = failed ? NULL : object_from_ret (gtype, member);
+    else if (strcmp(ret_type, "objlist") == 0)
+        *((GList **)ret_ptr) = failed ? NULL : objlist_from_ret (gtype, member, error);
+    else if (strcmp(ret_type, "json") == 0)
+        *((json_t **)ret_ptr) = failed ? NULL : json_from_ret (member);
+    else
+        g_warning ("unrecognized return type %s\n", ret_type);
+}
@@ -12,11 +12,24 @@
 typedef char *(*TransportCB)(void *arg, const gchar *fcall_str,
                              size_t fcall_len, size_t *ret_len);
 
+/**
+ * Like TransportCB, but gives up waiting for the response at @deadline,
+ * in g_get_monotonic_time() microseconds, and sets @timed_out then. A
+ * @deadline of 0 means no deadline.
+ */
+typedef char *(*TransportDeadlineCB)(void *arg, const gchar *fcall_str,
+                                     size_t fcall_len, size_t *ret_len,
+                                     gint64 deadline, gboolean *timed_out);
+
 /**
  * @rpc_priv is used by the rpc_client to store information related to
  * this rpc call.
  * @fcall_str is an allocated string, and the sender should free it
  * when not needed.
+ *
+ * On success the transport must eventually complete the call by passing
+ * @rpc_priv to rpcsyncwerk_client_generic_callback(), possibly from
+ * another thread. On failure (a negative return) it must not.
  */
 typedef int (*AsyncTransportSend)(void *arg, gchar *fcall_str,
                                   size_t fcall_len, void *rpc_priv);
@@ -29,6 +42,11 @@ struct _RpcsyncwerkClient {
     
     AsyncTransportSend async_send;
     void *async_arg;
+
+    /* optional, called instead of send when the call has a deadline */
+    TransportDeadlineCB send_with_deadline;
+    /* default timeout of the synchronous calls, 0 for none */
+    int timeout_ms;
 };
 
 typedef struct _RpcsyncwerkClient RpcsyncwerkClient;
@@ -37,12 +55,30 @@ RpcsyncwerkClient *rpcsyncwerk_client_new ();
 
 void rpcsyncwerk_client_free (RpcsyncwerkClient *client);
 
+/**
+ * Fail the synchronous calls of @client with TIMEOUT_ERROR_CODE when
+ * they take longer than @timeout_ms. 0 disables the timeout. Only
+ * applies to transports that set send_with_deadline.
+ */
+void
+rpcsyncwerk_client_set_timeout (RpcsyncwerkClient *client, int timeout_ms);
+
 void
 rpcsyncwerk_client_call (RpcsyncwerkClient *client, const char *fname,
                     const char *ret_type, GType gobject_type,
                     void *ret_ptr, GError **error,
                     int n_params, ...);
 
+/**
+ * Like rpcsyncwerk_client_call(), with @timeout_ms instead of the
+ * default timeout of @client. 0 means no timeout.
+ */
+void
+rpcsyncwerk_client_call_with_timeout (RpcsyncwerkClient *client, const char *fname,
+                                      const char *ret_type, GType gobject_type,
+                                      void *ret_ptr, int timeout_ms, GError **error,
+                                      int n_params, ...);
+
 int
 rpcsyncwerk_client_call__int (RpcsyncwerkClient *client, const char *fname,
                          GError **error, int n_params, ...);
@@ -69,6 +105,73 @@ json_t *
 rpcsyncwerk_client_call__json (RpcsyncwerkClient *client, const char *fname,
                           GError **error, int n_params, ...);
 
+/**
+ * Reads the objects returned by a function of the "objstream" type. They
+ * are pulled from the server in chunks as they are read, so only one chunk
+ * is held at a time.
+ */
+typedef struct _RpcsyncwerkClientObjStream RpcsyncwerkClientObjStream;
+
+/**
+ * Call @fname, which returns an object stream. Returns NULL and sets
+ * @error on failure.
+ */
+RpcsyncwerkClientObjStream *
+rpcsyncwerk_client_call__objstream (RpcsyncwerkClient *client, const char *fname,
+                               GType object_type,
+                               GError **error, int n_params, ...);
+
+/**
+ * Returns the next object of @stream, or NULL at the end of the stream or
+ * with @error set on failure.
+ */
+GObject *
+rpcsyncwerk_client_obj_stream_next (RpcsyncwerkClientObjStream *stream,
+                                    GError **error);
+
+/**
+ * Free @stream. If it has not been read to the end, the server is told to
+ * drop the rest.
+ */
+void
+rpcsyncwerk_client_obj_stream_free (RpcsyncwerkClientObjStream *stream);
+
+/**
+ * A batch packs several calls into one request. The server runs them
+ * through the same functions as single calls and returns all results in
+ * one response, saving a round trip per call. Requires a server built with
+ * this version of the library.
+ */
+typedef struct _RpcsyncwerkBatch RpcsyncwerkBatch;
+
+RpcsyncwerkBatch *rpcsyncwerk_batch_new ();
+
+void rpcsyncwerk_batch_free (RpcsyncwerkBatch *batch);
+
+/**
+ * Add a call to @batch. The parameters are like those of
+ * rpcsyncwerk_client_call(); @ret_ptr and @error are set by
+ * rpcsyncwerk_client_call_batch() and must stay valid until then.
+ *
+ * Returns -1 if a parameter has an unknown type.
+ */
+int
+rpcsyncwerk_batch_add (RpcsyncwerkBatch *batch, const char *fname,
+                       const char *ret_type, GType gobject_type,
+                       void *ret_ptr, GError **error,
+                       int n_params, ...);
+
+/**
+ * Send the calls of @batch in one request. Each call gets its own result
+ * and error, a failed call doesn't fail the others.
+ *
+ * Returns -1 and sets @error if the batch as a whole failed, e.g. on a
+ * transport error. The errors of all calls are set to it then.
+ */
+int
+rpcsyncwerk_client_call_batch (RpcsyncwerkClient *client, RpcsyncwerkBatch *batch,
+                               GError **error);
+
 
 char* rpcsyncwerk_client_transport_send (RpcsyncwerkClient *client,
                                     const gchar *fcall_str,
@@ -117,7 +220,8 @@ rpcsyncwerk_client_async_call__json (RpcsyncwerkClient *client,
 
 
 /* called by the transport layer, the rpc layer should be able to
- * modify the str, but not take ownership of it */
+ * modify the str, but not take ownership of it. @vdata is the rpc_priv
+ * passed to async_send, and is freed by this function. */
 int
 rpcsyncwerk_client_generic_callback (char *retstr, size_t len,
                                 void *vdata, const char *errstr);
@@ -128,5 +232,9 @@ rpcsyncwerk_client_generic_callback (char *retstr, size_t len,
 #define TRANSPORT_ERROR  "Transport Error"
 #define TRANSPORT_ERROR_CODE 500
 
+/* set when the call didn't complete before its deadline */
+#define TIMEOUT_ERROR  "Timeout"
+#define TIMEOUT_ERROR_CODE 504
+
 
 #endif
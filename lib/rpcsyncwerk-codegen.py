@@ -5,6 +5,7 @@ Generate function define macros.
 """
 
 from __future__ import print_function
+import hashlib
 import string
 import sys
 import os
@@ -14,44 +15,59 @@ import os
 #          <function to get value from array>,
 #          <function to set value to the ret_object>,
 #          <function to set value to array>,
-#          <default_ret_value>)
+#          <default_ret_value>,
+#          <function to write the response for a ret value>)
 type_table = {
     "string": ("const char*",
                "char*",
                "json_array_get_string_or_null_element",
                "rpcsyncwerk_set_string_to_ret_object",
                "json_array_add_string_or_null_element",
-               "NULL"),
+               "NULL",
+               "rpcsyncwerk_marshal_string_ret"),
     "int": ("int",
             "int",
             "json_array_get_int_element",
             "rpcsyncwerk_set_int_to_ret_object",
             "json_array_add_int_element",
-            "-1"),
+            "-1",
+            "rpcsyncwerk_marshal_int_ret"),
     "int64": ("gint64",
               "gint64",
               "json_array_get_int_element",
               "rpcsyncwerk_set_int_to_ret_object",
               "json_array_add_int_element",
-              "-1"),
+              "-1",
+              "rpcsyncwerk_marshal_int_ret"),
     "object": ("GObject*",
                "GObject*",
                "",
                "rpcsyncwerk_set_object_to_ret_object",
                "",
-               "NULL"),
+               "NULL",
+               "rpcsyncwerk_marshal_object_ret"),
     "objlist": ("GList*",
                 "GList*",
                 "",
                 "rpcsyncwerk_set_objlist_to_ret_object",
                 "",
-                "NULL"),
+                "NULL",
+                "rpcsyncwerk_marshal_objlist_ret"),
     "json": ("const json_t*",
              "json_t*",
              "json_array_get_json_or_null_element",
              "rpcsyncwerk_set_json_to_ret_object",
              "json_array_add_json_or_null_element",
-             "NULL"),
+             "NULL",
+             "rpcsyncwerk_marshal_json_ret"),
+    # only a return type
+    "objstream": ("",
+                  "RpcsyncwerkObjStream*",
+                  "",
+                  "",
+                  "",
+                  "NULL",
+                  "rpcsyncwerk_marshal_objstream_ret"),
 }
 
 marshal_template = r"""
@@ -62,9 +78,7 @@ ${marshal_name} (void *func, json_t *param_array, gsize *ret_len)
 ${get_parameters}
     ${func_call}
 
-    json_t *object = json_object ();
     ${convert_ret}
-    return rpcsyncwerk_marshal_set_ret_common (object, ret_len, error);
 }
 """
 
@@ -100,13 +114,54 @@ def generate_marshal(ret_type, arg_types):
     func_call = "%s ret = ((%s)func) (%s);" % (ret_type_in_c, func_prototype,
                                               func_args)
 
-    convert_ret = "%s (object, ret);" % ret_type_item[3]
+    convert_ret = "return %s (ret, error, ret_len);" % ret_type_item[6]
 
     return template.substitute(marshal_name=marshal_name,
                                get_parameters=get_parameters,
                                func_call=func_call,
                                convert_ret=convert_ret)
 
+async_marshal_template = r"""
+static void
+${marshal_name} (void *func, json_t *param_array, RpcsyncwerkReply *reply)
+{
+${get_parameters}
+    ${func_call}
+}
+"""
+
+def generate_async_marshal(ret_type, arg_types):
+    template = string.Template(async_marshal_template)
+
+    if len(arg_types) == 0:
+        marshal_name = "async_marshal_" + ret_type + "__void"
+    else:
+        marshal_name = "async_marshal_" + ret_type + "__" + ('_'.join(arg_types))
+    get_parameters = ""
+    for i, arg_type in enumerate(arg_types):
+        type_item = type_table[arg_type]
+        stmt = "    %s param%d = %s (param_array, %d);\n" %(
+            type_item[0], i+1, type_item[2], i+1)
+        get_parameters += stmt
+
+    # the function replies later instead of returning the result, e.g.
+    # void (*)(const char*, int, RpcsyncwerkReply *)
+    func_prototype = "void (*)("
+    for arg_type in arg_types:
+        func_prototype += type_table[arg_type][0] + ", "
+    func_prototype += "RpcsyncwerkReply *)"
+
+    func_args = ""
+    for i in range(1, len(arg_types)+1):
+        func_args += "param%d, " % (i)
+    func_args += "reply"
+
+    func_call = "((%s)func) (%s);" % (func_prototype, func_args)
+
+    return template.substitute(marshal_name=marshal_name,
+                               get_parameters=get_parameters,
+                               func_call=func_call)
+
 def write_file(f, s):
     f.write(s)
     f.write('\n')
@@ -114,11 +169,13 @@ def write_file(f, s):
 def gen_marshal_functions(f):
     for item in func_table:
         write_file(f, generate_marshal(item[0], item[1]))
+        write_file(f, generate_async_marshal(item[0], item[1]))
 
 
 marshal_register_item = r"""
     {
-        rpcsyncwerk_server_register_marshal (${signature_name}(), ${marshal_name});
+        rpcsyncwerk_server_register_marshal_static (${signature_macro}, ${marshal_name});
+        rpcsyncwerk_server_register_async_marshal_static (${signature_macro}, async_${marshal_name});
     }
 """
 
@@ -128,15 +185,9 @@ def generate_marshal_register_item(ret_type, arg_types):
     else:
         marshal_name = "marshal_" + ret_type + "__" + ('_'.join(arg_types))
 
-    if len(arg_types) == 0:
-        signature_name = "rpcsyncwerk_signature_" + ret_type + "__void"
-    else:
-        signature_name = "rpcsyncwerk_signature_" + ret_type + "__" + (
-            '_'.join(arg_types))
-
     return string.Template(marshal_register_item).substitute(
         marshal_name=marshal_name,
-        signature_name=signature_name)
+        signature_macro=signature_macro_name(ret_type, arg_types))
 
 def gen_marshal_register_function(f):
     write_file(f, "static void register_marshals()""")
@@ -146,29 +197,36 @@ def gen_marshal_register_function(f):
     write_file(f,  "}")
 
 signature_template = r"""
+#define ${signature_macro} "${signature}"
+
 inline static gchar *
 ${signature_name}()
 {
-    return rpcsyncwerk_compute_signature (${args});
+    return g_strdup (${signature_macro});
 }
 """
 
-def generate_signature(ret_type, arg_types):
-    ret_type_item = type_table[ret_type]
-    ret_type_in_c = ret_type_item[1]
+def signature_macro_name(ret_type, arg_types):
+    if len(arg_types) == 0:
+        return "RPCSYNCWERK_SIGNATURE_" + ret_type.upper() + "__VOID"
+    return "RPCSYNCWERK_SIGNATURE_" + ret_type.upper() + "__" + (
+        '_'.join(arg_types).upper())
+
+def compute_signature(ret_type, arg_types):
+    """Same as rpcsyncwerk_compute_signature(), at generation time."""
+    return hashlib.md5(':'.join([ret_type] + arg_types).encode('utf-8')).hexdigest()
 
+def generate_signature(ret_type, arg_types):
     if len(arg_types) == 0:
         signature_name = "rpcsyncwerk_signature_" + ret_type + "__void"
     else:
         signature_name = "rpcsyncwerk_signature_" + ret_type + "__" + (
             '_'.join(arg_types))
 
-    args = "\"" + ret_type + "\"" + ", " + str(len(arg_types))
-    for arg_type in arg_types:
-        args += ", " + "\"" + arg_type + "\""
-
     template = string.Template(signature_template)
-    return template.substitute(signature_name=signature_name, args=args)
+    return template.substitute(signature_name=signature_name,
+                               signature_macro=signature_macro_name(ret_type, arg_types),
+                               signature=compute_signature(ret_type, arg_types))
 
 def gen_signature_list():
     with open('rpcsyncwerk-signature.h', 'w') as f:
@@ -0,0 +1,57 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "rpcsyncwerk-client.h"
+#include "rpcsyncwerk-server.h"
+#include "rpcsyncwerk-loopback-transport.h"
+
+static char *
+rpcsyncwerk_loopback_send (void *arg, const gchar *fcall_str,
+                           size_t fcall_len, size_t *ret_len)
+{
+    const char *service = arg;
+    gsize len;
+    char *ret;
+
+    // The server only reads the call, so there is no need to copy it.
+    ret = rpcsyncwerk_server_call_function (service, (gchar *)fcall_str,
+                                            fcall_len, &len);
+    *ret_len = len;
+    return ret;
+}
+
+static int
+rpcsyncwerk_loopback_async_send (void *arg, gchar *fcall_str,
+                                 size_t fcall_len, void *rpc_priv)
+{
+    size_t ret_len;
+    char *ret;
+
+    ret = rpcsyncwerk_loopback_send (arg, fcall_str, fcall_len, &ret_len);
+    rpcsyncwerk_client_generic_callback (ret, ret_len, rpc_priv, NULL);
+    g_free (ret);
+    return 0;
+}
+
+RpcsyncwerkClient *
+rpcsyncwerk_client_with_loopback_transport (const char *service)
+{
+    RpcsyncwerkClient *client = rpcsyncwerk_client_new ();
+    char *service_name = g_strdup (service);
+
+    client->send = rpcsyncwerk_loopback_send;
+    client->arg = service_name;
+    client->async_send = rpcsyncwerk_loopback_async_send;
+    client->async_arg = service_name;
+    return client;
+}
+
+void
+rpcsyncwerk_free_client_with_loopback_transport (RpcsyncwerkClient *client)
+{
+    g_free (client->arg);
+    rpcsyncwerk_client_free (client);
+}
@@ -0,0 +1,19 @@
+#ifndef RPCSYNCWERK_LOOPBACK_TRANSPORT_H
+#define RPCSYNCWERK_LOOPBACK_TRANSPORT_H
+
+#include <glib.h>
+
+#include <rpcsyncwerk-client.h>
+
+// In-process transport for a client living in the same process as the
+// server. A call is passed directly to rpcsyncwerk_server_call_function()
+// on the calling thread, without any socket, framing or request envelope.
+//
+// Asynchronous calls are run the same way, so their callback has been called
+// by the time rpcsyncwerk_client_async_call__*() returns.
+
+RpcsyncwerkClient * rpcsyncwerk_client_with_loopback_transport(const char *service);
+
+void rpcsyncwerk_free_client_with_loopback_transport (RpcsyncwerkClient *client);
+
+#endif // RPCSYNCWERK_LOOPBACK_TRANSPORT_H
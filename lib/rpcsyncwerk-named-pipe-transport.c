@@ -1,3 +1,7 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
@@ -7,9 +11,28 @@
   #include <sys/types.h>
   #include <sys/socket.h>
   #include <sys/un.h>
+  #include <sys/uio.h>
+  #include <poll.h>
   #include <unistd.h>
+  // Writes to a peer that went away fail with EPIPE instead of raising
+  // SIGPIPE. Without MSG_NOSIGNAL, client sockets are set SO_NOSIGPIPE.
+  #if !defined(MSG_NOSIGNAL)
+    #define MSG_NOSIGNAL 0
+  #endif
 #endif // !defined(WIN32)
 
+#if !defined(WIN32) && defined(HAVE_SYS_EPOLL_H)
+  #define RPCSYNCWERK_USE_EPOLL 1
+  #include <fcntl.h>
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+#endif
+
+#if defined(RPCSYNCWERK_USE_EPOLL) && defined(HAVE_LIBURING)
+  #define RPCSYNCWERK_USE_IO_URING 1
+  #include <liburing.h>
+#endif
+
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <jansson.h>
@@ -18,6 +41,7 @@
 #include "rpcsyncwerk-client.h"
 #include "rpcsyncwerk-server.h"
 #include "rpcsyncwerk-named-pipe-transport.h"
+#include "rpcsyncwerk-shm-ring.h"
 
 #if defined(WIN32)
 static const int kPipeBufSize = 1024;
@@ -35,42 +59,276 @@ static char* formatErrorMessage();
 static void* named_pipe_listen(void *arg);
 static void* named_pipe_client_handler(void *arg);
 static char* rpcsyncwerk_named_pipe_send(void *arg, const gchar *fcall_str, size_t fcall_len, size_t *ret_len);
-
-static char * request_to_json(const char *service, const char *fcall_str, size_t fcall_len);
-static int request_from_json (const char *content, size_t len, char **service, char **fcall_str);
+static char* rpcsyncwerk_named_pipe_send_with_deadline(void *arg, const gchar *fcall_str, size_t fcall_len,
+                                                       size_t *ret_len, gint64 deadline, gboolean *timed_out);
+static int rpcsyncwerk_named_pipe_async_send(void *arg, gchar *fcall_str, size_t fcall_len, void *rpc_priv);
+
+static char * request_to_json(const char *service, const char *fcall_str, size_t fcall_len,
+                              guint32 timeout_ms);
+static int request_from_json (const char *content, size_t len, char **service, char **fcall_str,
+                              guint32 *timeout_ms);
 static void json_object_set_string_member (json_t *object, const char *key, const char *value);
 static const char * json_object_get_string_member (json_t *object, const char *key);
 
 static ssize_t pipe_write_n(RpcsyncwerkNamedPipe fd, const void *vptr, size_t n);
 static ssize_t pipe_read_n(RpcsyncwerkNamedPipe fd, void *vptr, size_t n);
 
+#if defined(WIN32)
+typedef struct {
+    void *iov_base;
+    size_t iov_len;
+} PipeIOVec;
+#else
+typedef struct iovec PipeIOVec;
+#endif
+
+// Max number of buffers passed to one pipe_write_v() call.
+#define PIPE_MAX_IOV 64
+
+static int pipe_write_v(RpcsyncwerkNamedPipe fd, PipeIOVec *iov, int iovcnt);
+
+// Deadlines are in g_get_monotonic_time() microseconds, 0 means none. Waits
+// past the deadline fail with errno set to ETIMEDOUT.
+static int pipe_write_v_until(RpcsyncwerkNamedPipe fd, PipeIOVec *iov, int iovcnt,
+                              gint64 deadline);
+static int pipe_wait_readable(RpcsyncwerkNamedPipe fd, gint64 deadline);
+
+// Buffered reads from a pipe, so the length, header and body of a frame
+// usually come with a single system call. Bodies larger than the buffer are
+// read in place. Pipes on windows are unbuffered, their messages must be read
+// at once. Descriptors received along with the data are kept in order, until
+// the frames they are attached to take them.
+#define PIPE_READER_BUF_SIZE 16384
+#define PIPE_READER_MAX_FDS 8
+
+struct _RpcsyncwerkPipeReader {
+    RpcsyncwerkNamedPipe fd;
+    // Reads fail once it passes, see pipe_wait_readable().
+    gint64 deadline;
+    size_t start;
+    size_t end;
+    int fds[PIPE_READER_MAX_FDS];
+    int n_fds;
+    char buf[PIPE_READER_BUF_SIZE];
+};
+
+typedef struct _RpcsyncwerkPipeReader PipeReader;
+
+static PipeReader *pipe_reader_new(RpcsyncwerkNamedPipe fd);
+static void pipe_reader_free(PipeReader *reader);
+static ssize_t pipe_reader_read_n(PipeReader *reader, void *vptr, size_t n);
+
+// Wire format.
+//
+// A legacy frame is a native-endian guint32 payload length followed by the
+// payload. A versioned frame has the highest bit of the length set, and the
+// length covers a PipeFrameHeader followed by the payload. Versioned requests
+// carry an id that is echoed in their response, so a client can have many
+// requests in flight on one connection and the server may answer them in any
+// order. Legacy requests are still answered one at a time, in order.
+//
+// The payload of a legacy request is a JSON object with the service name and
+// the serialized call, see request_to_json(). A versioned request with
+// PIPE_FRAME_FLAG_SERVICE set instead starts with a one byte length and the
+// service name, followed by the serialized call as is, which saves escaping
+// the call into a JSON string and parsing it twice.
+//
+// With PIPE_FRAME_FLAG_RESOLVE, the service name is followed by a function
+// name instead, and the response is {"ret": handle}, see
+// rpcsyncwerk_server_resolve_function(). With PIPE_FRAME_FLAG_HANDLE, the
+// service name is followed by a guint32 handle and then the serialized call,
+// which is dispatched without looking up the service and function names.
+// With PIPE_FRAME_FLAG_DEADLINE, these are followed by a guint32 number of
+// milliseconds the client still waits for the response, and the server
+// doesn't call the function once they have passed, see
+// rpcsyncwerk_server_call_function_with_deadline(). A legacy request carries
+// them in a "timeout" member.
+//
+// A PIPE_FRAME_SHM_SETUP frame asks the server for a shared memory channel,
+// see rpcsyncwerk_named_pipe_client_set_shared_memory(). The descriptors of
+// the channel are attached to the response. Once it is set up the requests and
+// responses are exchanged as versioned frames through the channel, and the
+// socket is only watched for the other side going away.
+//
+// A versioned request with PIPE_FRAME_FLAG_MEMFD set tells the server the
+// client accepts large responses in a memfd, see
+// rpcsyncwerk_named_pipe_server_set_memfd_threshold(). The payload of a
+// response with the flag set is the guint64 size of the actual response, and
+// the sealed memfd holding it is attached to the frame.
+
+#define PIPE_FRAME_VERSIONED 0x80000000U
+#define PIPE_FRAME_VERSION 1
+
+enum {
+    PIPE_FRAME_REQUEST = 1,
+    PIPE_FRAME_RESPONSE = 2,
+    PIPE_FRAME_SHM_SETUP = 3,
+};
+
+#define PIPE_FRAME_TYPE_MASK(type) (1U << (type))
+
+enum {
+    PIPE_FRAME_FLAG_SERVICE = 1 << 0,
+    PIPE_FRAME_FLAG_HANDLE = 1 << 1,
+    PIPE_FRAME_FLAG_RESOLVE = 1 << 2,
+    PIPE_FRAME_FLAG_MEMFD = 1 << 3,
+    PIPE_FRAME_FLAG_DEADLINE = 1 << 4,
+};
+
+#define PIPE_FRAME_KNOWN_FLAGS (PIPE_FRAME_FLAG_SERVICE | PIPE_FRAME_FLAG_HANDLE | \
+                                PIPE_FRAME_FLAG_RESOLVE | PIPE_FRAME_FLAG_MEMFD | \
+                                PIPE_FRAME_FLAG_DEADLINE)
+#define PIPE_FRAME_MAX_SERVICE_LEN 255
+
+typedef struct {
+    guint8 version;
+    guint8 type;
+    guint16 flags;
+    guint32 request_id;
+} PipeFrameHeader;
+
+// Max length of the framing in front of a payload.
+#define PIPE_FRAME_MAX_PREFIX (sizeof(guint32) + sizeof(PipeFrameHeader))
+
+// Framing of a request, carried along to frame its response the same way.
 typedef struct {
+    gboolean versioned;
+    guint32 request_id;
+    guint16 flags;
+    guint8 type;
+} PipeFrameInfo;
+
+static const PipeFrameInfo kLegacyFrame = { FALSE, 0, 0, PIPE_FRAME_REQUEST };
+
+// Payload of a PIPE_FRAME_SHM_SETUP request.
+typedef struct {
+    guint32 ring_size;
+    guint32 spin_us;
+} PipeShmSetup;
+
+static size_t pipe_frame_encode_prefix(char *out, const PipeFrameInfo *info,
+                                       guint8 type, guint16 flags, gsize payload_len);
+static int pipe_frame_decode_header(const char **payload, guint32 *payload_len,
+                                    guint32 types, PipeFrameInfo *info);
+static int pipe_write_frame(RpcsyncwerkNamedPipe fd, const PipeFrameInfo *info,
+                            guint8 type, const char *buf, gsize buf_len);
+
+typedef struct _PipeConn PipeConn;
+static char* handle_rpc_request(PipeConn *conn, const PipeFrameInfo *info,
+                                const char *buf, guint32 len, gint64 received,
+                                gsize *ret_len, gboolean *deferred);
+static void dispatch_worker(gpointer data, gpointer user_data);
+
+#if defined(RPCSYNCWERK_USE_EPOLL)
+static int start_io_loops(RpcsyncwerkNamedPipeServer *server, int n_loops);
+static void io_loop_add_connection(RpcsyncwerkNamedPipeServer *server, int connfd);
+#endif
+#if defined(RPCSYNCWERK_USE_IO_URING)
+static int start_uring_loops(RpcsyncwerkNamedPipeServer *server, int n_loops);
+#endif
+
+// Default backoff between attempts to reconnect.
+#define PIPE_RECONNECT_MIN_MS 100
+#define PIPE_RECONNECT_MAX_MS 10000
+
+typedef struct {
+    // The connection of the client, or the pool it takes one from per call.
     RpcsyncwerkNamedPipeClient* client;
+    RpcsyncwerkNamedPipeClientPool *pool;
     char *service;
+    // Function name -> handle + 1, or 0 if the server has no handle for it.
+    // The handles were resolved on connections of handles_generation or
+    // older.
+    pthread_mutex_t handles_lock;
+    GHashTable *handles;
+    gint handles_generation;
+    // Names of the functions retried after a broken connection.
+    GHashTable *idempotent;
 } ClientTransportData;
 
-RpcsyncwerkClient*
-rpcsyncwerk_client_with_named_pipe_transport(RpcsyncwerkNamedPipeClient *pipe_client,
-                                        const char *service)
+static RpcsyncwerkClient *
+named_pipe_transport_client_new (RpcsyncwerkNamedPipeClient *pipe_client,
+                                 RpcsyncwerkNamedPipeClientPool *pool,
+                                 const char *service)
 {
     RpcsyncwerkClient *client= rpcsyncwerk_client_new();
     client->send = rpcsyncwerk_named_pipe_send;
+    client->send_with_deadline = rpcsyncwerk_named_pipe_send_with_deadline;
 
-    ClientTransportData *data = g_malloc(sizeof(ClientTransportData));
+    ClientTransportData *data = g_malloc0(sizeof(ClientTransportData));
     data->client = pipe_client;
+    data->pool = pool;
     data->service = g_strdup(service);
+    pthread_mutex_init(&data->handles_lock, NULL);
+    data->handles = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
     client->arg = data;
+    client->async_send = rpcsyncwerk_named_pipe_async_send;
+    client->async_arg = data;
     return client;
 }
 
+RpcsyncwerkClient*
+rpcsyncwerk_client_with_named_pipe_transport(RpcsyncwerkNamedPipeClient *pipe_client,
+                                        const char *service)
+{
+    return named_pipe_transport_client_new (pipe_client, NULL, service);
+}
+
+RpcsyncwerkClient *
+rpcsyncwerk_client_with_named_pipe_pool (RpcsyncwerkNamedPipeClientPool *pool,
+                                         const char *service)
+{
+    return named_pipe_transport_client_new (NULL, pool, service);
+}
+
 RpcsyncwerkNamedPipeClient* rpcsyncwerk_create_named_pipe_client(const char *path)
 {
     RpcsyncwerkNamedPipeClient *client = g_malloc0(sizeof(RpcsyncwerkNamedPipeClient));
     memcpy(client->path, path, strlen(path) + 1);
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->cond, NULL);
+    pthread_mutex_init(&client->write_lock, NULL);
+    client->next_request_id = 1;
+    client->pending_calls = g_hash_table_new (g_direct_hash, g_direct_equal);
     return client;
 }
 
+void rpcsyncwerk_named_pipe_client_set_pipelined(RpcsyncwerkNamedPipeClient *client,
+                                                 gboolean pipelined)
+{
+    client->pipelined = pipelined;
+}
+
+void rpcsyncwerk_named_pipe_client_set_reconnect(RpcsyncwerkNamedPipeClient *client,
+                                                 int min_delay_ms,
+                                                 int max_delay_ms)
+{
+    client->reconnect = TRUE;
+    client->reconnect_min_ms = min_delay_ms > 0 ? min_delay_ms : PIPE_RECONNECT_MIN_MS;
+    client->reconnect_max_ms = MAX(max_delay_ms > 0 ? max_delay_ms : PIPE_RECONNECT_MAX_MS,
+                                   client->reconnect_min_ms);
+}
+
+void rpcsyncwerk_named_pipe_client_set_shared_memory(RpcsyncwerkNamedPipeClient *client,
+                                                     guint32 ring_size,
+                                                     int spin_us)
+{
+#if !defined(RPCSYNCWERK_USE_SHM)
+    g_warning ("shared memory channels are not supported on this platform\n");
+#endif
+    client->shm_ring_size = ring_size;
+    client->shm_spin_us = spin_us;
+}
+
+void rpcsyncwerk_named_pipe_client_set_async_context(RpcsyncwerkNamedPipeClient *client,
+                                                     GMainContext *context)
+{
+    if (client->async_context)
+        g_main_context_unref (client->async_context);
+    client->async_context = context ? g_main_context_ref (context) : NULL;
+}
+
 RpcsyncwerkNamedPipeServer* rpcsyncwerk_create_named_pipe_server(const char *path)
 {
     RpcsyncwerkNamedPipeServer *server = g_malloc0(sizeof(RpcsyncwerkNamedPipeServer));
@@ -80,6 +338,30 @@ RpcsyncwerkNamedPipeServer* rpcsyncwerk_create_named_pipe_server(const char *pat
 
 int rpcsyncwerk_named_pipe_server_start(RpcsyncwerkNamedPipeServer *server)
 {
+    return rpcsyncwerk_named_pipe_server_start_with_mode (server,
+                                                          RPCSYNCWERK_NAMED_PIPE_SERVER_THREADED,
+                                                          0);
+}
+
+int rpcsyncwerk_named_pipe_server_start_with_mode(RpcsyncwerkNamedPipeServer *server,
+                                                  RpcsyncwerkNamedPipeServerMode mode,
+                                                  int n_io_threads)
+{
+#if !defined(RPCSYNCWERK_USE_IO_URING)
+    if (mode == RPCSYNCWERK_NAMED_PIPE_SERVER_IO_URING) {
+        g_warning ("io_uring is not supported in this build, fall back to epoll\n");
+        mode = RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL;
+    }
+#endif
+#if !defined(RPCSYNCWERK_USE_EPOLL)
+    if (mode == RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL) {
+        g_warning ("epoll is not supported on this platform, "
+                   "fall back to one thread per connection\n");
+        mode = RPCSYNCWERK_NAMED_PIPE_SERVER_THREADED;
+    }
+#endif
+    server->mode = mode;
+
 #if !defined(WIN32)
     int pipe_fd = socket (AF_UNIX, SOCK_STREAM, 0);
     const char *un_path = server->path;
@@ -129,15 +411,70 @@ int rpcsyncwerk_named_pipe_server_start(RpcsyncwerkNamedPipeServer *server)
 
 #endif // !defined(WIN32)
 
-    /* TODO: use glib thread pool */
+    if (server->max_dispatch_workers > 0) {
+        GError *error = NULL;
+        server->dispatch_pool = g_thread_pool_new (dispatch_worker, server,
+                                                   server->max_dispatch_workers,
+                                                   FALSE, &error);
+        if (!server->dispatch_pool) {
+            g_warning ("failed to create rpc dispatch pool: %s\n", error->message);
+            g_error_free (error);
+            goto failed;
+        }
+    }
+
+#if defined(RPCSYNCWERK_USE_EPOLL)
+    if (n_io_threads <= 0)
+        n_io_threads = g_get_num_processors ();
+#endif
+
+#if defined(RPCSYNCWERK_USE_IO_URING)
+    // The kernel may not support io_uring, or forbid it.
+    if (mode == RPCSYNCWERK_NAMED_PIPE_SERVER_IO_URING) {
+        if (start_uring_loops (server, n_io_threads) == 0)
+            return 0;
+        g_warning ("fall back to epoll\n");
+        mode = server->mode = RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL;
+    }
+#endif
+
+#if defined(RPCSYNCWERK_USE_EPOLL)
+    if (mode == RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL) {
+        if (start_io_loops (server, n_io_threads) < 0)
+            goto failed;
+    }
+#endif
+
     pthread_create(&server->listener_thread, NULL, named_pipe_listen, server);
     return 0;
 
-#if !defined(WIN32)
 failed:
+    if (server->dispatch_pool) {
+        g_thread_pool_free (server->dispatch_pool, TRUE, FALSE);
+        server->dispatch_pool = NULL;
+    }
+#if !defined(WIN32)
     close(pipe_fd);
+#endif
     return -1;
+}
+
+void rpcsyncwerk_named_pipe_server_set_dispatch_pool(RpcsyncwerkNamedPipeServer *server,
+                                                     int max_workers,
+                                                     int max_queued_requests)
+{
+    server->max_dispatch_workers = max_workers;
+    server->max_queued_requests = max_queued_requests;
+}
+
+void rpcsyncwerk_named_pipe_server_set_memfd_threshold(RpcsyncwerkNamedPipeServer *server,
+                                                       gsize threshold)
+{
+#if !defined(RPCSYNCWERK_USE_SHM)
+    if (threshold > 0)
+        g_warning ("memfd responses are not supported on this platform\n");
 #endif
+    server->memfd_threshold = threshold;
 }
 
 typedef struct {
@@ -151,12 +488,20 @@ static void* named_pipe_listen(void *arg)
 #if !defined(WIN32)
     while (1) {
         int connfd = accept (server->pipe_fd, NULL, 0);
+        if (connfd < 0) {
+            g_warning ("failed to accept pipe client: %s\n", strerror(errno));
+            continue;
+        }
+#if defined(RPCSYNCWERK_USE_EPOLL)
+        if (server->mode == RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL) {
+            io_loop_add_connection (server, connfd);
+            continue;
+        }
+#endif
         pthread_t *handler = g_malloc(sizeof(pthread_t));
         ServerHandlerData *data = g_malloc(sizeof(ServerHandlerData));
         data->server = server;
         data->connfd = connfd;
-        // TODO(low priority): Instead of using a thread to handle each client,
-        // use select(unix)/iocp(windows) to do it.
         pthread_create(handler, NULL, named_pipe_client_handler, data);
         server->handlers = g_list_append(server->handlers, handler);
     }
@@ -200,7 +545,7 @@ static void* named_pipe_listen(void *arg)
         data->server = server;
         data->connfd = connfd;
         // TODO(low priority): Instead of using a thread to handle each client,
-        // use select(unix)/iocp(windows) to do it.
+        // use iocp to do it.
         pthread_create(handler, NULL, named_pipe_client_handler, data);
         server->handlers = g_list_append(server->handlers, handler);
     }
@@ -208,200 +553,3133 @@ static void* named_pipe_listen(void *arg)
     return NULL;
 }
 
-static void* named_pipe_client_handler(void *arg)
+// A connection accepted by the server. Responses may be produced on a dispatch
+// worker thread, so connections are reference counted and the pipe is only
+// closed when the last reference is dropped.
+struct _PipeConn {
+    RpcsyncwerkNamedPipeServer *server;
+    RpcsyncwerkNamedPipe fd;
+    volatile gint refcount;
+
+    // Send the response of a request back to the client, taking ownership of
+    // @ret_str. A NULL @ret_str means the request was malformed and the
+    // connection should be dropped.
+    void (*send_response) (PipeConn *conn, const PipeFrameInfo *info,
+                           char *ret_str, gsize ret_len);
+    void (*free) (PipeConn *conn);
+};
+
+static PipeConn *
+pipe_conn_ref (PipeConn *conn)
 {
-    ServerHandlerData *data = arg;
-    // RpcsyncwerkNamedPipeServer *server = data->server;
-    RpcsyncwerkNamedPipe connfd = data->connfd;
+    g_atomic_int_inc (&conn->refcount);
+    return conn;
+}
 
-    guint32 len;
-    guint32 bufsize = 4096;
-    char *buf = g_malloc(bufsize);
+static void
+pipe_conn_unref (PipeConn *conn)
+{
+    if (g_atomic_int_dec_and_test (&conn->refcount))
+        conn->free (conn);
+}
 
-    g_debug ("start to serve on pipe client\n");
+static PipeReader *
+pipe_reader_new (RpcsyncwerkNamedPipe fd)
+{
+    PipeReader *reader = g_new (PipeReader, 1);
 
-    while (1) {
-        len = 0;
-        if (pipe_read_n(connfd, &len, sizeof(guint32)) < 0) {
-            g_warning("failed to read rpc request size: %s", strerror(errno));
-            break;
-        }
+    reader->fd = fd;
+    reader->deadline = 0;
+    reader->start = reader->end = 0;
+    reader->n_fds = 0;
+    return reader;
+}
 
-        if (len == 0) {
-            g_debug("EOF reached, pipe connection lost");
-            break;
-        }
+static void
+pipe_reader_free (PipeReader *reader)
+{
+    int i;
 
-        while (bufsize < len) {
-            bufsize *= 2;
-            buf = realloc(buf, bufsize);
-        }
+    if (!reader)
+        return;
+#if !defined(WIN32)
+    for (i = 0; i < reader->n_fds; i++)
+        close (reader->fds[i]);
+#endif
+    g_free (reader);
+}
 
-        if (pipe_read_n(connfd, buf, len) < 0 || len == 0) {
-            g_warning("failed to read rpc request: %s", strerror(errno));
-            g_free (buf);
-            break;
-        }
+#if defined(RPCSYNCWERK_USE_SHM)
+// Take the oldest descriptor received, or -1 if there is none.
+static int
+pipe_reader_take_fd (PipeReader *reader)
+{
+    int fd;
 
-        char *service, *body;
-        if (request_from_json (buf, len, &service, &body) < 0) {
-            break;
-        }
+    if (reader->n_fds == 0)
+        return -1;
+    fd = reader->fds[0];
+    reader->n_fds--;
+    memmove (reader->fds, reader->fds + 1, reader->n_fds * sizeof(int));
+    return fd;
+}
+#endif
+
+static void
+pipe_close (RpcsyncwerkNamedPipe fd)
+{
+#if !defined(WIN32)
+    close(fd);
+#else // !defined(WIN32)
+    DisconnectNamedPipe(fd);
+    CloseHandle(fd);
+#endif // !defined(WIN32)
+}
 
-        gsize ret_len;
-        char *ret_str = rpcsyncwerk_server_call_function (service, body, strlen(body), &ret_len);
-        g_free (service);
-        g_free (body);
+static char *
+error_response (int code, const char *msg, gsize *ret_len)
+{
+    json_t *object = json_object ();
+    char *ret_str;
 
-        len = (guint32)ret_len;
-        if (pipe_write_n(connfd, &len, sizeof(guint32)) < 0) {
-            g_warning("failed to send rpc response(%s): %s", ret_str, strerror(errno));
-            g_free (ret_str);
-            break;
-        }
+    json_object_set_new (object, "err_code", json_integer ((json_int_t)code));
+    json_object_set_string_member (object, "err_msg", msg);
+    ret_str = json_dumps (object, JSON_COMPACT);
+    json_decref (object);
 
-        if (pipe_write_n(connfd, ret_str, ret_len) < 0) {
-            g_warning("failed to send rpc response: %s", strerror(errno));
-            g_free (ret_str);
-            break;
-        }
+    *ret_len = strlen(ret_str);
+    return ret_str;
+}
+
+typedef struct {
+    PipeConn *conn;
+    PipeFrameInfo info;
+    char *request;
+    guint32 len;
+    // When the request was read, which its timeout counts from.
+    gint64 received;
+} DispatchJob;
+
+static void
+dispatch_worker (gpointer data, gpointer user_data)
+{
+    DispatchJob *job = data;
+    gsize ret_len = 0;
+    gboolean deferred;
+    char *ret_str;
+
+    ret_str = handle_rpc_request (job->conn, &job->info, job->request, job->len,
+                                  job->received, &ret_len, &deferred);
+    if (!deferred)
+        job->conn->send_response (job->conn, &job->info, ret_str, ret_len);
+
+    pipe_conn_unref (job->conn);
+    g_free (job->request);
+    g_free (job);
+}
 
-        g_free (ret_str);
+// Handle a request read from @conn. Without a dispatch pool the RPC function
+// runs on the calling thread, otherwise the request is copied and queued to
+// the pool. Either way the response is delivered by conn->send_response(),
+// later for asynchronous functions.
+static void
+dispatch_request (PipeConn *conn, const PipeFrameInfo *info,
+                  const char *buf, guint32 len)
+{
+    RpcsyncwerkNamedPipeServer *server = conn->server;
+    gint64 received = g_get_monotonic_time ();
+    gsize ret_len = 0;
+    gboolean deferred;
+    char *ret_str;
+
+    if (!server->dispatch_pool) {
+        ret_str = handle_rpc_request (conn, info, buf, len, received, &ret_len, &deferred);
+        if (!deferred)
+            conn->send_response (conn, info, ret_str, ret_len);
+        return;
     }
 
-#if !defined(WIN32)
-    close(connfd);
-#else // !defined(WIN32)
-    DisconnectNamedPipe(connfd);
-    CloseHandle(connfd);
-#endif // !defined(WIN32)
+    if (server->max_queued_requests > 0 &&
+        g_thread_pool_unprocessed (server->dispatch_pool) >= (guint)server->max_queued_requests) {
+        ret_str = error_response (SERVER_BUSY_ERROR_CODE, SERVER_BUSY_ERROR, &ret_len);
+        conn->send_response (conn, info, ret_str, ret_len);
+        return;
+    }
 
-    return NULL;
+    DispatchJob *job = g_new0 (DispatchJob, 1);
+    job->conn = pipe_conn_ref (conn);
+    job->info = *info;
+    job->request = g_memdup (buf, len);
+    job->len = len;
+    job->received = received;
+    g_thread_pool_push (server->dispatch_pool, job, NULL);
 }
 
-
-int rpcsyncwerk_named_pipe_client_connect(RpcsyncwerkNamedPipeClient *client)
+static size_t
+pipe_frame_encode_prefix (char *out, const PipeFrameInfo *info,
+                          guint8 type, guint16 flags, gsize payload_len)
 {
-#if !defined(WIN32)
-    client->pipe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    struct sockaddr_un servaddr;
-    servaddr.sun_family = AF_UNIX;
+    PipeFrameHeader hdr;
+    guint32 len;
 
-    g_strlcpy (servaddr.sun_path, client->path, sizeof(servaddr.sun_path));
-    if (connect(client->pipe_fd, (struct sockaddr *)&servaddr, (socklen_t)sizeof(servaddr)) < 0) {
-        g_warning ("pipe client failed to connect to server: %s\n", strerror(errno));
-        return -1;
+    if (!info->versioned) {
+        len = (guint32)payload_len;
+        memcpy (out, &len, sizeof(guint32));
+        return sizeof(guint32);
     }
 
-#else // !defined(WIN32)
-    RpcsyncwerkNamedPipe pipe_fd;
-    pipe_fd = CreateFile(
-        client->path,           // pipe name
-        GENERIC_READ |          // read and write access
-        GENERIC_WRITE,
-        0,                      // no sharing
-        NULL,                   // default security attributes
-        OPEN_EXISTING,          // opens existing pipe
-        0,                      // default attributes
-        NULL);                  // no template file
+    hdr.version = PIPE_FRAME_VERSION;
+    hdr.type = type;
+    hdr.flags = flags;
+    hdr.request_id = info->request_id;
 
-    if (pipe_fd == INVALID_HANDLE_VALUE) {
-        G_WARNING_WITH_LAST_ERROR("Failed to connect to named pipe");
+    len = (guint32)(sizeof(hdr) + payload_len) | PIPE_FRAME_VERSIONED;
+    memcpy (out, &len, sizeof(guint32));
+    memcpy (out + sizeof(guint32), &hdr, sizeof(hdr));
+    return sizeof(guint32) + sizeof(hdr);
+}
+
+// Parse the header at the start of a versioned frame, and advance @payload
+// past it. @types is the mask of the frame types accepted.
+static int
+pipe_frame_decode_header (const char **payload, guint32 *payload_len,
+                          guint32 types, PipeFrameInfo *info)
+{
+    PipeFrameHeader hdr;
+
+    if (*payload_len < sizeof(hdr)) {
+        g_warning ("rpc frame too short\n");
         return -1;
     }
 
-    DWORD mode = PIPE_READMODE_MESSAGE;
-    if (!SetNamedPipeHandleState(pipe_fd, &mode, NULL, NULL)) {
-        G_WARNING_WITH_LAST_ERROR("Failed to set named pipe mode");
+    memcpy (&hdr, *payload, sizeof(hdr));
+    if (hdr.version != PIPE_FRAME_VERSION || hdr.type >= 32 ||
+        !(types & PIPE_FRAME_TYPE_MASK(hdr.type)) ||
+        (hdr.flags & ~PIPE_FRAME_KNOWN_FLAGS) != 0) {
+        g_warning ("unsupported rpc frame version %d type %d flags %x\n",
+                   hdr.version, hdr.type, hdr.flags);
         return -1;
     }
 
-    client->pipe_fd = pipe_fd;
+    info->versioned = TRUE;
+    info->request_id = hdr.request_id;
+    info->flags = hdr.flags;
+    info->type = hdr.type;
+    *payload += sizeof(hdr);
+    *payload_len -= sizeof(hdr);
+    return 0;
+}
 
-#endif // !defined(WIN32)
+// A versioned request, see the PIPE_FRAME_FLAG_* flags.
+typedef struct {
+    guint16 flags;
+    const char *service;
+    guint32 handle;
+    const char *body;
+    gsize body_len;
+    // Connection generation the handle was resolved for.
+    gint generation;
+    // When the caller stops waiting for the response, 0 for never.
+    gint64 deadline;
+} PipeRequest;
+
+// Max length of the framing and the service header in front of a request.
+#define PIPE_REQUEST_MAX_PREFIX (PIPE_FRAME_MAX_PREFIX + 1 + PIPE_FRAME_MAX_SERVICE_LEN + \
+                                 2 * sizeof(guint32))
+
+// Milliseconds left until @deadline, rounded up, or 0 for no deadline.
+static guint32
+pipe_deadline_timeout_ms (gint64 deadline)
+{
+    gint64 left;
 
-    g_debug ("pipe client connected to server\n");
-    return 0;
+    if (deadline <= 0)
+        return 0;
+    left = (deadline - g_get_monotonic_time () + 999) / 1000;
+    return (guint32)CLAMP(left, 1, G_MAXUINT32);
 }
 
-void rpcsyncwerk_free_client_with_pipe_transport (RpcsyncwerkClient *client)
+// Encode the framing of a versioned request carrying the service name in its
+// header, up to the serialized call.
+static size_t
+pipe_encode_request_prefix (char *prefix, const PipeFrameInfo *info,
+                            const PipeRequest *req)
 {
-    ClientTransportData *data = (ClientTransportData *)(client->arg);
-    RpcsyncwerkNamedPipeClient *pipe_client = data->client;
-#if defined(WIN32)
-    CloseHandle(pipe_client->pipe_fd);
-#else
-    close(pipe_client->pipe_fd);
+    size_t svc_len = strlen(req->service);
+    size_t hdr_len = 1 + svc_len;
+    size_t prefix_len;
+    guint16 flags;
+    char *p;
+
+    flags = req->flags | PIPE_FRAME_FLAG_SERVICE;
+#if defined(RPCSYNCWERK_USE_SHM)
+    flags |= PIPE_FRAME_FLAG_MEMFD;
 #endif
-    g_free (pipe_client);
-    g_free (data);
-    rpcsyncwerk_client_free (client);
+    if (req->deadline > 0)
+        flags |= PIPE_FRAME_FLAG_DEADLINE;
+
+    if (flags & PIPE_FRAME_FLAG_HANDLE)
+        hdr_len += sizeof(guint32);
+    if (flags & PIPE_FRAME_FLAG_DEADLINE)
+        hdr_len += sizeof(guint32);
+    prefix_len = pipe_frame_encode_prefix (prefix, info, PIPE_FRAME_REQUEST,
+                                           flags, hdr_len + req->body_len);
+
+    p = prefix + prefix_len;
+    *p++ = (char)svc_len;
+    memcpy (p, req->service, svc_len);
+    p += svc_len;
+    if (flags & PIPE_FRAME_FLAG_HANDLE) {
+        memcpy (p, &req->handle, sizeof(guint32));
+        p += sizeof(guint32);
+    }
+    if (flags & PIPE_FRAME_FLAG_DEADLINE) {
+        // Relative, the clocks of the two sides may not agree.
+        guint32 timeout_ms = pipe_deadline_timeout_ms (req->deadline);
+        memcpy (p, &timeout_ms, sizeof(guint32));
+    }
+    return prefix_len + hdr_len;
 }
 
-char *rpcsyncwerk_named_pipe_send(void *arg, const gchar *fcall_str,
-                             size_t fcall_len, size_t *ret_len)
+static int
+pipe_write_request (RpcsyncwerkNamedPipe fd, const PipeFrameInfo *info,
+                    const PipeRequest *req)
 {
-    g_debug ("rpcsyncwerk_named_pipe_send is called\n");
-    ClientTransportData *data = arg;
-    RpcsyncwerkNamedPipeClient *client = data->client;
-
-    char *json_str = request_to_json(data->service, fcall_str, fcall_len);
-    guint32 len = (guint32)strlen(json_str);
+    char prefix[PIPE_REQUEST_MAX_PREFIX];
+    PipeIOVec iov[2];
+
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = pipe_encode_request_prefix (prefix, info, req);
+    iov[1].iov_base = (void *)req->body;
+    iov[1].iov_len = req->body_len;
+    return pipe_write_v_until (fd, iov, 2, req->deadline);
+}
 
-    if (pipe_write_n(client->pipe_fd, &len, sizeof(guint32)) < 0) {
-        g_warning("failed to send rpc call: %s", strerror(errno));
-        free (json_str);
-        return NULL;
-    }
+static int
+pipe_write_frame (RpcsyncwerkNamedPipe fd, const PipeFrameInfo *info,
+                  guint8 type, const char *buf, gsize buf_len)
+{
+    char prefix[PIPE_FRAME_MAX_PREFIX];
+    PipeIOVec iov[2];
+
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = pipe_frame_encode_prefix (prefix, info, type, 0, buf_len);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = buf_len;
+    return pipe_write_v (fd, iov, 2);
+}
 
-    if (pipe_write_n(client->pipe_fd, json_str, len) < 0) {
-        g_warning("failed to send rpc call: %s", strerror(errno));
-        free (json_str);
-        return NULL;
-    }
+// Max number of pipelined requests handled at the same time for a connection.
+static const int kMaxInFlightRequests = 128;
 
-    free (json_str);
+// Connection served by its own thread in RPCSYNCWERK_NAMED_PIPE_SERVER_THREADED
+// mode. The handler thread reads the requests, responses are written by
+// whichever thread ran the request. Responses finished while another thread
+// is writing are queued, and that thread writes them all at once.
+typedef struct {
+    PipeConn base;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int in_flight;
+    gboolean broken;
+    gboolean writing;
+    GQueue responses;
+} ThreadedConn;
 
-    if (pipe_read_n(client->pipe_fd, &len, sizeof(guint32)) < 0) {
-        g_warning("failed to read rpc response: %s", strerror(errno));
-        return NULL;
-    }
+typedef struct {
+    char prefix[PIPE_FRAME_MAX_PREFIX];
+    size_t prefix_len;
+    char *ret_str;
+    gsize ret_len;
+    // Memfd holding the response, attached to the frame.
+    int fd;
+} PipeResponse;
+
+#if defined(RPCSYNCWERK_USE_SHM)
+
+// Move a response of at least server->memfd_threshold bytes to a sealed
+// memfd, if the client accepts them. The response is replaced by the payload
+// of the frame carrying the memfd. Returns the memfd, or -1 if the response
+// is to be sent as is.
+static int
+pipe_response_to_memfd (RpcsyncwerkNamedPipeServer *server, const PipeFrameInfo *info,
+                        char **ret_str, gsize *ret_len)
+{
+    guint64 size = *ret_len;
+    int fd;
 
-    char *buf = g_malloc(len);
+    if (!*ret_str || server->memfd_threshold == 0 ||
+        !(info->flags & PIPE_FRAME_FLAG_MEMFD) || *ret_len < server->memfd_threshold)
+        return -1;
 
-    if (pipe_read_n(client->pipe_fd, buf, len) < 0) {
-        g_warning("failed to read rpc response: %s", strerror(errno));
-        g_free (buf);
-        return NULL;
-    }
+    fd = rpcsyncwerk_shm_payload_create (*ret_str, *ret_len);
+    if (fd < 0)
+        return -1;
 
-    *ret_len = len;
-    return buf;
+    g_free (*ret_str);
+    *ret_str = g_malloc (sizeof(size));
+    memcpy (*ret_str, &size, sizeof(size));
+    *ret_len = sizeof(size);
+    return fd;
 }
 
-static char *
-request_to_json (const char *service, const char *fcall_str, size_t fcall_len)
+// Write a response frame with its memfd attached to it.
+static int
+pipe_write_memfd_response (RpcsyncwerkNamedPipe fd, const PipeResponse *resp)
 {
-    json_t *object = json_object ();
-
-    char *temp_request = g_malloc0(fcall_len + 1);
-    memcpy(temp_request, fcall_str, fcall_len);
-
-    json_object_set_string_member (object, "service", service);
-    json_object_set_string_member (object, "request", temp_request);
+    char frame[PIPE_FRAME_MAX_PREFIX + sizeof(guint64)];
+    size_t len = resp->prefix_len + resp->ret_len;
+    gssize n;
+
+    memcpy (frame, resp->prefix, resp->prefix_len);
+    memcpy (frame + resp->prefix_len, resp->ret_str, resp->ret_len);
+    n = rpcsyncwerk_shm_send_some (fd, frame, len, &resp->fd, 1);
+    if (n <= 0)
+        return -1;
+    return pipe_write_n (fd, frame + n, len - n) < 0 ? -1 : 0;
+}
 
-    g_free (temp_request);
+#else
 
-    char *str = json_dumps (object, 0);
-    json_decref (object);
-    return str;
+static int
+pipe_response_to_memfd (RpcsyncwerkNamedPipeServer *server, const PipeFrameInfo *info,
+                        char **ret_str, gsize *ret_len)
+{
+    return -1;
 }
 
 static int
-request_from_json (const char *content, size_t len, char **service, char **fcall_str)
+pipe_write_memfd_response (RpcsyncwerkNamedPipe fd, const PipeResponse *resp)
 {
-    json_error_t jerror;
-    json_t *object = json_loadb(content, len, 0, &jerror);
+    return -1;
+}
+
+#endif // defined(RPCSYNCWERK_USE_SHM)
+
+static void
+pipe_response_free (PipeResponse *resp)
+{
+#if defined(RPCSYNCWERK_USE_SHM)
+    if (resp->fd >= 0)
+        close (resp->fd);
+#endif
+    g_free (resp->ret_str);
+    g_free (resp);
+}
+
+// Write the queued responses with as few system calls as possible.
+static int
+pipe_write_responses (RpcsyncwerkNamedPipe fd, GQueue *responses)
+{
+    PipeIOVec iov[PIPE_MAX_IOV];
+    int iovcnt = 0;
+    GList *ptr;
+
+    for (ptr = responses->head; ptr; ptr = ptr->next) {
+        PipeResponse *resp = ptr->data;
+
+        // A memfd goes with a frame of its own.
+        if (resp->fd >= 0) {
+            if (iovcnt > 0 && pipe_write_v (fd, iov, iovcnt) < 0)
+                return -1;
+            iovcnt = 0;
+            if (pipe_write_memfd_response (fd, resp) < 0)
+                return -1;
+            continue;
+        }
+
+        iov[iovcnt].iov_base = resp->prefix;
+        iov[iovcnt].iov_len = resp->prefix_len;
+        iov[iovcnt + 1].iov_base = resp->ret_str;
+        iov[iovcnt + 1].iov_len = resp->ret_len;
+        iovcnt += 2;
+
+        if (iovcnt == PIPE_MAX_IOV) {
+            if (pipe_write_v (fd, iov, iovcnt) < 0)
+                return -1;
+            iovcnt = 0;
+        }
+    }
+
+    if (iovcnt > 0 && pipe_write_v (fd, iov, iovcnt) < 0)
+        return -1;
+    return 0;
+}
+
+static void
+threaded_conn_send_response (PipeConn *conn, const PipeFrameInfo *info,
+                             char *ret_str, gsize ret_len)
+{
+    ThreadedConn *tconn = (ThreadedConn *)conn;
+    PipeResponse *resp;
+    int fd = pipe_response_to_memfd (conn->server, info, &ret_str, &ret_len);
+
+    pthread_mutex_lock (&tconn->lock);
+    if (!ret_str) {
+        tconn->broken = TRUE;
+        tconn->in_flight--;
+        pthread_cond_signal (&tconn->cond);
+        pthread_mutex_unlock (&tconn->lock);
+        return;
+    }
+
+    resp = g_new0 (PipeResponse, 1);
+    resp->prefix_len = pipe_frame_encode_prefix (resp->prefix, info, PIPE_FRAME_RESPONSE,
+                                                 fd >= 0 ? PIPE_FRAME_FLAG_MEMFD : 0,
+                                                 ret_len);
+    resp->ret_str = ret_str;
+    resp->ret_len = ret_len;
+    resp->fd = fd;
+    g_queue_push_tail (&tconn->responses, resp);
+
+    if (tconn->writing) {
+        pthread_mutex_unlock (&tconn->lock);
+        return;
+    }
+
+    // Requests only count as done once their responses are written, so the
+    // handler thread doesn't write to the connection at the same time.
+    tconn->writing = TRUE;
+    while (!g_queue_is_empty (&tconn->responses)) {
+        GQueue batch = tconn->responses;
+        gboolean broken = tconn->broken;
+
+        g_queue_init (&tconn->responses);
+        pthread_mutex_unlock (&tconn->lock);
+
+        if (!broken && pipe_write_responses (conn->fd, &batch) < 0) {
+            g_warning("failed to send rpc response: %s", strerror(errno));
+            broken = TRUE;
+        }
+
+        pthread_mutex_lock (&tconn->lock);
+        tconn->in_flight -= batch.length;
+        if (broken)
+            tconn->broken = TRUE;
+        pthread_cond_signal (&tconn->cond);
+        pthread_mutex_unlock (&tconn->lock);
+
+        while ((resp = g_queue_pop_head (&batch)) != NULL)
+            pipe_response_free (resp);
+
+        pthread_mutex_lock (&tconn->lock);
+    }
+    tconn->writing = FALSE;
+    pthread_mutex_unlock (&tconn->lock);
+}
+
+static void
+threaded_conn_free (PipeConn *conn)
+{
+    ThreadedConn *tconn = (ThreadedConn *)conn;
+
+    pipe_close (conn->fd);
+    pthread_mutex_destroy (&tconn->lock);
+    pthread_cond_destroy (&tconn->cond);
+    g_free (tconn);
+}
+
+// Requests of a connection with a shared memory channel are read from the
+// channel by a thread of their own, and answered through the channel by
+// whichever thread ran the request.
+typedef struct _ShmConn ShmConn;
+
+#if defined(RPCSYNCWERK_USE_SHM)
+
+struct _ShmConn {
+    PipeConn base;
+    RpcsyncwerkShmChannel *chan;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int in_flight;
+    gboolean broken;
+};
+
+static void
+shm_conn_send_response (PipeConn *conn, const PipeFrameInfo *info,
+                        char *ret_str, gsize ret_len)
+{
+    ShmConn *sconn = (ShmConn *)conn;
+    char prefix[PIPE_FRAME_MAX_PREFIX];
+    size_t prefix_len;
+
+    pthread_mutex_lock (&sconn->lock);
+    if (!ret_str) {
+        sconn->broken = TRUE;
+    } else if (!sconn->broken) {
+        prefix_len = pipe_frame_encode_prefix (prefix, info, PIPE_FRAME_RESPONSE, 0, ret_len);
+        if (rpcsyncwerk_shm_channel_write (sconn->chan, prefix, prefix_len, TRUE) < 0 ||
+            rpcsyncwerk_shm_channel_write (sconn->chan, ret_str, ret_len, FALSE) < 0)
+            sconn->broken = TRUE;
+    }
+    sconn->in_flight--;
+    pthread_cond_signal (&sconn->cond);
+    pthread_mutex_unlock (&sconn->lock);
+
+    g_free (ret_str);
+}
+
+static void
+shm_conn_free (PipeConn *conn)
+{
+    ShmConn *sconn = (ShmConn *)conn;
+
+    rpcsyncwerk_shm_channel_free (sconn->chan);
+    close (conn->fd);
+    pthread_mutex_destroy (&sconn->lock);
+    pthread_cond_destroy (&sconn->cond);
+    g_free (sconn);
+}
+
+// Set up a shared memory channel for the connection @fd, and send it to the
+// client in response to the setup request @info. Returns 0 on success, -1 if
+// no channel could be set up and nothing was sent, then the caller answers
+// with an error and keeps serving the socket, or -2 if the connection is
+// broken.
+static int
+shm_conn_setup (RpcsyncwerkNamedPipeServer *server, RpcsyncwerkNamedPipe fd,
+                const PipeFrameInfo *info, const char *payload, guint32 len,
+                ShmConn **out)
+{
+    RpcsyncwerkShmChannel *chan;
+    PipeShmSetup setup;
+    int fds[RPCSYNCWERK_SHM_N_FDS];
+    char frame[PIPE_FRAME_MAX_PREFIX + 64];
+    size_t prefix_len;
+    int ret_len, sock;
+
+    if (len != sizeof(setup)) {
+        g_warning ("malformed shared memory setup request\n");
+        return -1;
+    }
+    memcpy (&setup, payload, sizeof(setup));
+
+    // The channel watches its own descriptor of the connection, so it does
+    // not depend on how the caller serves the socket.
+    sock = dup (fd);
+    if (sock < 0) {
+        g_warning ("failed to dup pipe client: %s\n", strerror(errno));
+        return -1;
+    }
+    chan = rpcsyncwerk_shm_channel_create (sock, setup.ring_size,
+                                           MIN(setup.spin_us, RPCSYNCWERK_SHM_MAX_SPIN_US),
+                                           fds);
+    if (!chan) {
+        close (sock);
+        return -1;
+    }
+
+    ret_len = g_snprintf (frame + PIPE_FRAME_MAX_PREFIX, sizeof(frame) - PIPE_FRAME_MAX_PREFIX,
+                          "{\"ret\":%u}", rpcsyncwerk_shm_channel_ring_size (chan));
+    prefix_len = pipe_frame_encode_prefix (frame, info, PIPE_FRAME_RESPONSE, 0, ret_len);
+    // A versioned prefix fills PIPE_FRAME_MAX_PREFIX exactly.
+    if (rpcsyncwerk_shm_send_fds (fd, frame, prefix_len + ret_len, fds, RPCSYNCWERK_SHM_N_FDS) < 0) {
+        g_warning ("failed to send shared memory channel: %s\n", strerror(errno));
+        rpcsyncwerk_shm_channel_free (chan);
+        close (sock);
+        return -2;
+    }
+
+    ShmConn *sconn = g_new0 (ShmConn, 1);
+    sconn->base.server = server;
+    sconn->base.fd = sock;
+    sconn->base.refcount = 1;
+    sconn->base.send_response = shm_conn_send_response;
+    sconn->base.free = shm_conn_free;
+    sconn->chan = chan;
+    pthread_mutex_init (&sconn->lock, NULL);
+    pthread_cond_init (&sconn->cond, NULL);
+
+    g_debug ("pipe client switched to a shared memory channel\n");
+    *out = sconn;
+    return 0;
+}
+
+// Serve the requests of @sconn until the client goes away, and release it.
+static void
+shm_conn_run (ShmConn *sconn)
+{
+    RpcsyncwerkShmChannel *chan = sconn->chan;
+    gboolean broken = FALSE;
+    guint32 bufsize = 4096;
+    char *buf = g_malloc(bufsize);
+    guint32 len;
+
+    while (!broken) {
+        if (rpcsyncwerk_shm_channel_read (chan, &len, sizeof(guint32)) < 0)
+            break;
+        if (!(len & PIPE_FRAME_VERSIONED)) {
+            g_warning ("unexpected legacy rpc request on a shared memory channel\n");
+            break;
+        }
+        len &= ~PIPE_FRAME_VERSIONED;
+
+        while (bufsize < len) {
+            bufsize *= 2;
+            buf = g_realloc(buf, bufsize);
+        }
+        if (len == 0 || rpcsyncwerk_shm_channel_read (chan, buf, len) < 0)
+            break;
+
+        PipeFrameInfo info;
+        const char *payload = buf;
+        if (pipe_frame_decode_header (&payload, &len,
+                                      PIPE_FRAME_TYPE_MASK(PIPE_FRAME_REQUEST), &info) < 0)
+            break;
+
+        pthread_mutex_lock (&sconn->lock);
+        sconn->in_flight++;
+        pthread_mutex_unlock (&sconn->lock);
+
+        dispatch_request (&sconn->base, &info, payload, len);
+
+        // The client sends one request at a time.
+        pthread_mutex_lock (&sconn->lock);
+        while (sconn->in_flight > 0)
+            pthread_cond_wait (&sconn->cond, &sconn->lock);
+        broken = sconn->broken;
+        pthread_mutex_unlock (&sconn->lock);
+    }
+
+    g_free (buf);
+    pipe_conn_unref (&sconn->base);
+}
+
+#else // defined(RPCSYNCWERK_USE_SHM)
+
+static int
+shm_conn_setup (RpcsyncwerkNamedPipeServer *server, RpcsyncwerkNamedPipe fd,
+                const PipeFrameInfo *info, const char *payload, guint32 len,
+                ShmConn **out)
+{
+    g_warning ("shared memory channels are not supported on this platform\n");
+    return -1;
+}
+
+static void
+shm_conn_run (ShmConn *sconn)
+{
+}
+
+#endif // defined(RPCSYNCWERK_USE_SHM)
+
+static void *
+shm_conn_thread (void *arg)
+{
+    shm_conn_run (arg);
+    return NULL;
+}
+
+// Error response to a shared memory setup request the server can't satisfy.
+#define PIPE_SHM_UNAVAILABLE_ERROR "Shared memory channel not available"
+
+static void* named_pipe_client_handler(void *arg)
+{
+    ServerHandlerData *data = arg;
+    ThreadedConn *tconn = g_new0 (ThreadedConn, 1);
+    gboolean broken = FALSE;
+
+    tconn->base.server = data->server;
+    tconn->base.fd = data->connfd;
+    tconn->base.refcount = 1;
+    tconn->base.send_response = threaded_conn_send_response;
+    tconn->base.free = threaded_conn_free;
+    pthread_mutex_init (&tconn->lock, NULL);
+    pthread_cond_init (&tconn->cond, NULL);
+    g_free (data);
+
+    RpcsyncwerkNamedPipe connfd = tconn->base.fd;
+    PipeReader *reader = pipe_reader_new (connfd);
+
+    guint32 len;
+    guint32 bufsize = 4096;
+    char *buf = g_malloc(bufsize);
+
+    g_debug ("start to serve on pipe client\n");
+
+    while (!broken) {
+        len = 0;
+        if (pipe_reader_read_n(reader, &len, sizeof(guint32)) < 0) {
+            g_warning("failed to read rpc request size: %s", strerror(errno));
+            break;
+        }
+
+        if (len == 0) {
+            g_debug("EOF reached, pipe connection lost");
+            break;
+        }
+
+        PipeFrameInfo info = kLegacyFrame;
+        gboolean versioned = (len & PIPE_FRAME_VERSIONED) != 0;
+        len &= ~PIPE_FRAME_VERSIONED;
+
+        while (bufsize < len) {
+            bufsize *= 2;
+            buf = g_realloc(buf, bufsize);
+        }
+
+        if (pipe_reader_read_n(reader, buf, len) < 0 || len == 0) {
+            g_warning("failed to read rpc request: %s", strerror(errno));
+            break;
+        }
+
+        const char *payload = buf;
+        if (versioned &&
+            pipe_frame_decode_header (&payload, &len,
+                                      PIPE_FRAME_TYPE_MASK(PIPE_FRAME_REQUEST) |
+                                      PIPE_FRAME_TYPE_MASK(PIPE_FRAME_SHM_SETUP),
+                                      &info) < 0) {
+            break;
+        }
+
+        pthread_mutex_lock (&tconn->lock);
+        if (info.type == PIPE_FRAME_SHM_SETUP) {
+            while (tconn->in_flight > 0)
+                pthread_cond_wait (&tconn->cond, &tconn->lock);
+        }
+        tconn->in_flight++;
+        pthread_mutex_unlock (&tconn->lock);
+
+        if (info.type == PIPE_FRAME_SHM_SETUP) {
+            ShmConn *sconn = NULL;
+            int rc = shm_conn_setup (tconn->base.server, connfd, &info, payload, len, &sconn);
+            if (rc == 0) {
+                // From now on this thread serves the channel.
+                shm_conn_run (sconn);
+                break;
+            }
+            if (rc == -2)
+                break;
+            gsize ret_len = 0;
+            char *ret_str = error_response (TRANSPORT_ERROR_CODE, PIPE_SHM_UNAVAILABLE_ERROR,
+                                            &ret_len);
+            tconn->base.send_response (&tconn->base, &info, ret_str, ret_len);
+            continue;
+        }
+
+        dispatch_request (&tconn->base, &info, payload, len);
+
+        // Legacy responses must be sent in the order of the requests, so wait
+        // for this one before reading the next. Versioned requests are
+        // pipelined up to kMaxInFlightRequests.
+        pthread_mutex_lock (&tconn->lock);
+        while (tconn->in_flight > (versioned ? kMaxInFlightRequests - 1 : 0))
+            pthread_cond_wait (&tconn->cond, &tconn->lock);
+        broken = tconn->broken;
+        pthread_mutex_unlock (&tconn->lock);
+    }
+
+    g_free (buf);
+    pipe_reader_free (reader);
+    pipe_conn_unref (&tconn->base);
+
+    return NULL;
+}
+
+// The absolute deadline of a request read at @received that the client waits
+// @timeout_ms for.
+static gint64
+pipe_request_deadline (gint64 received, guint32 timeout_ms)
+{
+    return timeout_ms > 0 ? received + (gint64)timeout_ms * 1000 : 0;
+}
+
+// The response of an asynchronous function, sent when it replies.
+typedef struct {
+    PipeConn *conn;
+    PipeFrameInfo info;
+} PipeDeferredReply;
+
+static void
+pipe_deferred_reply (char *ret_str, gsize ret_len, void *user_data)
+{
+    PipeDeferredReply *reply = user_data;
+
+    reply->conn->send_response (reply->conn, &reply->info, ret_str, ret_len);
+    pipe_conn_unref (reply->conn);
+    g_free (reply);
+}
+
+// Call the function of a request from @conn, letting an asynchronous one
+// reply later. Sets @deferred and returns NULL then.
+static char *
+pipe_call_function (PipeConn *conn, const PipeFrameInfo *info, const char *svc_name,
+                    int handle, gchar *body, gsize len, gint64 deadline,
+                    gsize *ret_len, gboolean *deferred)
+{
+    PipeDeferredReply *reply = g_new0 (PipeDeferredReply, 1);
+    char *ret_str;
+
+    reply->conn = pipe_conn_ref (conn);
+    reply->info = *info;
+    ret_str = rpcsyncwerk_server_call_function_deferred (svc_name, handle, body, len,
+                                                         ret_len, deadline,
+                                                         pipe_deferred_reply, reply);
+    if (ret_str) {
+        pipe_conn_unref (conn);
+        g_free (reply);
+    } else {
+        *deferred = TRUE;
+    }
+    return ret_str;
+}
+
+// Parse a request read from @conn at @received and call the requested
+// function. Returns the response to send back, or NULL if the request is
+// malformed. If the function replies later, sets @deferred instead.
+static char *
+handle_rpc_request (PipeConn *conn, const PipeFrameInfo *info, const char *buf,
+                    guint32 len, gint64 received, gsize *ret_len, gboolean *deferred)
+{
+    char *service, *body;
+    char *ret_str;
+    guint32 timeout_ms = 0;
+
+    *deferred = FALSE;
+
+    if (info->flags & PIPE_FRAME_FLAG_SERVICE) {
+        char svc_name[PIPE_FRAME_MAX_SERVICE_LEN + 1];
+        guint8 svc_len;
+        guint32 handle;
+        int call_handle = -1;
+
+        if (len < 1 || (svc_len = (guint8)buf[0]) > len - 1) {
+            g_warning ("malformed rpc request header\n");
+            return NULL;
+        }
+        memcpy (svc_name, buf + 1, svc_len);
+        svc_name[svc_len] = '\0';
+        buf += 1 + svc_len;
+        len -= 1 + svc_len;
+
+        if (info->flags & PIPE_FRAME_FLAG_HANDLE) {
+            if (len < sizeof(guint32)) {
+                g_warning ("malformed rpc request header\n");
+                return NULL;
+            }
+            memcpy (&handle, buf, sizeof(guint32));
+            call_handle = (int)handle;
+            buf += sizeof(guint32);
+            len -= sizeof(guint32);
+        }
+
+        if (info->flags & PIPE_FRAME_FLAG_DEADLINE) {
+            if (len < sizeof(guint32)) {
+                g_warning ("malformed rpc request header\n");
+                return NULL;
+            }
+            memcpy (&timeout_ms, buf, sizeof(guint32));
+            buf += sizeof(guint32);
+            len -= sizeof(guint32);
+        }
+
+        if (info->flags & PIPE_FRAME_FLAG_RESOLVE) {
+            char *fname = g_strndup (buf, len);
+            json_t *object = json_object ();
+            json_object_set_new (object, "ret",
+                                 json_integer (rpcsyncwerk_server_resolve_function (svc_name, fname)));
+            ret_str = json_dumps (object, JSON_COMPACT);
+            json_decref (object);
+            g_free (fname);
+            *ret_len = strlen(ret_str);
+            return ret_str;
+        }
+
+        return pipe_call_function (conn, info, svc_name, call_handle, (gchar *)buf, len,
+                                   pipe_request_deadline (received, timeout_ms),
+                                   ret_len, deferred);
+    }
+
+    if (request_from_json (buf, len, &service, &body, &timeout_ms) < 0) {
+        return NULL;
+    }
+
+    ret_str = pipe_call_function (conn, info, service, -1, body, strlen(body),
+                                  pipe_request_deadline (received, timeout_ms),
+                                  ret_len, deferred);
+    g_free (service);
+    g_free (body);
+
+    return ret_str;
+}
+
+#if defined(RPCSYNCWERK_USE_EPOLL)
+
+// Epoll based server loop. Each I/O loop owns an epoll instance and a thread
+// waiting on it. The listener thread hands accepted connections to the loops
+// in a round robin way, after that the connection state is only touched by the
+// thread of its loop. Dispatch workers hand their responses back to the loop
+// through a completion queue and an eventfd.
+
+#define kIOLoopMaxEvents 64
+
+// Initial size of the per connection read buffer. Buffers grown beyond
+// kConnBufKeepSize for a large request/response are released once drained.
+static const size_t kConnBufSize = 4096;
+static const size_t kConnBufKeepSize = 64 * 1024;
+// Max bytes read from a connection before giving other connections a turn.
+static const size_t kConnReadBudget = 256 * 1024;
+// Stop reading requests from a connection while it has more output pending.
+static const size_t kConnMaxPendingOutput = 1024 * 1024;
+
+typedef struct _RpcsyncwerkNamedPipeIOLoop RpcsyncwerkNamedPipeIOLoop;
+
+struct _RpcsyncwerkNamedPipeIOLoop {
+    RpcsyncwerkNamedPipeServer *server;
+    pthread_t thread;
+    int epoll_fd;
+    int event_fd;
+
+    // Responses produced by the dispatch pool, protected by lock.
+    pthread_mutex_t lock;
+    GQueue completions;
+
+#if defined(RPCSYNCWERK_USE_IO_URING)
+    // Set when the loop runs on io_uring instead of epoll_fd.
+    struct io_uring *ring;
+    guint64 event_count;
+#endif
+};
+
+typedef struct {
+    PipeConn base;
+    RpcsyncwerkNamedPipeIOLoop *loop;
+
+    // Received bytes not yet consumed as requests.
+    char *rbuf;
+    size_t rbuf_len;
+    size_t rbuf_size;
+
+    // Framed responses not yet written to the socket.
+    char *wbuf;
+    size_t wbuf_off;
+    size_t wbuf_len;
+    size_t wbuf_size;
+    // Memfds to attach to frames in wbuf, in order.
+    GQueue wfds;
+
+    // Events the fd is currently registered for.
+    guint32 events;
+    // A legacy request is being handled on the dispatch pool.
+    gboolean busy;
+    // Number of versioned requests being handled on the dispatch pool.
+    int in_flight;
+    gboolean broken;
+    gboolean closed;
+
+    // io_uring operations submitted for the connection. Responses queued
+    // while sbuf is being sent go to wbuf.
+    gboolean read_pending;
+    gboolean write_pending;
+    char *sbuf;
+    size_t sbuf_off;
+    size_t sbuf_len;
+    size_t sbuf_size;
+} NamedPipeConn;
+
+typedef struct {
+    NamedPipeConn *conn;
+    PipeFrameInfo info;
+    char *ret_str;
+    gsize ret_len;
+    int fd;
+} NamedPipeCompletion;
+
+// A memfd and the frame in wbuf it is attached to.
+typedef struct {
+    size_t off;
+    size_t len;
+    int fd;
+} NamedPipeConnFd;
+
+static void* named_pipe_io_loop(void *arg);
+#if defined(RPCSYNCWERK_USE_IO_URING)
+static int uring_conn_arm(NamedPipeConn *conn, guint32 events);
+static void uring_conn_cancel_read(NamedPipeConn *conn);
+#endif
+
+static int
+set_nonblocking (int fd)
+{
+    int flags = fcntl (fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int
+start_io_loops (RpcsyncwerkNamedPipeServer *server, int n_loops)
+{
+    struct epoll_event ev;
+    int i;
+
+    server->io_loops = g_new0 (RpcsyncwerkNamedPipeIOLoop, n_loops);
+
+    for (i = 0; i < n_loops; i++) {
+        RpcsyncwerkNamedPipeIOLoop *loop = &server->io_loops[i];
+        loop->server = server;
+        loop->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+        loop->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init (&loop->lock, NULL);
+        g_queue_init (&loop->completions);
+
+        // The eventfd is the only fd registered with a NULL pointer.
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (loop->epoll_fd < 0 || loop->event_fd < 0 ||
+            epoll_ctl (loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &ev) < 0) {
+            g_warning ("failed to create epoll instance: %s\n", strerror(errno));
+            for (; i >= 0; i--) {
+                loop = &server->io_loops[i];
+                if (loop->epoll_fd >= 0)
+                    close (loop->epoll_fd);
+                if (loop->event_fd >= 0)
+                    close (loop->event_fd);
+                pthread_mutex_destroy (&loop->lock);
+            }
+            g_free (server->io_loops);
+            server->io_loops = NULL;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < n_loops; i++) {
+        RpcsyncwerkNamedPipeIOLoop *loop = &server->io_loops[i];
+        pthread_create (&loop->thread, NULL, named_pipe_io_loop, loop);
+    }
+    server->n_io_loops = n_loops;
+
+    g_debug ("started %d pipe server I/O loops\n", n_loops);
+    return 0;
+}
+
+static void
+named_pipe_conn_free (PipeConn *base)
+{
+    NamedPipeConn *conn = (NamedPipeConn *)base;
+
+    NamedPipeConnFd *wfd;
+
+    close (base->fd);
+    while ((wfd = g_queue_pop_head (&conn->wfds)) != NULL) {
+        close (wfd->fd);
+        g_free (wfd);
+    }
+    g_free (conn->rbuf);
+    g_free (conn->wbuf);
+    g_free (conn->sbuf);
+    g_free (conn);
+}
+
+// Stop serving the connection. It's freed once the pending dispatch jobs
+// release their references.
+static void
+conn_close (NamedPipeConn *conn)
+{
+    if (conn->closed)
+        return;
+    conn->closed = TRUE;
+#if defined(RPCSYNCWERK_USE_IO_URING)
+    if (conn->loop->ring)
+        uring_conn_cancel_read (conn);
+    else
+#endif
+    epoll_ctl (conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->base.fd, NULL);
+    pipe_conn_unref (&conn->base);
+}
+
+static void
+conn_queue_response (NamedPipeConn *conn, const PipeFrameInfo *info,
+                     const char *ret_str, gsize ret_len, int fd)
+{
+    size_t needed = conn->wbuf_len + PIPE_FRAME_MAX_PREFIX + ret_len;
+    size_t prefix_len;
+
+    if (needed > conn->wbuf_size) {
+        size_t size = conn->wbuf_size ? conn->wbuf_size : kConnBufSize;
+        while (size < needed)
+            size *= 2;
+        conn->wbuf = g_realloc (conn->wbuf, size);
+        conn->wbuf_size = size;
+    }
+
+    prefix_len = pipe_frame_encode_prefix (conn->wbuf + conn->wbuf_len, info, PIPE_FRAME_RESPONSE,
+                                           fd >= 0 ? PIPE_FRAME_FLAG_MEMFD : 0,
+                                           ret_len);
+    memcpy (conn->wbuf + conn->wbuf_len + prefix_len, ret_str, ret_len);
+
+    if (fd >= 0) {
+        NamedPipeConnFd *wfd = g_new0 (NamedPipeConnFd, 1);
+        wfd->off = conn->wbuf_len;
+        wfd->len = prefix_len + ret_len;
+        wfd->fd = fd;
+        g_queue_push_tail (&conn->wfds, wfd);
+    }
+    conn->wbuf_len += prefix_len + ret_len;
+}
+
+// Must be called on the loop thread.
+static void
+conn_take_response (NamedPipeConn *conn, const PipeFrameInfo *info,
+                    char *ret_str, gsize ret_len, int fd)
+{
+    if (info->versioned)
+        conn->in_flight--;
+    else
+        conn->busy = FALSE;
+
+    if (!ret_str)
+        conn->broken = TRUE;
+    else if (!conn->closed) {
+        conn_queue_response (conn, info, ret_str, ret_len, fd);
+        fd = -1;
+    }
+    if (fd >= 0)
+        close (fd);
+    g_free (ret_str);
+}
+
+static void
+named_pipe_conn_send_response (PipeConn *base, const PipeFrameInfo *info,
+                               char *ret_str, gsize ret_len)
+{
+    NamedPipeConn *conn = (NamedPipeConn *)base;
+    RpcsyncwerkNamedPipeIOLoop *loop = conn->loop;
+    NamedPipeCompletion *completion;
+    gboolean wakeup;
+    int fd = -1;
+
+#if defined(RPCSYNCWERK_USE_IO_URING)
+    // Descriptors can't be attached to io_uring sends.
+    if (!loop->ring)
+#endif
+        fd = pipe_response_to_memfd (base->server, info, &ret_str, &ret_len);
+
+    // Handled inline by the loop thread.
+    if (pthread_equal (pthread_self(), loop->thread)) {
+        conn_take_response (conn, info, ret_str, ret_len, fd);
+        return;
+    }
+
+    completion = g_new0 (NamedPipeCompletion, 1);
+    completion->conn = (NamedPipeConn *)pipe_conn_ref (base);
+    completion->info = *info;
+    completion->ret_str = ret_str;
+    completion->ret_len = ret_len;
+    completion->fd = fd;
+
+    pthread_mutex_lock (&loop->lock);
+    wakeup = g_queue_is_empty (&loop->completions);
+    g_queue_push_tail (&loop->completions, completion);
+    pthread_mutex_unlock (&loop->lock);
+
+    if (wakeup) {
+        guint64 one = 1;
+        if (write (loop->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            g_warning ("failed to wake up pipe server I/O loop: %s\n", strerror(errno));
+    }
+}
+
+static NamedPipeConn *
+named_pipe_conn_new (RpcsyncwerkNamedPipeIOLoop *loop, int connfd)
+{
+    NamedPipeConn *conn = g_new0 (NamedPipeConn, 1);
+
+    conn->base.server = loop->server;
+    conn->base.fd = connfd;
+    conn->base.refcount = 1;
+    conn->base.send_response = named_pipe_conn_send_response;
+    conn->base.free = named_pipe_conn_free;
+    conn->loop = loop;
+    conn->rbuf_size = kConnBufSize;
+    conn->rbuf = g_malloc (conn->rbuf_size);
+    return conn;
+}
+
+static void
+io_loop_add_connection (RpcsyncwerkNamedPipeServer *server, int connfd)
+{
+    RpcsyncwerkNamedPipeIOLoop *loop;
+    NamedPipeConn *conn;
+    struct epoll_event ev;
+
+    loop = &server->io_loops[server->next_io_loop++ % server->n_io_loops];
+
+    if (set_nonblocking (connfd) < 0) {
+        g_warning ("failed to set pipe client non-blocking: %s\n", strerror(errno));
+        close (connfd);
+        return;
+    }
+
+    conn = named_pipe_conn_new (loop, connfd);
+    conn->events = EPOLLIN;
+
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    if (epoll_ctl (loop->epoll_fd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+        g_warning ("failed to add pipe client to epoll: %s\n", strerror(errno));
+        pipe_conn_unref (&conn->base);
+        return;
+    }
+
+    g_debug ("start to serve on pipe client\n");
+}
+
+// Don't read more requests while a legacy request is dispatched, too many
+// pipelined requests are in flight or too much output is pending. So a client
+// that doesn't read its responses can't make the server buffer unbounded input
+// or output.
+static int
+conn_update_events (NamedPipeConn *conn)
+{
+    struct epoll_event ev;
+    guint32 events = 0;
+
+    if (!conn->busy &&
+        conn->in_flight < kMaxInFlightRequests &&
+        conn->wbuf_len - conn->wbuf_off < kConnMaxPendingOutput)
+        events |= EPOLLIN;
+    if (conn->wbuf_len > 0)
+        events |= EPOLLOUT;
+
+#if defined(RPCSYNCWERK_USE_IO_URING)
+    if (conn->loop->ring)
+        return uring_conn_arm (conn, events);
+#endif
+
+    if (events == conn->events)
+        return 0;
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl (conn->loop->epoll_fd, EPOLL_CTL_MOD, conn->base.fd, &ev) < 0) {
+        g_warning ("failed to modify pipe client in epoll: %s\n", strerror(errno));
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+// Write wbuf up to the next frame with a memfd attached, or that frame along
+// with its memfd.
+static ssize_t
+conn_write_some (NamedPipeConn *conn)
+{
+    NamedPipeConnFd *wfd = g_queue_peek_head (&conn->wfds);
+    size_t end = wfd ? wfd->off : conn->wbuf_len;
+
+#if defined(RPCSYNCWERK_USE_SHM)
+    if (wfd && wfd->off == conn->wbuf_off) {
+        gssize n = rpcsyncwerk_shm_send_some (conn->base.fd, conn->wbuf + conn->wbuf_off,
+                                              wfd->len, &wfd->fd, 1);
+        if (n > 0) {
+            close (wfd->fd);
+            g_free (g_queue_pop_head (&conn->wfds));
+        }
+        return n;
+    }
+#endif
+
+    return send (conn->base.fd, conn->wbuf + conn->wbuf_off, end - conn->wbuf_off,
+                 MSG_NOSIGNAL);
+}
+
+static int
+conn_flush (NamedPipeConn *conn)
+{
+    ssize_t n;
+
+#if defined(RPCSYNCWERK_USE_IO_URING)
+    // Writes are submitted to the ring.
+    if (conn->loop->ring)
+        return conn_update_events (conn);
+#endif
+
+    while (conn->wbuf_off < conn->wbuf_len) {
+        n = conn_write_some (conn);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            g_warning ("failed to send rpc response: %s", strerror(errno));
+            return -1;
+        }
+        conn->wbuf_off += n;
+    }
+
+    if (conn->wbuf_off == conn->wbuf_len) {
+        conn->wbuf_off = conn->wbuf_len = 0;
+        if (conn->wbuf_size > kConnBufKeepSize) {
+            g_free (conn->wbuf);
+            conn->wbuf = NULL;
+            conn->wbuf_size = 0;
+        }
+    }
+
+    return conn_update_events (conn);
+}
+
+// Hand the connection over to a thread serving a shared memory channel, or
+// answer the setup request @info with an error if no channel can be set up.
+// Returns -1 when the connection is to be closed, including when it was
+// handed over.
+static int
+conn_start_shm (NamedPipeConn *conn, const PipeFrameInfo *info,
+                const char *payload, guint32 len)
+{
+    ShmConn *sconn = NULL;
+    pthread_t thread;
+    int rc;
+
+    if (conn->in_flight > 1 || conn->wbuf_len > conn->wbuf_off || conn->write_pending) {
+        g_warning ("shared memory setup request while other requests are in progress\n");
+        return -1;
+    }
+
+    rc = shm_conn_setup (conn->base.server, conn->base.fd, info, payload, len, &sconn);
+    if (rc == -2)
+        return -1;
+    if (rc == -1) {
+        gsize ret_len = 0;
+        char *ret_str = error_response (TRANSPORT_ERROR_CODE, PIPE_SHM_UNAVAILABLE_ERROR,
+                                        &ret_len);
+        conn->base.send_response (&conn->base, info, ret_str, ret_len);
+        return 0;
+    }
+
+    if (pthread_create (&thread, NULL, shm_conn_thread, sconn) != 0) {
+        g_warning ("failed to start shared memory channel thread\n");
+        pipe_conn_unref ((PipeConn *)sconn);
+        return -1;
+    }
+    pthread_detach (thread);
+    return -1;
+}
+
+// Handle the complete requests in the read buffer until a legacy request goes
+// to the dispatch pool or too many are in flight, and make sure the buffer is
+// large enough to hold the next one.
+static int
+conn_handle_requests (NamedPipeConn *conn)
+{
+    size_t off = 0;
+    size_t frame_size = 0;
+    guint32 len;
+
+    while (!conn->busy && conn->in_flight < kMaxInFlightRequests &&
+           conn->rbuf_len - off >= sizeof(guint32)) {
+        memcpy (&len, conn->rbuf + off, sizeof(guint32));
+        if (len == 0) {
+            g_debug("EOF reached, pipe connection lost");
+            return -1;
+        }
+
+        PipeFrameInfo info = kLegacyFrame;
+        gboolean versioned = (len & PIPE_FRAME_VERSIONED) != 0;
+        len &= ~PIPE_FRAME_VERSIONED;
+
+        frame_size = sizeof(guint32) + (size_t)len;
+        if (conn->rbuf_len - off < frame_size)
+            break;
+
+        const char *payload = conn->rbuf + off + sizeof(guint32);
+        if (versioned) {
+            if (pipe_frame_decode_header (&payload, &len,
+                                          PIPE_FRAME_TYPE_MASK(PIPE_FRAME_REQUEST) |
+                                          PIPE_FRAME_TYPE_MASK(PIPE_FRAME_SHM_SETUP),
+                                          &info) < 0)
+                return -1;
+            conn->in_flight++;
+            if (info.type == PIPE_FRAME_SHM_SETUP) {
+                if (conn_start_shm (conn, &info, payload, len) < 0)
+                    return -1;
+                off += frame_size;
+                frame_size = 0;
+                continue;
+            }
+        } else {
+            conn->busy = TRUE;
+        }
+
+        dispatch_request (&conn->base, &info, payload, len);
+        if (conn->broken)
+            return -1;
+
+        off += frame_size;
+        frame_size = 0;
+    }
+
+    if (off > 0) {
+        memmove (conn->rbuf, conn->rbuf + off, conn->rbuf_len - off);
+        conn->rbuf_len -= off;
+    }
+
+    if (frame_size > conn->rbuf_size) {
+        conn->rbuf = g_realloc (conn->rbuf, frame_size);
+        conn->rbuf_size = frame_size;
+    } else if (conn->rbuf_len == 0 && conn->rbuf_size > kConnBufKeepSize) {
+        conn->rbuf = g_realloc (conn->rbuf, kConnBufSize);
+        conn->rbuf_size = kConnBufSize;
+    }
+
+    return 0;
+}
+
+static int
+conn_on_readable (NamedPipeConn *conn)
+{
+    size_t budget = kConnReadBudget;
+    ssize_t n;
+
+    while (budget > 0) {
+        if (conn->rbuf_len == conn->rbuf_size) {
+            conn->rbuf_size *= 2;
+            conn->rbuf = g_realloc (conn->rbuf, conn->rbuf_size);
+        }
+
+        n = read (conn->base.fd, conn->rbuf + conn->rbuf_len,
+                  conn->rbuf_size - conn->rbuf_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            g_warning("failed to read rpc request: %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            g_debug("EOF reached, pipe connection lost");
+            return -1;
+        }
+
+        conn->rbuf_len += n;
+        budget -= MIN(budget, (size_t)n);
+
+        if (conn_handle_requests (conn) < 0)
+            return -1;
+        if (conn->busy || conn->in_flight >= kMaxInFlightRequests ||
+            conn->wbuf_len - conn->wbuf_off >= kConnMaxPendingOutput)
+            break;
+    }
+
+    return conn_flush (conn);
+}
+
+static void
+io_loop_drain_completions (RpcsyncwerkNamedPipeIOLoop *loop)
+{
+    GQueue completions = G_QUEUE_INIT;
+    NamedPipeCompletion *completion;
+    guint64 count;
+
+    if (read (loop->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        g_warning ("failed to read pipe server eventfd: %s\n", strerror(errno));
+
+    pthread_mutex_lock (&loop->lock);
+    completions = loop->completions;
+    g_queue_init (&loop->completions);
+    pthread_mutex_unlock (&loop->lock);
+
+    while ((completion = g_queue_pop_head (&completions)) != NULL) {
+        NamedPipeConn *conn = completion->conn;
+
+        conn_take_response (conn, &completion->info, completion->ret_str,
+                            completion->ret_len, completion->fd);
+        if (!conn->closed) {
+            // Continue with the requests received in the meantime. A pending
+            // io_uring read means they were all handled already, and the
+            // read buffer can't be moved.
+            if (conn->broken ||
+                (!conn->read_pending && conn_handle_requests (conn) < 0) ||
+                conn_flush (conn) < 0)
+                conn_close (conn);
+        }
+
+        pipe_conn_unref (&conn->base);
+        g_free (completion);
+    }
+}
+
+static void*
+named_pipe_io_loop (void *arg)
+{
+    RpcsyncwerkNamedPipeIOLoop *loop = arg;
+    struct epoll_event events[kIOLoopMaxEvents];
+    gboolean drain;
+    int n, i;
+
+    while (1) {
+        n = epoll_wait (loop->epoll_fd, events, kIOLoopMaxEvents, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning ("epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // Completions may close and free connections that later events of
+        // the batch point to, so they are handled after the batch.
+        drain = FALSE;
+        for (i = 0; i < n; i++) {
+            NamedPipeConn *conn = events[i].data.ptr;
+            int ret;
+
+            if (!conn) {
+                drain = TRUE;
+                continue;
+            }
+
+            ret = 0;
+            if (events[i].events & EPOLLOUT)
+                ret = conn_flush (conn);
+            // A hang up or error is fatal unless there are requests left to
+            // read.
+            if (ret == 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                ret = (conn->events & EPOLLIN) ? conn_on_readable (conn) : -1;
+
+            if (ret < 0)
+                conn_close (conn);
+        }
+
+        if (drain)
+            io_loop_drain_completions (loop);
+    }
+
+    return NULL;
+}
+
+#if defined(RPCSYNCWERK_USE_IO_URING)
+
+// io_uring based server loop. It shares the connection handling above with the
+// epoll loop, but every loop accepts connections on the listening socket
+// itself, and reads and writes are submitted to the loop's ring instead of
+// being done when the socket becomes ready. All the operations queued while
+// handling a batch of completions are submitted with the same system call that
+// waits for the next batch.
+
+#define kUringEntries 256
+
+// The operation of a completion is kept in the low bits of its user data, the
+// rest is the connection or loop it belongs to.
+enum {
+    URING_OP_ACCEPT = 0,
+    URING_OP_EVENT,
+    URING_OP_READ,
+    URING_OP_WRITE,
+    URING_OP_CANCEL,
+};
+#define URING_OP_MASK 7
+
+static void* named_pipe_uring_loop(void *arg);
+
+static struct io_uring_sqe *
+uring_get_sqe (RpcsyncwerkNamedPipeIOLoop *loop)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe (loop->ring);
+
+    // The submission queue is full, submit what's queued to make room.
+    if (!sqe) {
+        io_uring_submit (loop->ring);
+        sqe = io_uring_get_sqe (loop->ring);
+        if (!sqe)
+            g_warning ("io_uring submission queue is full\n");
+    }
+    return sqe;
+}
+
+static void
+uring_set_data (struct io_uring_sqe *sqe, void *ptr, int op)
+{
+    sqe->user_data = (guint64)(uintptr_t)ptr | op;
+}
+
+static int
+uring_arm_accept (RpcsyncwerkNamedPipeIOLoop *loop)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe (loop);
+    if (!sqe)
+        return -1;
+    io_uring_prep_accept (sqe, loop->server->pipe_fd, NULL, NULL, 0);
+    uring_set_data (sqe, loop, URING_OP_ACCEPT);
+    return 0;
+}
+
+static int
+uring_arm_event (RpcsyncwerkNamedPipeIOLoop *loop)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe (loop);
+    if (!sqe)
+        return -1;
+    io_uring_prep_read (sqe, loop->event_fd, &loop->event_count,
+                        sizeof(loop->event_count), 0);
+    uring_set_data (sqe, loop, URING_OP_EVENT);
+    return 0;
+}
+
+static int
+uring_conn_send (NamedPipeConn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe (conn->loop);
+    if (!sqe)
+        return -1;
+    io_uring_prep_send (sqe, conn->base.fd, conn->sbuf + conn->sbuf_off,
+                        conn->sbuf_len - conn->sbuf_off, MSG_NOSIGNAL);
+    uring_set_data (sqe, conn, URING_OP_WRITE);
+    pipe_conn_ref (&conn->base);
+    conn->write_pending = TRUE;
+    return 0;
+}
+
+// Submit a read if @events has EPOLLIN, and a write of the queued responses.
+// Each submitted operation holds a reference on the connection until it
+// completes.
+static int
+uring_conn_arm (NamedPipeConn *conn, guint32 events)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((events & EPOLLIN) && !conn->read_pending) {
+        if (conn->rbuf_len == conn->rbuf_size) {
+            conn->rbuf_size *= 2;
+            conn->rbuf = g_realloc (conn->rbuf, conn->rbuf_size);
+        }
+
+        sqe = uring_get_sqe (conn->loop);
+        if (!sqe)
+            return -1;
+        io_uring_prep_recv (sqe, conn->base.fd, conn->rbuf + conn->rbuf_len,
+                            conn->rbuf_size - conn->rbuf_len, 0);
+        uring_set_data (sqe, conn, URING_OP_READ);
+        pipe_conn_ref (&conn->base);
+        conn->read_pending = TRUE;
+    }
+
+    // The buffer being sent can't be reallocated, so the queued responses are
+    // moved to sbuf, and the ones queued meanwhile are sent with the next
+    // write.
+    if (!conn->write_pending && conn->wbuf_len > 0) {
+        char *buf = conn->sbuf;
+        size_t size = conn->sbuf_size;
+
+        conn->sbuf = conn->wbuf;
+        conn->sbuf_size = conn->wbuf_size;
+        conn->sbuf_off = 0;
+        conn->sbuf_len = conn->wbuf_len;
+        conn->wbuf = buf;
+        conn->wbuf_size = size;
+        conn->wbuf_off = conn->wbuf_len = 0;
+
+        if (uring_conn_send (conn) < 0)
+            return -1;
+    }
+
+    conn->events = events;
+    return 0;
+}
+
+static void
+uring_conn_cancel_read (NamedPipeConn *conn)
+{
+    struct io_uring_sqe *sqe;
+    guint64 data = (guint64)(uintptr_t)conn | URING_OP_READ;
+
+    if (!conn->read_pending)
+        return;
+
+    sqe = uring_get_sqe (conn->loop);
+    if (!sqe)
+        return;
+    io_uring_prep_cancel (sqe, (void *)(uintptr_t)data, 0);
+    uring_set_data (sqe, NULL, URING_OP_CANCEL);
+}
+
+static void
+uring_on_read (NamedPipeConn *conn, int res)
+{
+    conn->read_pending = FALSE;
+    if (conn->closed)
+        return;
+
+    if (res <= 0) {
+        if (res == 0)
+            g_debug("EOF reached, pipe connection lost");
+        else
+            g_warning("failed to read rpc request: %s", strerror(-res));
+        conn_close (conn);
+        return;
+    }
+
+    conn->rbuf_len += res;
+    if (conn_handle_requests (conn) < 0 || conn_flush (conn) < 0)
+        conn_close (conn);
+}
+
+static void
+uring_on_write (NamedPipeConn *conn, int res)
+{
+    conn->write_pending = FALSE;
+    if (conn->closed)
+        return;
+
+    if (res < 0) {
+        g_warning ("failed to send rpc response: %s", strerror(-res));
+        conn_close (conn);
+        return;
+    }
+
+    conn->sbuf_off += res;
+    if (conn->sbuf_off < conn->sbuf_len) {
+        if (uring_conn_send (conn) < 0)
+            conn_close (conn);
+        return;
+    }
+
+    conn->sbuf_off = conn->sbuf_len = 0;
+    if (conn->sbuf_size > kConnBufKeepSize) {
+        g_free (conn->sbuf);
+        conn->sbuf = NULL;
+        conn->sbuf_size = 0;
+    }
+
+    // Less output is pending now, which may resume reading.
+    if (conn_update_events (conn) < 0)
+        conn_close (conn);
+}
+
+static void
+uring_on_accept (RpcsyncwerkNamedPipeIOLoop *loop, int res)
+{
+    NamedPipeConn *conn;
+
+    if (res < 0) {
+        g_warning ("failed to accept pipe client: %s\n", strerror(-res));
+        return;
+    }
+
+    conn = named_pipe_conn_new (loop, res);
+    if (conn_update_events (conn) < 0) {
+        conn_close (conn);
+        return;
+    }
+
+    g_debug ("start to serve on pipe client\n");
+}
+
+static void
+uring_handle_completion (RpcsyncwerkNamedPipeIOLoop *loop, guint64 data, int res)
+{
+    void *ptr = (void *)(uintptr_t)(data & ~(guint64)URING_OP_MASK);
+    NamedPipeConn *conn = ptr;
+
+    switch (data & URING_OP_MASK) {
+    case URING_OP_ACCEPT:
+        uring_on_accept (loop, res);
+        uring_arm_accept (loop);
+        break;
+    case URING_OP_EVENT:
+        io_loop_drain_completions (loop);
+        uring_arm_event (loop);
+        break;
+    case URING_OP_READ:
+        uring_on_read (conn, res);
+        pipe_conn_unref (&conn->base);
+        break;
+    case URING_OP_WRITE:
+        uring_on_write (conn, res);
+        pipe_conn_unref (&conn->base);
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+uring_loops_free (RpcsyncwerkNamedPipeServer *server, int n_loops)
+{
+    int i;
+
+    for (i = 0; i < n_loops; i++) {
+        RpcsyncwerkNamedPipeIOLoop *loop = &server->io_loops[i];
+        if (loop->ring) {
+            io_uring_queue_exit (loop->ring);
+            g_free (loop->ring);
+        }
+        if (loop->event_fd >= 0)
+            close (loop->event_fd);
+        pthread_mutex_destroy (&loop->lock);
+    }
+    g_free (server->io_loops);
+    server->io_loops = NULL;
+}
+
+static int
+start_uring_loops (RpcsyncwerkNamedPipeServer *server, int n_loops)
+{
+    int i, ret;
+
+    server->io_loops = g_new0 (RpcsyncwerkNamedPipeIOLoop, n_loops);
+
+    for (i = 0; i < n_loops; i++) {
+        RpcsyncwerkNamedPipeIOLoop *loop = &server->io_loops[i];
+        loop->server = server;
+        loop->epoll_fd = -1;
+        loop->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init (&loop->lock, NULL);
+        g_queue_init (&loop->completions);
+
+        if (loop->event_fd < 0) {
+            g_warning ("failed to create eventfd: %s\n", strerror(errno));
+            uring_loops_free (server, i + 1);
+            return -1;
+        }
+
+        loop->ring = g_new0 (struct io_uring, 1);
+        ret = io_uring_queue_init (kUringEntries, loop->ring, 0);
+        if (ret < 0) {
+            g_warning ("failed to create io_uring instance: %s\n", strerror(-ret));
+            g_free (loop->ring);
+            loop->ring = NULL;
+            uring_loops_free (server, i + 1);
+            return -1;
+        }
+    }
+
+    server->n_io_loops = n_loops;
+    for (i = 0; i < n_loops; i++) {
+        RpcsyncwerkNamedPipeIOLoop *loop = &server->io_loops[i];
+        pthread_create (&loop->thread, NULL, named_pipe_uring_loop, loop);
+    }
+
+    g_debug ("started %d pipe server io_uring loops\n", n_loops);
+    return 0;
+}
+
+static void*
+named_pipe_uring_loop (void *arg)
+{
+    RpcsyncwerkNamedPipeIOLoop *loop = arg;
+    struct io_uring_cqe *cqes[kUringEntries];
+    unsigned n, i;
+    int ret;
+
+    if (uring_arm_accept (loop) < 0 || uring_arm_event (loop) < 0)
+        return NULL;
+
+    while (1) {
+        ret = io_uring_submit_and_wait (loop->ring, 1);
+        if (ret < 0) {
+            if (ret == -EINTR)
+                continue;
+            g_warning ("io_uring_submit_and_wait failed: %s\n", strerror(-ret));
+            break;
+        }
+
+        n = io_uring_peek_batch_cqe (loop->ring, cqes, kUringEntries);
+        for (i = 0; i < n; i++)
+            uring_handle_completion (loop, cqes[i]->user_data, cqes[i]->res);
+        io_uring_cq_advance (loop->ring, n);
+    }
+
+    return NULL;
+}
+
+#endif // defined(RPCSYNCWERK_USE_IO_URING)
+
+#endif // defined(RPCSYNCWERK_USE_EPOLL)
+
+#if defined(RPCSYNCWERK_USE_SHM)
+
+// Ask the server for a shared memory channel. Returns -1 if the connection
+// failed. If the server can't set up a channel, the socket is used.
+static int
+pipe_client_setup_shm (RpcsyncwerkNamedPipeClient *client)
+{
+    PipeFrameInfo info = { TRUE, 0, 0 };
+    PipeShmSetup setup;
+    char prefix[PIPE_FRAME_MAX_PREFIX];
+    int fds[RPCSYNCWERK_SHM_N_FDS];
+    int n_fds, i;
+    guint32 len;
+    char *ret;
+
+    setup.ring_size = client->shm_ring_size;
+    setup.spin_us = (guint32)MAX(client->shm_spin_us, 0);
+    if (pipe_write_frame (client->pipe_fd, &info, PIPE_FRAME_SHM_SETUP,
+                          (const char *)&setup, sizeof(setup)) < 0) {
+        g_warning ("failed to send shared memory setup request: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // The descriptors come with the prefix of the response.
+    n_fds = rpcsyncwerk_shm_recv_fds (client->pipe_fd, prefix, sizeof(prefix),
+                                      fds, RPCSYNCWERK_SHM_N_FDS);
+    if (n_fds < 0) {
+        g_warning ("failed to read shared memory setup response: %s\n", strerror(errno));
+        return -1;
+    }
+
+    const char *hdr = prefix + sizeof(guint32);
+    guint32 hdr_len = sizeof(PipeFrameHeader);
+    memcpy (&len, prefix, sizeof(guint32));
+    if (!(len & PIPE_FRAME_VERSIONED) ||
+        (len & ~PIPE_FRAME_VERSIONED) < sizeof(PipeFrameHeader) ||
+        pipe_frame_decode_header (&hdr, &hdr_len,
+                                  PIPE_FRAME_TYPE_MASK(PIPE_FRAME_RESPONSE), &info) < 0) {
+        g_warning ("malformed shared memory setup response\n");
+        goto failed;
+    }
+    len = (len & ~PIPE_FRAME_VERSIONED) - sizeof(PipeFrameHeader);
+
+    ret = g_malloc (len + 1);
+    if (pipe_read_n (client->pipe_fd, ret, len) != len) {
+        g_warning ("failed to read shared memory setup response: %s\n", strerror(errno));
+        g_free (ret);
+        goto failed;
+    }
+    ret[len] = '\0';
+
+    if (n_fds == RPCSYNCWERK_SHM_N_FDS) {
+        client->shm = rpcsyncwerk_shm_channel_attach (client->pipe_fd, client->shm_spin_us, fds);
+        n_fds = 0;
+    }
+    if (!client->shm)
+        g_warning ("no shared memory channel from server, using the socket: %s\n", ret);
+    g_free (ret);
+
+    for (i = 0; i < n_fds; i++)
+        close (fds[i]);
+    return 0;
+
+failed:
+    for (i = 0; i < n_fds; i++)
+        close (fds[i]);
+    return -1;
+}
+
+#endif // defined(RPCSYNCWERK_USE_SHM)
+
+// Close the connection of @client, if it has one. The client can connect
+// again afterwards.
+static void
+pipe_client_close_connection (RpcsyncwerkNamedPipeClient *client)
+{
+#if defined(RPCSYNCWERK_USE_SHM)
+    rpcsyncwerk_shm_channel_free (client->shm);
+    client->shm = NULL;
+#endif
+    // The reader is only there while connected.
+    if (!client->reader)
+        return;
+#if defined(WIN32)
+    CloseHandle(client->pipe_fd);
+#else
+    close(client->pipe_fd);
+#endif
+    pipe_reader_free (client->reader);
+    client->reader = NULL;
+}
+
+static int
+pipe_client_open_connection (RpcsyncwerkNamedPipeClient *client)
+{
+#if !defined(WIN32)
+    client->pipe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client->pipe_fd < 0) {
+        g_warning ("pipe client failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+#if defined(SO_NOSIGPIPE)
+    int on = 1;
+    setsockopt (client->pipe_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    struct sockaddr_un servaddr;
+    servaddr.sun_family = AF_UNIX;
+
+    g_strlcpy (servaddr.sun_path, client->path, sizeof(servaddr.sun_path));
+    if (connect(client->pipe_fd, (struct sockaddr *)&servaddr, (socklen_t)sizeof(servaddr)) < 0) {
+        g_warning ("pipe client failed to connect to server: %s\n", strerror(errno));
+        close (client->pipe_fd);
+        client->pipe_fd = -1;
+        return -1;
+    }
+    client->reader = pipe_reader_new (client->pipe_fd);
+
+#if defined(RPCSYNCWERK_USE_SHM)
+    if (client->shm_ring_size > 0 && pipe_client_setup_shm (client) < 0) {
+        pipe_client_close_connection (client);
+        client->pipe_fd = -1;
+        return -1;
+    }
+#endif
+
+#else // !defined(WIN32)
+    RpcsyncwerkNamedPipe pipe_fd;
+    pipe_fd = CreateFile(
+        client->path,           // pipe name
+        GENERIC_READ |          // read and write access
+        GENERIC_WRITE,
+        0,                      // no sharing
+        NULL,                   // default security attributes
+        OPEN_EXISTING,          // opens existing pipe
+        0,                      // default attributes
+        NULL);                  // no template file
+
+    if (pipe_fd == INVALID_HANDLE_VALUE) {
+        G_WARNING_WITH_LAST_ERROR("Failed to connect to named pipe");
+        return -1;
+    }
+
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    if (!SetNamedPipeHandleState(pipe_fd, &mode, NULL, NULL)) {
+        G_WARNING_WITH_LAST_ERROR("Failed to set named pipe mode");
+        CloseHandle(pipe_fd);
+        return -1;
+    }
+
+    client->pipe_fd = pipe_fd;
+    client->reader = pipe_reader_new (client->pipe_fd);
+
+#endif // !defined(WIN32)
+
+    g_debug ("pipe client connected to server\n");
+    return 0;
+}
+
+static pthread_mutex_t pipe_generation_lock = PTHREAD_MUTEX_INITIALIZER;
+static gint pipe_last_generation;
+
+// Wait before the next attempt to connect, from @min_ms after the first
+// failure doubling up to @max_ms. The actual wait is picked between half the
+// delay and the delay, to spread the attempts of different clients.
+static void
+pipe_backoff_failed (int *delay_ms, gint64 *next_time, int min_ms, int max_ms)
+{
+    int delay = *delay_ms > 0 ? MIN(*delay_ms * 2, max_ms) : min_ms;
+
+    *delay_ms = delay;
+    *next_time = g_get_monotonic_time () +
+        (gint64)(delay / 2 + g_random_int_range (0, delay / 2 + 1)) * 1000;
+}
+
+int rpcsyncwerk_named_pipe_client_connect(RpcsyncwerkNamedPipeClient *client)
+{
+    gint generation;
+
+    if (pipe_client_open_connection (client) < 0) {
+        pthread_mutex_lock (&client->lock);
+        client->broken = TRUE;
+        if (client->reconnect)
+            pipe_backoff_failed (&client->reconnect_delay_ms, &client->next_reconnect_time,
+                                 client->reconnect_min_ms, client->reconnect_max_ms);
+        pthread_mutex_unlock (&client->lock);
+        return -1;
+    }
+
+    pthread_mutex_lock (&pipe_generation_lock);
+    generation = ++pipe_last_generation;
+    pthread_mutex_unlock (&pipe_generation_lock);
+    g_atomic_int_set (&client->generation, generation);
+
+    pthread_mutex_lock (&client->lock);
+    client->broken = FALSE;
+    client->reconnect_delay_ms = 0;
+    pthread_mutex_unlock (&client->lock);
+    return 0;
+}
+
+// Replace the broken connection of @client with a new one, unless the backoff
+// delay after a failed attempt hasn't passed. Returns 0 if the client is
+// connected.
+static int
+pipe_client_reconnect (RpcsyncwerkNamedPipeClient *client)
+{
+    gboolean reader_running;
+    int ret = -1;
+
+    // Writers and shared memory callers hold write_lock, waiting readers and
+    // the reader thread are woken up by shutting the socket down.
+    pthread_mutex_lock (&client->write_lock);
+    pthread_mutex_lock (&client->lock);
+    if (!client->broken) {
+        // Another caller reconnected first.
+        ret = 0;
+        goto out;
+    }
+    if (g_get_monotonic_time () < client->next_reconnect_time)
+        goto out;
+    // A callback run by the reader thread can't wait for it to exit.
+    if (client->reader_running && pthread_equal (pthread_self (), client->reader_thread))
+        goto out;
+
+    if (client->reader) {
+#if defined(WIN32)
+        CancelIoEx(client->pipe_fd, NULL);
+#else
+        shutdown(client->pipe_fd, SHUT_RDWR);
+#endif
+    }
+    reader_running = client->reader_running;
+    client->reader_running = FALSE;
+    if (reader_running) {
+        // The reader thread keeps client->reading until it exits.
+        pthread_mutex_unlock (&client->lock);
+        pthread_join (client->reader_thread, NULL);
+        pthread_mutex_lock (&client->lock);
+        client->reading = FALSE;
+    }
+    while (client->reading)
+        pthread_cond_wait (&client->cond, &client->lock);
+    pthread_mutex_unlock (&client->lock);
+
+    pipe_client_close_connection (client);
+    g_debug ("pipe client reconnecting to %s\n", client->path);
+    ret = rpcsyncwerk_named_pipe_client_connect (client);
+
+    pthread_mutex_lock (&client->lock);
+out:
+    pthread_mutex_unlock (&client->lock);
+    pthread_mutex_unlock (&client->write_lock);
+    return ret;
+}
+
+static void
+named_pipe_client_free (RpcsyncwerkNamedPipeClient *pipe_client)
+{
+    if (pipe_client->reader_running) {
+        // Wake up the reader thread, which fails the calls still pending.
+        pthread_mutex_lock(&pipe_client->lock);
+        pipe_client->broken = TRUE;
+        pthread_mutex_unlock(&pipe_client->lock);
+#if defined(WIN32)
+        CancelIoEx(pipe_client->pipe_fd, NULL);
+#else
+        shutdown(pipe_client->pipe_fd, SHUT_RDWR);
+#endif
+        pthread_join(pipe_client->reader_thread, NULL);
+    }
+
+    pipe_client_close_connection (pipe_client);
+    if (pipe_client->async_context)
+        g_main_context_unref (pipe_client->async_context);
+    pthread_mutex_destroy(&pipe_client->lock);
+    pthread_cond_destroy(&pipe_client->cond);
+    pthread_mutex_destroy(&pipe_client->write_lock);
+    g_hash_table_destroy (pipe_client->pending_calls);
+    g_free (pipe_client);
+}
+
+void rpcsyncwerk_free_client_with_pipe_transport (RpcsyncwerkClient *client)
+{
+    ClientTransportData *data = (ClientTransportData *)(client->arg);
+
+    if (data->client)
+        named_pipe_client_free (data->client);
+    g_free (data->service);
+    pthread_mutex_destroy(&data->handles_lock);
+    g_hash_table_destroy (data->handles);
+    if (data->idempotent)
+        g_hash_table_destroy (data->idempotent);
+    g_free (data);
+    rpcsyncwerk_client_free (client);
+}
+
+// A call waiting for its response on a pipelined connection.
+typedef struct {
+    char *ret;
+    size_t ret_len;
+    gboolean done;
+    // Set for asynchronous calls, which are completed by passing it to
+    // rpcsyncwerk_client_generic_callback() instead of waking up a caller.
+    void *rpc_priv;
+    guint32 request_id;
+} PipePendingCall;
+
+// Fail all the calls waiting on a broken connection. Must be called with
+// client->lock held. Returns the asynchronous calls, which the caller must
+// complete with pipe_complete_async_calls() after releasing the lock.
+static GList *
+pipe_client_fail_calls (RpcsyncwerkNamedPipeClient *client)
+{
+    GHashTableIter iter;
+    gpointer value;
+    GList *async_calls = NULL;
+
+    client->broken = TRUE;
+
+    g_hash_table_iter_init (&iter, client->pending_calls);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        PipePendingCall *call = value;
+        call->done = TRUE;
+        if (call->rpc_priv)
+            async_calls = g_list_prepend (async_calls, call);
+    }
+    g_hash_table_remove_all (client->pending_calls);
+    pthread_cond_broadcast (&client->cond);
+
+    return async_calls;
+}
+
+static gboolean
+pipe_run_async_callback (gpointer data)
+{
+    PipePendingCall *call = data;
+
+    rpcsyncwerk_client_generic_callback (call->ret, call->ret_len, call->rpc_priv,
+                                         call->ret ? NULL : "connection to server lost");
+    g_free (call->ret);
+    g_free (call);
+    return FALSE;
+}
+
+static void
+pipe_complete_async_call (RpcsyncwerkNamedPipeClient *client, PipePendingCall *call)
+{
+    if (!client->async_context) {
+        pipe_run_async_callback (call);
+        return;
+    }
+
+    GSource *source = g_idle_source_new ();
+    g_source_set_callback (source, pipe_run_async_callback, call, NULL);
+    g_source_attach (source, client->async_context);
+    g_source_unref (source);
+}
+
+static void
+pipe_complete_async_calls (RpcsyncwerkNamedPipeClient *client, GList *calls)
+{
+    GList *ptr;
+
+    for (ptr = calls; ptr; ptr = ptr->next)
+        pipe_complete_async_call (client, ptr->data);
+    g_list_free (calls);
+}
+
+// Read a response passed in the memfd attached to its frame.
+static char *
+pipe_read_memfd_payload (PipeReader *reader, guint32 len, size_t *ret_len)
+{
+#if defined(RPCSYNCWERK_USE_SHM)
+    guint64 size;
+    char *buf;
+    int fd;
+
+    if (len != sizeof(size) ||
+        pipe_reader_read_n(reader, &size, sizeof(size)) != sizeof(size)) {
+        return NULL;
+    }
+    fd = pipe_reader_take_fd (reader);
+    if (fd < 0) {
+        g_warning ("rpc response memfd is missing\n");
+        return NULL;
+    }
+
+    buf = rpcsyncwerk_shm_payload_read (fd, (gsize)size);
+    close (fd);
+    if (buf)
+        *ret_len = size;
+    return buf;
+#else
+    g_warning ("unexpected rpc response memfd\n");
+    return NULL;
+#endif
+}
+
+// Read a versioned response frame. Returns the payload, or NULL on error.
+static char *
+pipe_read_response (PipeReader *reader, PipeFrameInfo *info, size_t *ret_len)
+{
+    PipeFrameHeader hdr;
+    guint32 len;
+    char *buf;
+
+    if (pipe_reader_read_n(reader, &len, sizeof(guint32)) != sizeof(guint32)) {
+        return NULL;
+    }
+    if (!(len & PIPE_FRAME_VERSIONED)) {
+        g_warning ("unexpected legacy rpc response on a pipelined connection\n");
+        return NULL;
+    }
+    len &= ~PIPE_FRAME_VERSIONED;
+
+    if (len < sizeof(hdr) || pipe_reader_read_n(reader, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        return NULL;
+    }
+    const char *hdr_ptr = (const char *)&hdr;
+    guint32 hdr_len = sizeof(hdr);
+    if (pipe_frame_decode_header (&hdr_ptr, &hdr_len,
+                                  PIPE_FRAME_TYPE_MASK(PIPE_FRAME_RESPONSE), info) < 0) {
+        return NULL;
+    }
+    len -= sizeof(hdr);
+
+    if (info->flags & PIPE_FRAME_FLAG_MEMFD)
+        return pipe_read_memfd_payload (reader, len, ret_len);
+
+    buf = g_malloc(len + 1);
+    if (pipe_reader_read_n(reader, buf, len) != len) {
+        g_free (buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    *ret_len = len;
+    return buf;
+}
+
+// Read one response and hand it to its call. The caller must have set
+// client->reading, and must not hold client->lock. Returns -1 when the
+// connection is broken, after failing all the pending calls, or 1 if no
+// response started before @deadline. The connection is still usable then, but
+// a response that doesn't arrive whole by @deadline breaks it.
+static int
+pipe_client_read_one (RpcsyncwerkNamedPipeClient *client, gint64 deadline)
+{
+    PipeFrameInfo info;
+    PipePendingCall *call, *async_call = NULL;
+    size_t len = 0;
+    char *buf;
+
+    if (client->reader->start == client->reader->end &&
+        pipe_wait_readable (client->reader->fd, deadline) < 0 && errno == ETIMEDOUT)
+        return 1;
+
+    client->reader->deadline = deadline;
+    buf = pipe_read_response (client->reader, &info, &len);
+    client->reader->deadline = 0;
+
+    pthread_mutex_lock (&client->lock);
+    if (!buf) {
+        if (!client->broken)
+            g_warning("failed to read rpc response: %s", strerror(errno));
+        GList *async_calls = pipe_client_fail_calls (client);
+        pthread_mutex_unlock (&client->lock);
+        pipe_complete_async_calls (client, async_calls);
+        return -1;
+    }
+
+    call = g_hash_table_lookup (client->pending_calls, GUINT_TO_POINTER(info.request_id));
+    if (call) {
+        call->ret = buf;
+        call->ret_len = len;
+        call->done = TRUE;
+        g_hash_table_remove (client->pending_calls, GUINT_TO_POINTER(info.request_id));
+        // A synchronous call may be gone as soon as the lock is released.
+        if (call->rpc_priv)
+            async_call = call;
+    } else {
+        // The caller gave up waiting for it.
+        g_debug ("dropping rpc response id %u of an abandoned call\n", info.request_id);
+        g_free (buf);
+    }
+    pthread_cond_broadcast (&client->cond);
+    pthread_mutex_unlock (&client->lock);
+
+    if (async_call)
+        pipe_complete_async_call (client, async_call);
+    return 0;
+}
+
+// Once started, the reader thread reads all the responses of the connection,
+// and synchronous callers just wait for theirs.
+static void *
+pipe_client_reader (void *arg)
+{
+    RpcsyncwerkNamedPipeClient *client = arg;
+
+    pthread_mutex_lock (&client->lock);
+    while (client->reading)
+        pthread_cond_wait (&client->cond, &client->lock);
+    client->reading = TRUE;
+    pthread_mutex_unlock (&client->lock);
+
+    while (pipe_client_read_one (client, 0) == 0)
+        ;
+
+    return NULL;
+}
+
+// A handle is only valid on the connection it was resolved on.
+static gboolean
+pipe_request_is_current (RpcsyncwerkNamedPipeClient *client, const PipeRequest *req)
+{
+    return !(req->flags & PIPE_FRAME_FLAG_HANDLE) ||
+        req->generation == g_atomic_int_get (&client->generation);
+}
+
+// Register @call under a fresh id and send the request. Returns -1 if the
+// connection is broken; @call is not registered then.
+static int
+pipe_client_start_call (RpcsyncwerkNamedPipeClient *client, PipePendingCall *call,
+                        const PipeRequest *req)
+{
+    PipeFrameInfo info = { TRUE, 0, 0 };
+    int rc;
+
+    if (strlen(req->service) > PIPE_FRAME_MAX_SERVICE_LEN) {
+        g_warning ("rpc service name %s is too long\n", req->service);
+        return -1;
+    }
+
+    pthread_mutex_lock (&client->lock);
+    if (client->broken) {
+        pthread_mutex_unlock (&client->lock);
+        return -1;
+    }
+    info.request_id = client->next_request_id++;
+    call->request_id = info.request_id;
+    g_hash_table_insert (client->pending_calls, GUINT_TO_POINTER(info.request_id), call);
+
+    if (call->rpc_priv && !client->reader_running) {
+        if (pthread_create (&client->reader_thread, NULL, pipe_client_reader, client) != 0) {
+            g_warning ("failed to start pipe client reader thread\n");
+            g_hash_table_remove (client->pending_calls, GUINT_TO_POINTER(info.request_id));
+            pthread_mutex_unlock (&client->lock);
+            return -1;
+        }
+        client->reader_running = TRUE;
+    }
+    pthread_mutex_unlock (&client->lock);
+
+    pthread_mutex_lock (&client->write_lock);
+    pthread_mutex_lock (&client->lock);
+    // The connection may have been replaced while the lock was released, and
+    // the call failed with the old one.
+    if (call->done || !pipe_request_is_current (client, req)) {
+        gboolean registered = g_hash_table_remove (client->pending_calls,
+                                                   GUINT_TO_POINTER(info.request_id));
+        pthread_mutex_unlock (&client->lock);
+        pthread_mutex_unlock (&client->write_lock);
+        return registered ? -1 : 0;
+    }
+    pthread_mutex_unlock (&client->lock);
+    rc = pipe_write_request (client->pipe_fd, &info, req);
+    pthread_mutex_unlock (&client->write_lock);
+
+    if (rc < 0) {
+        g_warning("failed to send rpc call: %s", strerror(errno));
+        pthread_mutex_lock (&client->lock);
+        // If the call is gone, someone else has already failed it.
+        gboolean registered = g_hash_table_remove (client->pending_calls,
+                                                   GUINT_TO_POINTER(info.request_id));
+        GList *async_calls = pipe_client_fail_calls (client);
+        pthread_mutex_unlock (&client->lock);
+        pipe_complete_async_calls (client, async_calls);
+        if (registered)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Wait on @cond until @deadline, or for ever if it is 0. Returns -1 once the
+// deadline has passed.
+static int
+pipe_cond_wait_until (pthread_cond_t *cond, pthread_mutex_t *lock, gint64 deadline)
+{
+    struct timespec ts;
+    gint64 left, abs_time;
+
+    if (deadline <= 0) {
+        pthread_cond_wait (cond, lock);
+        return 0;
+    }
+
+    left = deadline - g_get_monotonic_time ();
+    if (left <= 0)
+        return -1;
+    // pthread_cond_timedwait() takes the real time.
+    abs_time = g_get_real_time () + left;
+    ts.tv_sec = abs_time / G_USEC_PER_SEC;
+    ts.tv_nsec = (abs_time % G_USEC_PER_SEC) * 1000;
+    pthread_cond_timedwait (cond, lock, &ts);
+    return 0;
+}
+
+// Send a request with a fresh id and wait for the response with the same id.
+// The threads waiting on the connection take turns to read the responses and
+// hand them to their callers, so synchronous calls need no reader thread.
+static char *
+pipe_call_pipelined (RpcsyncwerkNamedPipeClient *client, const PipeRequest *req,
+                     size_t *ret_len)
+{
+    PipePendingCall call = { NULL, 0, FALSE, NULL, 0 };
+    int rc;
+
+    if (pipe_client_start_call (client, &call, req) < 0)
+        return NULL;
+
+    pthread_mutex_lock (&client->lock);
+    while (!call.done) {
+        if (client->reading) {
+            if (pipe_cond_wait_until (&client->cond, &client->lock, req->deadline) < 0)
+                break;
+            continue;
+        }
+
+        client->reading = TRUE;
+        pthread_mutex_unlock (&client->lock);
+
+        rc = pipe_client_read_one (client, req->deadline);
+
+        pthread_mutex_lock (&client->lock);
+        client->reading = FALSE;
+        pthread_cond_broadcast (&client->cond);
+        if (rc > 0)
+            break;
+    }
+    if (!call.done) {
+        // Past the deadline. The connection stays in sync, the response is
+        // dropped when it comes.
+        g_hash_table_remove (client->pending_calls, GUINT_TO_POINTER(call.request_id));
+    }
+    pthread_mutex_unlock (&client->lock);
+
+    *ret_len = call.ret_len;
+    return call.ret;
+}
+
+#if defined(RPCSYNCWERK_USE_SHM)
+
+static const char *
+pipe_shm_error (void)
+{
+    return errno == ETIMEDOUT ? "timed out" : "connection to server lost";
+}
+
+// Send a request through the shared memory channel and wait for its response.
+// The calls take turns under client->write_lock.
+static char *
+pipe_call_shm (RpcsyncwerkNamedPipeClient *client, const PipeRequest *req,
+               size_t *ret_len)
+{
+    PipeFrameInfo info = { TRUE, 0, 0 };
+    char prefix[PIPE_REQUEST_MAX_PREFIX];
+    size_t prefix_len;
+    guint32 len;
+    char *buf = NULL;
+
+    if (strlen(req->service) > PIPE_FRAME_MAX_SERVICE_LEN) {
+        g_warning ("rpc service name %s is too long\n", req->service);
+        return NULL;
+    }
+
+    pthread_mutex_lock (&client->write_lock);
+    // A reconnect may have left the client without a channel.
+    if (client->broken || !client->shm || !pipe_request_is_current (client, req))
+        goto out;
+
+    // The response of a call that times out would be taken for the next one,
+    // the connection is broken then.
+    rpcsyncwerk_shm_channel_set_deadline (client->shm, req->deadline);
+    prefix_len = pipe_encode_request_prefix (prefix, &info, req);
+    if (rpcsyncwerk_shm_channel_write (client->shm, prefix, prefix_len, TRUE) < 0 ||
+        rpcsyncwerk_shm_channel_write (client->shm, req->body, req->body_len, FALSE) < 0) {
+        g_warning ("failed to send rpc call: %s\n", pipe_shm_error ());
+        client->broken = TRUE;
+        goto out;
+    }
+
+    // A versioned response prefix fills PIPE_FRAME_MAX_PREFIX exactly.
+    if (rpcsyncwerk_shm_channel_read (client->shm, prefix, PIPE_FRAME_MAX_PREFIX) < 0) {
+        g_warning ("failed to read rpc response: %s\n", pipe_shm_error ());
+        client->broken = TRUE;
+        goto out;
+    }
+    memcpy (&len, prefix, sizeof(guint32));
+    const char *hdr = prefix + sizeof(guint32);
+    guint32 hdr_len = sizeof(PipeFrameHeader);
+    if (!(len & PIPE_FRAME_VERSIONED) ||
+        (len & ~PIPE_FRAME_VERSIONED) < sizeof(PipeFrameHeader) ||
+        pipe_frame_decode_header (&hdr, &hdr_len,
+                                  PIPE_FRAME_TYPE_MASK(PIPE_FRAME_RESPONSE), &info) < 0) {
+        g_warning ("malformed rpc response on shared memory channel\n");
+        client->broken = TRUE;
+        goto out;
+    }
+    len = (len & ~PIPE_FRAME_VERSIONED) - sizeof(PipeFrameHeader);
+
+    buf = g_malloc (len + 1);
+    if (rpcsyncwerk_shm_channel_read (client->shm, buf, len) < 0) {
+        g_warning ("failed to read rpc response: %s\n", pipe_shm_error ());
+        client->broken = TRUE;
+        g_free (buf);
+        buf = NULL;
+        goto out;
+    }
+    buf[len] = '\0';
+    *ret_len = len;
+
+out:
+    if (client->shm)
+        rpcsyncwerk_shm_channel_set_deadline (client->shm, 0);
+    pthread_mutex_unlock (&client->write_lock);
+    return buf;
+}
+
+#endif // defined(RPCSYNCWERK_USE_SHM)
+
+// Send a versioned request and wait for its response, through the shared
+// memory channel if there is one.
+static char *
+pipe_call (RpcsyncwerkNamedPipeClient *client, const PipeRequest *req,
+           size_t *ret_len)
+{
+#if defined(RPCSYNCWERK_USE_SHM)
+    if (client->shm)
+        return pipe_call_shm (client, req, ret_len);
+#endif
+    return pipe_call_pipelined (client, req, ret_len);
+}
+
+// Ask the server for the handle of a function. Returns -1 if the server has
+// none, or -2 if the connection failed.
+static int
+pipe_client_resolve (ClientTransportData *data, RpcsyncwerkNamedPipeClient *client,
+                     const char *fname, gint64 deadline)
+{
+    PipeRequest req = { PIPE_FRAME_FLAG_RESOLVE, data->service, 0, fname, strlen(fname), 0,
+                        deadline };
+    size_t len = 0;
+    char *ret = pipe_call (client, &req, &len);
+    json_t *object;
+    int handle = -1;
+
+    if (!ret)
+        return -2;
+
+    object = json_loadb (ret, len, 0, NULL);
+    if (object && json_is_integer (json_object_get (object, "ret")))
+        handle = (int)json_integer_value (json_object_get (object, "ret"));
+    json_decref (object);
+    g_free (ret);
+
+    return handle;
+}
+
+// Copy the name of the function called by @fcall_str into @fname. Returns
+// FALSE if there is no plain name to take.
+static gboolean
+pipe_call_function_name (const char *fcall_str, size_t fcall_len,
+                         char *fname, size_t size)
+{
+    const char *name, *end;
+
+    // A serialized call starts with ["fname", skip names with escapes.
+    if (fcall_len < 3 || fcall_str[0] != '[' || fcall_str[1] != '"')
+        return FALSE;
+    name = fcall_str + 2;
+    end = memchr (name, '"', MIN(fcall_len - 2, size));
+    if (!end || memchr (name, '\\', end - name))
+        return FALSE;
+    memcpy (fname, name, end - name);
+    fname[end - name] = '\0';
+    return TRUE;
+}
+
+// Set up @req to call by handle if the function in @fcall_str has one. On a
+// cache miss the function is resolved first on @client if @resolve is TRUE.
+static void
+pipe_client_get_handle (ClientTransportData *data, RpcsyncwerkNamedPipeClient *client,
+                        const char *fcall_str, size_t fcall_len, gboolean resolve,
+                        PipeRequest *req)
+{
+    char fname[256];
+    gpointer value;
+    gboolean cached;
+    gint generation = g_atomic_int_get (&client->generation);
+
+    if (!pipe_call_function_name (fcall_str, fcall_len, fname, sizeof(fname)))
+        return;
+
+    pthread_mutex_lock (&data->handles_lock);
+    // The server may have been restarted since the handles were resolved.
+    if (generation > data->handles_generation) {
+        g_hash_table_remove_all (data->handles);
+        data->handles_generation = generation;
+    }
+    cached = g_hash_table_lookup_extended (data->handles, fname, NULL, &value);
+    pthread_mutex_unlock (&data->handles_lock);
+
+    if (!cached) {
+        if (!resolve)
+            return;
+        int handle = pipe_client_resolve (data, client, fname, req->deadline);
+        if (handle == -2)
+            return;
+        value = GINT_TO_POINTER(handle + 1);
+        pthread_mutex_lock (&data->handles_lock);
+        if (generation == data->handles_generation)
+            g_hash_table_replace (data->handles, g_strdup(fname), value);
+        pthread_mutex_unlock (&data->handles_lock);
+    }
+
+    if (GPOINTER_TO_INT(value) > 0) {
+        req->flags |= PIPE_FRAME_FLAG_HANDLE;
+        req->handle = (guint32)(GPOINTER_TO_INT(value) - 1);
+        req->generation = generation;
+    }
+}
+
+static gboolean
+pipe_client_is_broken (RpcsyncwerkNamedPipeClient *client)
+{
+    gboolean broken;
+
+    pthread_mutex_lock (&client->lock);
+    broken = client->broken;
+    pthread_mutex_unlock (&client->lock);
+    return broken;
+}
+
+// Reconnect a broken client before a call, if it is set to.
+static void
+pipe_client_check_connection (RpcsyncwerkNamedPipeClient *client)
+{
+    if (client->reconnect && pipe_client_is_broken (client))
+        pipe_client_reconnect (client);
+}
+
+// Whether a call that failed on @client can be sent again.
+static gboolean
+pipe_call_can_retry (ClientTransportData *data, RpcsyncwerkNamedPipeClient *client,
+                     const char *fcall_str, size_t fcall_len)
+{
+    char fname[256];
+
+    if (!data->idempotent ||
+        !pipe_call_function_name (fcall_str, fcall_len, fname, sizeof(fname)) ||
+        !g_hash_table_lookup (data->idempotent, fname))
+        return FALSE;
+
+    // Only failures of the connection, not calls that timed out.
+    return pipe_client_is_broken (client);
+}
+
+void
+rpcsyncwerk_named_pipe_transport_set_idempotent (RpcsyncwerkClient *client,
+                                                 const char *fname)
+{
+    ClientTransportData *data = client->arg;
+
+    if (!data->idempotent)
+        data->idempotent = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_replace (data->idempotent, g_strdup(fname), GINT_TO_POINTER(1));
+}
+
+static int
+rpcsyncwerk_named_pipe_async_send (void *arg, gchar *fcall_str,
+                                   size_t fcall_len, void *rpc_priv)
+{
+    ClientTransportData *data = arg;
+    RpcsyncwerkNamedPipeClient *client = data->client;
+
+    if (!client || !client->pipelined || client->shm) {
+        g_warning ("asynchronous rpc calls need a pipelined named pipe client "
+                   "without shared memory\n");
+        return -1;
+    }
+
+    pipe_client_check_connection (client);
+
+    PipeRequest req = { 0, data->service, 0, fcall_str, fcall_len };
+    // Do not wait for resolving the function here.
+    pipe_client_get_handle (data, client, fcall_str, fcall_len, FALSE, &req);
+
+    PipePendingCall *call = g_new0 (PipePendingCall, 1);
+    call->rpc_priv = rpc_priv;
+
+    if (pipe_client_start_call (client, call, &req) < 0) {
+        g_free (call);
+        return -1;
+    }
+
+    return 0;
+}
+
+static char *
+pipe_client_send (ClientTransportData *data, RpcsyncwerkNamedPipeClient *client,
+                  const gchar *fcall_str, size_t fcall_len, size_t *ret_len,
+                  gint64 deadline)
+{
+    // Nobody waits for the response any more, e.g. before a retry.
+    if (deadline > 0 && g_get_monotonic_time () >= deadline)
+        return NULL;
+
+    pipe_client_check_connection (client);
+
+    if (client->pipelined || client->shm) {
+        PipeRequest req = { 0, data->service, 0, fcall_str, fcall_len, 0, deadline };
+        size_t ret_len_ = 0;
+        pipe_client_get_handle (data, client, fcall_str, fcall_len, TRUE, &req);
+        char *ret = pipe_call (client, &req, &ret_len_);
+        *ret_len = ret_len_;
+        return ret;
+    }
+
+    // A late response to an earlier call may still arrive on a broken
+    // connection, so it's not used again until it has been reopened.
+    if (pipe_client_is_broken (client))
+        return NULL;
+
+    char *json_str = request_to_json(data->service, fcall_str, fcall_len,
+                                     pipe_deadline_timeout_ms (deadline));
+    guint32 len = (guint32)strlen(json_str);
+    PipeIOVec iov[2];
+
+    iov[0].iov_base = &len;
+    iov[0].iov_len = sizeof(guint32);
+    iov[1].iov_base = json_str;
+    iov[1].iov_len = len;
+    // Legacy responses have no id to tell a late one from the next, so a
+    // call past its deadline breaks the connection.
+    if (pipe_write_v_until(client->pipe_fd, iov, 2, deadline) < 0) {
+        g_warning("failed to send rpc call: %s", strerror(errno));
+        free (json_str);
+        client->broken = TRUE;
+        return NULL;
+    }
+
+    free (json_str);
+    client->reader->deadline = deadline;
+
+    // A short read means the server closed the connection.
+    errno = 0;
+    if (pipe_reader_read_n(client->reader, &len, sizeof(guint32)) != sizeof(guint32)) {
+        g_warning("failed to read rpc response: %s",
+                  errno ? strerror(errno) : "connection closed");
+        client->reader->deadline = 0;
+        client->broken = TRUE;
+        return NULL;
+    }
+
+    char *buf = g_malloc(len);
+
+    errno = 0;
+    if (pipe_reader_read_n(client->reader, buf, len) != (ssize_t)len) {
+        g_warning("failed to read rpc response: %s",
+                  errno ? strerror(errno) : "connection closed");
+        g_free (buf);
+        client->reader->deadline = 0;
+        client->broken = TRUE;
+        return NULL;
+    }
+    client->reader->deadline = 0;
+
+    *ret_len = len;
+    return buf;
+}
+
+// Take an idle connection of the pool, or open a new one if there are less
+// than max_connections. Otherwise wait for one to be released. With @fresh,
+// the idle connections are closed first, to retry a call after a connection
+// broke: the others to the same server likely are broken too.
+static RpcsyncwerkNamedPipeClient *
+pipe_pool_acquire (RpcsyncwerkNamedPipeClientPool *pool, gboolean fresh, gint64 deadline)
+{
+    RpcsyncwerkNamedPipeClient *conn;
+    GList *closed = NULL, *ptr;
+
+    pthread_mutex_lock (&pool->lock);
+    while (fresh && (conn = g_queue_pop_head (&pool->idle)) != NULL) {
+        closed = g_list_prepend (closed, conn);
+        pool->n_connections--;
+    }
+    while ((conn = g_queue_pop_head (&pool->idle)) == NULL &&
+           pool->n_connections >= pool->max_connections) {
+        if (pipe_cond_wait_until (&pool->cond, &pool->lock, deadline) < 0)
+            break;
+    }
+    if (!conn) {
+        if (pool->n_connections >= pool->max_connections ||
+            g_get_monotonic_time () < pool->next_reconnect_time) {
+            pthread_mutex_unlock (&pool->lock);
+            return NULL;
+        }
+        pool->n_connections++;
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    for (ptr = closed; ptr; ptr = ptr->next)
+        named_pipe_client_free (ptr->data);
+    g_list_free (closed);
+
+    if (conn)
+        return conn;
+
+    conn = rpcsyncwerk_create_named_pipe_client (pool->path);
+    conn->pipelined = pool->pipelined;
+    conn->shm_ring_size = pool->shm_ring_size;
+    conn->shm_spin_us = pool->shm_spin_us;
+    if (rpcsyncwerk_named_pipe_client_connect (conn) < 0) {
+        named_pipe_client_free (conn);
+        pthread_mutex_lock (&pool->lock);
+        pool->n_connections--;
+        pipe_backoff_failed (&pool->reconnect_delay_ms, &pool->next_reconnect_time,
+                             pool->reconnect_min_ms, pool->reconnect_max_ms);
+        pthread_cond_signal (&pool->cond);
+        pthread_mutex_unlock (&pool->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock (&pool->lock);
+    pool->reconnect_delay_ms = 0;
+    pthread_mutex_unlock (&pool->lock);
+    return conn;
+}
+
+// Return a connection to the pool. A broken connection is closed, its state
+// is unknown after a failed call.
+static void
+pipe_pool_release (RpcsyncwerkNamedPipeClientPool *pool,
+                   RpcsyncwerkNamedPipeClient *conn, gboolean broken)
+{
+    if (broken)
+        named_pipe_client_free (conn);
+
+    pthread_mutex_lock (&pool->lock);
+    if (broken)
+        pool->n_connections--;
+    else
+        // The most recently used connection is reused first, the others can
+        // stay idle.
+        g_queue_push_head (&pool->idle, conn);
+    pthread_cond_signal (&pool->cond);
+    pthread_mutex_unlock (&pool->lock);
+}
+
+char *rpcsyncwerk_named_pipe_send(void *arg, const gchar *fcall_str,
+                             size_t fcall_len, size_t *ret_len)
+{
+    gboolean timed_out;
+
+    return rpcsyncwerk_named_pipe_send_with_deadline (arg, fcall_str, fcall_len, ret_len,
+                                                      0, &timed_out);
+}
+
+static char *
+rpcsyncwerk_named_pipe_send_with_deadline (void *arg, const gchar *fcall_str,
+                                           size_t fcall_len, size_t *ret_len,
+                                           gint64 deadline, gboolean *timed_out)
+{
+    g_debug ("rpcsyncwerk_named_pipe_send is called\n");
+    ClientTransportData *data = arg;
+    RpcsyncwerkNamedPipeClient *conn;
+    char *ret;
+
+    if (data->client) {
+        ret = pipe_client_send (data, data->client, fcall_str, fcall_len, ret_len, deadline);
+        // The retry starts by reconnecting.
+        if (!ret && data->client->reconnect &&
+            pipe_call_can_retry (data, data->client, fcall_str, fcall_len))
+            ret = pipe_client_send (data, data->client, fcall_str, fcall_len, ret_len, deadline);
+        goto out;
+    }
+
+    conn = pipe_pool_acquire (data->pool, FALSE, deadline);
+    if (!conn) {
+        ret = NULL;
+        goto out;
+    }
+    ret = pipe_client_send (data, conn, fcall_str, fcall_len, ret_len, deadline);
+    if (!ret && pipe_call_can_retry (data, conn, fcall_str, fcall_len)) {
+        pipe_pool_release (data->pool, conn, TRUE);
+        conn = pipe_pool_acquire (data->pool, TRUE, deadline);
+        if (!conn)
+            goto out;
+        ret = pipe_client_send (data, conn, fcall_str, fcall_len, ret_len, deadline);
+    }
+    // A pipelined connection stays usable after a call timed out.
+    pipe_pool_release (data->pool, conn, !ret && pipe_client_is_broken (conn));
+
+out:
+    *timed_out = !ret && deadline > 0 && g_get_monotonic_time () >= deadline;
+    return ret;
+}
+
+RpcsyncwerkNamedPipeClientPool *
+rpcsyncwerk_create_named_pipe_client_pool (const char *path, int max_connections)
+{
+    RpcsyncwerkNamedPipeClientPool *pool = g_new0 (RpcsyncwerkNamedPipeClientPool, 1);
+
+    g_strlcpy (pool->path, path, sizeof(pool->path));
+    pool->max_connections = max_connections > 0 ? max_connections : g_get_num_processors ();
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->cond, NULL);
+    g_queue_init (&pool->idle);
+    rpcsyncwerk_named_pipe_client_pool_set_reconnect (pool, 0, 0);
+    return pool;
+}
+
+void
+rpcsyncwerk_named_pipe_client_pool_set_pipelined (RpcsyncwerkNamedPipeClientPool *pool,
+                                                  gboolean pipelined)
+{
+    pool->pipelined = pipelined;
+}
+
+void
+rpcsyncwerk_named_pipe_client_pool_set_shared_memory (RpcsyncwerkNamedPipeClientPool *pool,
+                                                      guint32 ring_size,
+                                                      int spin_us)
+{
+    pool->shm_ring_size = ring_size;
+    pool->shm_spin_us = spin_us;
+}
+
+void
+rpcsyncwerk_named_pipe_client_pool_set_reconnect (RpcsyncwerkNamedPipeClientPool *pool,
+                                                  int min_delay_ms,
+                                                  int max_delay_ms)
+{
+    pool->reconnect_min_ms = min_delay_ms > 0 ? min_delay_ms : PIPE_RECONNECT_MIN_MS;
+    pool->reconnect_max_ms = MAX(max_delay_ms > 0 ? max_delay_ms : PIPE_RECONNECT_MAX_MS,
+                                 pool->reconnect_min_ms);
+}
+
+void
+rpcsyncwerk_named_pipe_client_pool_free (RpcsyncwerkNamedPipeClientPool *pool)
+{
+    RpcsyncwerkNamedPipeClient *conn;
+
+    if (!pool)
+        return;
+
+    while ((conn = g_queue_pop_head (&pool->idle)) != NULL)
+        named_pipe_client_free (conn);
+    pthread_mutex_destroy (&pool->lock);
+    pthread_cond_destroy (&pool->cond);
+    g_free (pool);
+}
+
+static char *
+request_to_json (const char *service, const char *fcall_str, size_t fcall_len,
+                 guint32 timeout_ms)
+{
+    json_t *object = json_object ();
+
+    char *temp_request = g_malloc0(fcall_len + 1);
+    memcpy(temp_request, fcall_str, fcall_len);
+
+    json_object_set_string_member (object, "service", service);
+    json_object_set_string_member (object, "request", temp_request);
+    if (timeout_ms > 0)
+        json_object_set_new (object, "timeout", json_integer ((json_int_t)timeout_ms));
+
+    g_free (temp_request);
+
+    char *str = json_dumps (object, 0);
+    json_decref (object);
+    return str;
+}
+
+static int
+request_from_json (const char *content, size_t len, char **service, char **fcall_str,
+                   guint32 *timeout_ms)
+{
+    json_error_t jerror;
+    json_t *object = json_loadb(content, len, 0, &jerror);
     if (!object) {
         g_warning ("Failed to parse request body: %s.\n", strlen(jerror.text) > 0 ? jerror.text : "");
         return -1;
@@ -409,6 +3687,9 @@ request_from_json (const char *content, size_t len, char **service, char **fcall
 
     *service = g_strdup(json_object_get_string_member (object, "service"));
     *fcall_str = g_strdup(json_object_get_string_member(object, "request"));
+    json_t *timeout = json_object_get (object, "timeout");
+    if (json_is_integer (timeout) && json_integer_value (timeout) > 0)
+        *timeout_ms = (guint32)MIN(json_integer_value (timeout), G_MAXUINT32);
 
     json_decref (object);
 
@@ -448,7 +3729,7 @@ pipe_write_n(int fd, const void *vptr, size_t n)
     ptr = vptr;
     nleft = n;
     while (nleft > 0) {
-        if ( (nwritten = write(fd, ptr, nleft)) <= 0)
+        if ( (nwritten = send(fd, ptr, nleft, MSG_NOSIGNAL)) <= 0)
         {
             if (nwritten < 0 && errno == EINTR)
                 nwritten = 0;       /* and call write() again */
@@ -487,6 +3768,143 @@ pipe_read_n(int fd, void *vptr, size_t n)
     return(n - nleft);      /* return >= 0 */
 }
 
+// Wait for @events on @fd until @deadline.
+static int
+pipe_wait_fd(int fd, short events, gint64 deadline)
+{
+    struct pollfd pfd;
+    gint64 left;
+    int rc;
+
+    while (1) {
+        left = deadline - g_get_monotonic_time ();
+        if (left <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        // Round up, so the deadline has passed when poll() times out.
+        rc = poll (&pfd, 1, (int)MIN((left + 999) / 1000, G_MAXINT));
+        if (rc > 0)
+            return 0;
+        if (rc < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+static int
+pipe_wait_readable(int fd, gint64 deadline)
+{
+    return deadline > 0 ? pipe_wait_fd (fd, POLLIN, deadline) : 0;
+}
+
+// Write all the buffers of "iov", advancing it past partial writes.
+static int
+pipe_write_v(int fd, PipeIOVec *iov, int iovcnt)
+{
+    return pipe_write_v_until (fd, iov, iovcnt, 0);
+}
+
+// With a deadline the socket is written without blocking, waiting for room
+// with poll() in between.
+static int
+pipe_write_v_until(int fd, PipeIOVec *iov, int iovcnt, gint64 deadline)
+{
+    struct msghdr msg;
+    ssize_t nwritten;
+
+    while (iovcnt > 0) {
+        memset (&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        if (deadline > 0) {
+            nwritten = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (pipe_wait_fd (fd, POLLOUT, deadline) < 0)
+                    return -1;
+                continue;
+            }
+        } else {
+            nwritten = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        }
+        if (nwritten <= 0) {
+            if (nwritten < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return 0;
+}
+
+static ssize_t
+pipe_reader_recv(PipeReader *reader, void *buf, size_t len)
+{
+    if (pipe_wait_readable (reader->fd, reader->deadline) < 0)
+        return -1;
+#if defined(RPCSYNCWERK_USE_SHM)
+    return rpcsyncwerk_shm_recv_some (reader->fd, buf, len, reader->fds,
+                                      PIPE_READER_MAX_FDS, &reader->n_fds);
+#else
+    return read (reader->fd, buf, len);
+#endif
+}
+
+// Read "n" bytes through the reader's buffer. Returns less than "n" on EOF.
+static ssize_t
+pipe_reader_read_n(PipeReader *reader, void *vptr, size_t n)
+{
+    size_t  nleft;
+    ssize_t nread;
+    char    *ptr;
+
+    ptr = vptr;
+    nleft = n;
+    while (nleft > 0) {
+        if (reader->start < reader->end) {
+            size_t chunk = MIN(nleft, reader->end - reader->start);
+            memcpy (ptr, reader->buf + reader->start, chunk);
+            reader->start += chunk;
+            nleft -= chunk;
+            ptr   += chunk;
+            continue;
+        }
+
+        if (nleft >= sizeof(reader->buf)) {
+            nread = pipe_reader_recv(reader, ptr, nleft);
+            if (nread > 0) {
+                nleft -= nread;
+                ptr   += nread;
+            }
+        } else {
+            nread = pipe_reader_recv(reader, reader->buf, sizeof(reader->buf));
+            if (nread > 0) {
+                reader->start = 0;
+                reader->end = nread;
+            }
+        }
+
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        } else if (nread == 0)
+            break;              /* EOF */
+    }
+    return(n - nleft);
+}
+
 #else // !defined(WIN32)
 
 ssize_t pipe_read_n (RpcsyncwerkNamedPipe fd, void *vptr, size_t n)
@@ -528,6 +3946,51 @@ ssize_t pipe_write_n(RpcsyncwerkNamedPipe fd, const void *vptr, size_t n)
     return 0;
 }
 
+// The reading side expects each buffer as a message of its own.
+static int
+pipe_write_v(RpcsyncwerkNamedPipe fd, PipeIOVec *iov, int iovcnt)
+{
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        pipe_write_n (fd, iov[i].iov_base, iov[i].iov_len);
+    return 0;
+}
+
+// Writes to a pipe in byte-blocking mode can't be bounded, only the waits for
+// responses are.
+static int
+pipe_write_v_until(RpcsyncwerkNamedPipe fd, PipeIOVec *iov, int iovcnt, gint64 deadline)
+{
+    return pipe_write_v (fd, iov, iovcnt);
+}
+
+// Named pipes can't be waited on without overlapped I/O, poll them instead.
+static int
+pipe_wait_readable(RpcsyncwerkNamedPipe fd, gint64 deadline)
+{
+    DWORD avail = 0;
+
+    if (deadline <= 0)
+        return 0;
+    while (PeekNamedPipe(fd, NULL, 0, NULL, &avail, NULL) && avail == 0) {
+        if (g_get_monotonic_time () >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        Sleep(1);
+    }
+    return 0;
+}
+
+static ssize_t
+pipe_reader_read_n(PipeReader *reader, void *vptr, size_t n)
+{
+    if (pipe_wait_readable (reader->fd, reader->deadline) < 0)
+        return -1;
+    return pipe_read_n (reader->fd, vptr, n);
+}
+
 static char *locale_to_utf8 (const gchar *src)
 {
     if (!src)
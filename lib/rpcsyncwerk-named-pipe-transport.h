@@ -18,6 +18,18 @@
 // functions on the server side may be called from different threads, and it's
 // the RPC functions implementation's responsibility to guarantee thread safety
 // of the RPC calls. (e.g. using mutexes).
+//
+// Alternatively the server can be started in epoll mode (linux only), where a
+// small fixed number of I/O threads multiplex all the connections with
+// non-blocking sockets, so the number of threads doesn't grow with the number
+// of connected clients.
+// Where liburing is available, the I/O threads can use io_uring instead,
+// saving most of the system calls per request.
+//
+// By default a RPC function runs on the thread that read the request. A
+// dispatch pool can be configured instead, to bound the number of RPC
+// functions running concurrently and keep slow functions from blocking the
+// I/O threads.
 
 #if defined(WIN32)
 typedef HANDLE RpcsyncwerkNamedPipe;
@@ -27,34 +39,243 @@ typedef int RpcsyncwerkNamedPipe;
 
 // Server side interface.
 
+typedef enum {
+    // One thread per connection.
+    RPCSYNCWERK_NAMED_PIPE_SERVER_THREADED = 0,
+    // A few I/O threads multiplexing all connections with epoll. Falls back to
+    // RPCSYNCWERK_NAMED_PIPE_SERVER_THREADED where epoll is not available.
+    RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL,
+    // Like RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL, but the I/O threads submit
+    // accepts, reads and writes in batches through io_uring. Requires a build
+    // with liburing, falls back to RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL
+    // otherwise or when the kernel doesn't support io_uring.
+    RPCSYNCWERK_NAMED_PIPE_SERVER_IO_URING,
+} RpcsyncwerkNamedPipeServerMode;
+
+struct _RpcsyncwerkNamedPipeIOLoop;
+
 struct _RpcsyncwerkNamedPipeServer {
     char path[4096];
     pthread_t listener_thread;
     GList *handlers;
     RpcsyncwerkNamedPipe pipe_fd;
+
+    RpcsyncwerkNamedPipeServerMode mode;
+    int n_io_loops;
+    struct _RpcsyncwerkNamedPipeIOLoop *io_loops;
+    guint next_io_loop;
+
+    int max_dispatch_workers;
+    int max_queued_requests;
+    GThreadPool *dispatch_pool;
+
+    gsize memfd_threshold;
 };
 
 typedef struct _RpcsyncwerkNamedPipeServer RpcsyncwerkNamedPipeServer;
 
 RpcsyncwerkNamedPipeServer* rpcsyncwerk_create_named_pipe_server(const char *path);
 
+// Start the server in RPCSYNCWERK_NAMED_PIPE_SERVER_THREADED mode.
 int rpcsyncwerk_named_pipe_server_start(RpcsyncwerkNamedPipeServer *server);
 
+// Start the server in the given mode. @n_io_threads is the number of I/O
+// threads used in epoll and io_uring modes, a value <= 0 means one per
+// processor. It's ignored in threaded mode.
+int rpcsyncwerk_named_pipe_server_start_with_mode(RpcsyncwerkNamedPipeServer *server,
+                                                  RpcsyncwerkNamedPipeServerMode mode,
+                                                  int n_io_threads);
+
+// Run the RPC functions on a pool of at most @max_workers threads. When more
+// than @max_queued_requests requests are waiting for a worker, new requests
+// are rejected with SERVER_BUSY_ERROR_CODE; a value <= 0 means no limit.
+// Must be called before the server is started.
+void rpcsyncwerk_named_pipe_server_set_dispatch_pool(RpcsyncwerkNamedPipeServer *server,
+                                                     int max_workers,
+                                                     int max_queued_requests);
+
+// Pass responses of at least @threshold bytes to pipelined clients in a
+// sealed memfd attached to the response frame, instead of through the socket.
+// The client maps it read-only and copies the result out of it, as the
+// transport returns responses in a buffer owned by the caller, so this is not
+// zero-copy. It saves pushing large results through the socket buffer in many
+// chunks. 0, the default, disables it. Linux only, not used for
+// io_uring and shared memory connections. Must be called before the server is
+// started.
+void rpcsyncwerk_named_pipe_server_set_memfd_threshold(RpcsyncwerkNamedPipeServer *server,
+                                                       gsize threshold);
+
+// Error code and message of the response to a request rejected because the
+// dispatch queue is full.
+#define SERVER_BUSY_ERROR "Server Busy"
+#define SERVER_BUSY_ERROR_CODE 502
+
 // Client side interface.
 
+struct _RpcsyncwerkShmChannel;
+struct _RpcsyncwerkPipeReader;
+
 struct _RpcsyncwerkNamedPipeClient {
     char path[4096];
     RpcsyncwerkNamedPipe pipe_fd;
+    // Buffers the responses read from pipe_fd.
+    struct _RpcsyncwerkPipeReader *reader;
+
+    // State of a pipelined connection.
+    gboolean pipelined;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t write_lock;
+    guint32 next_request_id;
+    GHashTable *pending_calls;
+    gboolean reading;
+    gboolean broken;
+
+    // Reader thread of an asynchronous connection, started on the first
+    // asynchronous call.
+    gboolean reader_running;
+    pthread_t reader_thread;
+    GMainContext *async_context;
+
+    // Shared memory channel requested when connecting.
+    guint32 shm_ring_size;
+    int shm_spin_us;
+    struct _RpcsyncwerkShmChannel *shm;
+
+    // Reconnect state, see rpcsyncwerk_named_pipe_client_set_reconnect().
+    gboolean reconnect;
+    int reconnect_min_ms;
+    int reconnect_max_ms;
+    int reconnect_delay_ms;
+    gint64 next_reconnect_time;
+    // Changes on every connect, so that the function handles resolved on a
+    // previous connection are not used on the new one.
+    gint generation;
 };
 
 typedef struct _RpcsyncwerkNamedPipeClient RpcsyncwerkNamedPipeClient;
 
 RpcsyncwerkNamedPipeClient* rpcsyncwerk_create_named_pipe_client(const char *path);
 
+// Use the versioned framing that tags each request with an id. Several
+// threads may then share the client and have their calls in flight on the
+// connection at the same time, and the server can answer them out of order.
+// Requires a server built with this version of the library. The timeout of
+// a call is passed on to the server, which skips the call if it is still
+// queued when the client stops waiting.
+void rpcsyncwerk_named_pipe_client_set_pipelined(RpcsyncwerkNamedPipeClient *client,
+                                                 gboolean pipelined);
+
+// Asynchronous calls (rpcsyncwerk_client_async_call__*) need a pipelined
+// client. Their responses are read by a reader thread. By default the
+// callbacks are run on that thread; if a context is set, they are run from
+// an idle source attached to it instead. Callbacks run on the reader thread
+// must not make synchronous calls on the same client. Must be called before
+// the first asynchronous call.
+void rpcsyncwerk_named_pipe_client_set_async_context(RpcsyncwerkNamedPipeClient *client,
+                                                     GMainContext *context);
+
+// Exchange the synchronous calls through a shared memory channel instead of
+// the socket, to save the system calls and copies of the socket. When
+// connecting, the client asks the server for a channel with two rings of
+// @ring_size bytes; the socket is then only used to notice when either side
+// goes away. A side waiting on the channel spins for up to @spin_us
+// microseconds before going to sleep, trading CPU time for latency. Calls
+// from several threads take turns on the channel, and asynchronous calls are
+// not supported. Where the server can't set up a channel the client keeps
+// using the socket. Linux only, and requires a server built with this version
+// of the library. Must be called before connecting.
+void rpcsyncwerk_named_pipe_client_set_shared_memory(RpcsyncwerkNamedPipeClient *client,
+                                                     guint32 ring_size,
+                                                     int spin_us);
+
+// Reconnect lazily once the connection is broken: the next call opens a new
+// connection instead of failing. After a failed attempt, calls fail without
+// trying to connect for a delay that starts at @min_delay_ms and doubles on
+// every failure up to @max_delay_ms, with some jitter so that the clients of
+// a restarted server don't all come back at once. A delay <= 0 takes the
+// default (100 ms and 10 s). Pipelined calls in flight when the connection
+// breaks still fail, unless their function is marked idempotent with
+// rpcsyncwerk_named_pipe_transport_set_idempotent().
+void rpcsyncwerk_named_pipe_client_set_reconnect(RpcsyncwerkNamedPipeClient *client,
+                                                 int min_delay_ms,
+                                                 int max_delay_ms);
+
 RpcsyncwerkClient * rpcsyncwerk_client_with_named_pipe_transport(RpcsyncwerkNamedPipeClient *client, const char *service);
 
+// Returns -1 if the server can't be reached. With reconnect set the next
+// call tries again.
 int rpcsyncwerk_named_pipe_client_connect(RpcsyncwerkNamedPipeClient *client);
 
+// Mark the function @fname of the service of @client as safe to run twice. A
+// synchronous call to it that fails because the connection broke is sent once
+// more on a new connection, where the client reconnects or the pool opens
+// one. Must be called before the first call.
+void rpcsyncwerk_named_pipe_transport_set_idempotent (RpcsyncwerkClient *client,
+                                                      const char *fname);
+
+// Also frees the named pipe client, or for a client of a pool, only the
+// client.
 void rpcsyncwerk_free_client_with_pipe_transport (RpcsyncwerkClient *client);
 
+// A pool of connections to the same server, safe to call from any number of
+// threads. Each synchronous call takes an idle connection for its duration,
+// opening a new one while there are less than max_connections, and otherwise
+// waits for one to be released. Connections that fail a call are closed and
+// reopened on demand, see rpcsyncwerk_named_pipe_client_pool_set_reconnect()
+// for when the server can't be reached. Asynchronous calls are not supported.
+
+struct _RpcsyncwerkNamedPipeClientPool {
+    char path[4096];
+    int max_connections;
+
+    // Options of the connections, see the named pipe client functions.
+    gboolean pipelined;
+    guint32 shm_ring_size;
+    int shm_spin_us;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GQueue idle;
+    int n_connections;
+
+    // Backoff between failed attempts to open a connection.
+    int reconnect_min_ms;
+    int reconnect_max_ms;
+    int reconnect_delay_ms;
+    gint64 next_reconnect_time;
+};
+
+typedef struct _RpcsyncwerkNamedPipeClientPool RpcsyncwerkNamedPipeClientPool;
+
+// A @max_connections <= 0 means one per processor. Connections are opened on
+// the first calls that need them.
+RpcsyncwerkNamedPipeClientPool *
+rpcsyncwerk_create_named_pipe_client_pool (const char *path, int max_connections);
+
+// Apply rpcsyncwerk_named_pipe_client_set_pipelined() or
+// rpcsyncwerk_named_pipe_client_set_shared_memory() to the connections. Must
+// be called before the first call.
+void rpcsyncwerk_named_pipe_client_pool_set_pipelined (RpcsyncwerkNamedPipeClientPool *pool,
+                                                       gboolean pipelined);
+void rpcsyncwerk_named_pipe_client_pool_set_shared_memory (RpcsyncwerkNamedPipeClientPool *pool,
+                                                           guint32 ring_size,
+                                                           int spin_us);
+
+// After failing to open a connection, calls that need a new one fail without
+// trying to connect for a delay with the same backoff as
+// rpcsyncwerk_named_pipe_client_set_reconnect(). Calls on the idle
+// connections go on. Defaults to 100 ms and 10 s.
+void rpcsyncwerk_named_pipe_client_pool_set_reconnect (RpcsyncwerkNamedPipeClientPool *pool,
+                                                       int min_delay_ms,
+                                                       int max_delay_ms);
+
+// Any number of clients, for different services, can share a pool. Free them
+// with rpcsyncwerk_free_client_with_pipe_transport().
+RpcsyncwerkClient *rpcsyncwerk_client_with_named_pipe_pool (RpcsyncwerkNamedPipeClientPool *pool,
+                                                            const char *service);
+
+// Close the connections. No call must be in progress.
+void rpcsyncwerk_named_pipe_client_pool_free (RpcsyncwerkNamedPipeClientPool *pool);
+
 #endif // RPCSYNCWERK_NAMED_PIPE_TRANSPORT_H
@@ -1,9 +1,16 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <jansson.h>
 
 #include "rpcsyncwerk-server.h"
@@ -17,72 +24,344 @@ struct FuncItem;
 
 typedef struct MarshalItem {
     RpcsyncwerkMarshalFunc mfunc;
+    /* for the asynchronous functions of the signature */
+    RpcsyncwerkAsyncMarshalFunc amfunc;
     gchar *signature;
+    /* the signature is a constant from the generated header, not owned */
+    gboolean static_signature;
 } MarshalItem;
 
 typedef struct FuncItem {
     void        *func;
     gchar       *fname;
+    /* the service the function is registered to */
+    gchar       *svc_name;
     MarshalItem *marshal;
+    guint        handle;
+    gboolean     async;
+    volatile gint refcount;
 } FuncItem;
 
+struct _RpcsyncwerkReply {
+    /* keeps the parameters passed to the function valid */
+    json_t *params;
+    gint64 deadline;
+    RpcsyncwerkReplyFunc func;
+    void *user_data;
+    /* service of the function, owns the stream it may reply with */
+    char *svc_name;
+};
+
 typedef struct {
     char *name;
     GHashTable *func_table;
+    volatile gint refcount;
 } RpcsyncwerkService;
 
+/* An immutable snapshot of the registered services and functions. Calls
+ * look functions up in the current one without locking, updates publish a
+ * modified copy. Services and functions are shared between snapshots. */
+typedef struct {
+    GHashTable *services;
+    /* All registered functions, indexed by handle. Handles are not reused,
+     * the slot of a removed function is NULL. */
+    GPtrArray *func_items;
+    volatile gint refcount;
+} Registry;
+
 static GHashTable *marshal_table;
-static GHashTable *service_table;
+static Registry *volatile registry;
+/* Serializes the updates of the registry and the marshal table. */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+/* The copy of the registry being updated, published by the updater at the
+ * end of the update. While registry_batch is set, e.g. when registering the
+ * functions at startup, updates modify it in place and are published
+ * together. All guarded by registry_lock. */
+static Registry *registry_pending;
+static gboolean registry_pending_changed;
+static gboolean registry_batch;
+/* Readers that may have loaded the registry without holding a reference
+ * yet, counted by the phase they started in. */
+static volatile gint registry_phase;
+static volatile gint registry_readers[2];
+/* Points to the deadline of the call running on each thread. */
+static pthread_key_t call_deadline_key;
+static pthread_once_t call_deadline_once = PTHREAD_ONCE_INIT;
+/* Helps running the calls of a batch in parallel, NULL to run them on the
+ * calling thread only. */
+static GThreadPool *batch_pool;
+static int batch_threads;
+
+static FuncItem *
+func_item_ref (FuncItem *item)
+{
+    g_atomic_int_inc (&item->refcount);
+    return item;
+}
 
 static void
-func_item_free (FuncItem *item)
+func_item_unref (FuncItem *item)
 {
+    if (!item || !g_atomic_int_dec_and_test (&item->refcount))
+        return;
     g_free (item->fname);
+    g_free (item->svc_name);
     g_free (item);
 }
 
 static void
 marshal_item_free (MarshalItem *item)
 {
-    g_free (item->signature);
+    if (!item->static_signature)
+        g_free (item->signature);
     g_free (item);
 }
 
-int
-rpcsyncwerk_create_service (const char *svc_name)
+static RpcsyncwerkService *
+service_new (const char *svc_name)
 {
-    RpcsyncwerkService *service;
-
-    if (!svc_name)
-        return -1;
-
-    if (g_hash_table_lookup (service_table, svc_name) != NULL)
-        return 0;
+    RpcsyncwerkService *service = g_new0 (RpcsyncwerkService, 1);
 
-    service = g_new0 (RpcsyncwerkService, 1);
     service->name = g_strdup(svc_name);
     service->func_table = g_hash_table_new_full (g_str_hash, g_str_equal, 
-                                                 NULL, (GDestroyNotify)func_item_free);
+                                                 NULL, (GDestroyNotify)func_item_unref);
+    service->refcount = 1;
+    return service;
+}
 
-    g_hash_table_insert (service_table, service->name, service);
+static RpcsyncwerkService *
+service_copy (RpcsyncwerkService *service)
+{
+    RpcsyncwerkService *copy = service_new (service->name);
+    GHashTableIter iter;
+    gpointer value;
 
-    return 0;
+    g_hash_table_iter_init (&iter, service->func_table);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        FuncItem *item = value;
+        g_hash_table_insert (copy->func_table, item->fname, func_item_ref (item));
+    }
+    return copy;
+}
+
+static RpcsyncwerkService *
+service_ref (RpcsyncwerkService *service)
+{
+    g_atomic_int_inc (&service->refcount);
+    return service;
 }
 
 static void
-service_free (RpcsyncwerkService *service)
+service_unref (RpcsyncwerkService *service)
 {
+    if (!g_atomic_int_dec_and_test (&service->refcount))
+        return;
     g_free (service->name);
     g_hash_table_destroy (service->func_table);
     g_free (service);
 }
 
+static Registry *
+registry_new (void)
+{
+    Registry *reg = g_new0 (Registry, 1);
+
+    reg->services = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, (GDestroyNotify)service_unref);
+    reg->func_items = g_ptr_array_new_with_free_func ((GDestroyNotify)func_item_unref);
+    reg->refcount = 1;
+    return reg;
+}
+
+/* A copy of the current registry, must hold registry_lock. */
+static Registry *
+registry_copy (void)
+{
+    Registry *reg = registry_new ();
+    GHashTableIter iter;
+    gpointer value;
+    guint i;
+
+    g_hash_table_iter_init (&iter, registry->services);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        RpcsyncwerkService *service = value;
+        g_hash_table_insert (reg->services, service->name, service_ref (service));
+    }
+
+    g_ptr_array_set_size (reg->func_items, registry->func_items->len);
+    for (i = 0; i < registry->func_items->len; i++) {
+        FuncItem *item = g_ptr_array_index (registry->func_items, i);
+        if (item)
+            g_ptr_array_index (reg->func_items, i) = func_item_ref (item);
+    }
+    return reg;
+}
+
+static void
+registry_unref (Registry *reg)
+{
+    if (!g_atomic_int_dec_and_test (&reg->refcount))
+        return;
+    g_hash_table_destroy (reg->services);
+    g_ptr_array_free (reg->func_items, TRUE);
+    g_free (reg);
+}
+
+/* Get a reference to the current registry. Doesn't block, even while the
+ * registry is being updated. */
+static Registry *
+registry_acquire (void)
+{
+    Registry *reg;
+    gint phase;
+
+    phase = g_atomic_int_get (&registry_phase);
+
+    g_atomic_int_inc (&registry_readers[phase]);
+    reg = g_atomic_pointer_get (&registry);
+    g_atomic_int_inc (&reg->refcount);
+    g_atomic_int_add (&registry_readers[phase], -1);
+
+    return reg;
+}
+
+/* Make @reg the current registry, must hold registry_lock. */
+static void
+registry_publish (Registry *reg)
+{
+    Registry *old = registry;
+    gint phase;
+    int i;
+
+    g_atomic_pointer_set (&registry, reg);
+
+    /* Wait for the readers that may have loaded the old registry to take
+     * their reference. The first flip lets new readers count in the other
+     * phase, the second catches those that read the phase before it. */
+    for (i = 0; i < 2; i++) {
+        phase = g_atomic_int_get (&registry_phase);
+        g_atomic_int_set (&registry_phase, phase ^ 1);
+        while (g_atomic_int_get (&registry_readers[phase]) > 0)
+            g_thread_yield ();
+    }
+
+    if (old)
+        registry_unref (old);
+}
+
+/* The registry to apply an update to, must hold registry_lock. Call
+ * registry_updated() if it was changed, and registry_edit_done() before
+ * releasing the lock. */
+static Registry *
+registry_edit (void)
+{
+    if (!registry_pending)
+        registry_pending = registry_copy ();
+    return registry_pending;
+}
+
+static void
+registry_updated (void)
+{
+    registry_pending_changed = TRUE;
+}
+
+/* Publish the pending updates unless in a batch, must hold registry_lock. */
+static void
+registry_edit_done (void)
+{
+    if (registry_batch || !registry_pending)
+        return;
+
+    if (registry_pending_changed)
+        registry_publish (registry_pending);
+    else
+        registry_unref (registry_pending);
+    registry_pending = NULL;
+    registry_pending_changed = FALSE;
+}
+
+/* @service of @reg to modify. It's copied unless only @reg, which is not
+ * published yet, has it. */
+static RpcsyncwerkService *
+registry_edit_service (Registry *reg, RpcsyncwerkService *service)
+{
+    if (g_atomic_int_get (&service->refcount) == 1)
+        return service;
+
+    service = service_copy (service);
+    g_hash_table_replace (reg->services, service->name, service);
+    return service;
+}
+
+static void
+registry_clear_handle (Registry *reg, FuncItem *item)
+{
+    func_item_unref (g_ptr_array_index (reg->func_items, item->handle));
+    g_ptr_array_index (reg->func_items, item->handle) = NULL;
+}
+
+/* Drop function @fname of @service, or all its functions if @fname is NULL,
+ * from the handles of @reg. */
+static void
+registry_clear_handles (Registry *reg, RpcsyncwerkService *service,
+                        const char *fname)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (fname) {
+        FuncItem *item = g_hash_table_lookup (service->func_table, fname);
+        if (item)
+            registry_clear_handle (reg, item);
+        return;
+    }
+
+    g_hash_table_iter_init (&iter, service->func_table);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        registry_clear_handle (reg, value);
+}
+
+int
+rpcsyncwerk_create_service (const char *svc_name)
+{
+    Registry *reg;
+
+    if (!svc_name)
+        return -1;
+
+    pthread_mutex_lock (&registry_lock);
+    reg = registry_edit ();
+    if (g_hash_table_lookup (reg->services, svc_name) == NULL) {
+        RpcsyncwerkService *service = service_new (svc_name);
+        g_hash_table_insert (reg->services, service->name, service);
+        registry_updated ();
+    }
+    registry_edit_done ();
+    pthread_mutex_unlock (&registry_lock);
+
+    return 0;
+}
+
 void
 rpcsyncwerk_remove_service (const char *svc_name)
 {
+    RpcsyncwerkService *service;
+    Registry *reg;
+
     if (!svc_name)
         return;
-    g_hash_table_remove (service_table, svc_name);
+
+    pthread_mutex_lock (&registry_lock);
+    reg = registry_edit ();
+    service = g_hash_table_lookup (reg->services, svc_name);
+    if (service) {
+        registry_clear_handles (reg, service, NULL);
+        g_hash_table_remove (reg->services, svc_name);
+        registry_updated ();
+    }
+    registry_edit_done ();
+    pthread_mutex_unlock (&registry_lock);
 }
 
 /* Marshal functions */
@@ -158,6 +437,131 @@ rpcsyncwerk_marshal_set_ret_common (json_t *object, gsize *len,  GError *error)
     return data;
 }
 
+/* Direct writers for the return value of a marshal. They produce the same
+ * response as the rpcsyncwerk_set_*_to_ret_object() functions followed by
+ * rpcsyncwerk_marshal_set_ret_common(), but append it to a single buffer
+ * instead of building a json_t tree and dumping it. */
+
+static GString *
+marshal_ret_begin (gsize size_hint)
+{
+    GString *out = g_string_sized_new (size_hint);
+    g_string_append (out, "{\"ret\":");
+    return out;
+}
+
+static char *
+marshal_ret_end (GString *out, GError *error, gsize *len)
+{
+    if (error) {
+        g_string_append_printf (out, ",\"err_code\":%d,\"err_msg\":", error->code);
+        if (!error->message || !json_buffer_append_string (out, error->message))
+            g_string_append (out, "null");
+        g_error_free (error);
+    }
+    g_string_append_c (out, '}');
+
+    *len = out->len;
+    return g_string_free (out, FALSE);
+}
+
+char *
+rpcsyncwerk_marshal_string_ret (char *ret, GError *error, gsize *len)
+{
+    GString *out;
+
+    if (ret != NULL && !g_utf8_validate (ret, -1, NULL)) {
+        /* keep the old behaviour for strings jansson cannot hold */
+        json_t *object = json_object ();
+        rpcsyncwerk_set_string_to_ret_object (object, ret);
+        return rpcsyncwerk_marshal_set_ret_common (object, len, error);
+    }
+
+    out = marshal_ret_begin (ret ? strlen(ret) + 32 : 32);
+    if (ret == NULL)
+        g_string_append (out, "null");
+    else {
+        json_buffer_append_string (out, ret);
+        g_free (ret);
+    }
+    return marshal_ret_end (out, error, len);
+}
+
+char *
+rpcsyncwerk_marshal_int_ret (json_int_t ret, GError *error, gsize *len)
+{
+    GString *out = marshal_ret_begin (32);
+
+    g_string_append_printf (out, "%" JSON_INTEGER_FORMAT, ret);
+    return marshal_ret_end (out, error, len);
+}
+
+char *
+rpcsyncwerk_marshal_object_ret (GObject *ret, GError *error, gsize *len)
+{
+    GString *out = marshal_ret_begin (256);
+
+    if (ret == NULL)
+        g_string_append (out, "null");
+    else {
+        json_gobject_serialize_to_buffer (ret, out);
+        g_object_unref (ret);
+    }
+    return marshal_ret_end (out, error, len);
+}
+
+char *
+rpcsyncwerk_marshal_objlist_ret (GList *ret, GError *error, gsize *len)
+{
+    GString *out = marshal_ret_begin (4096);
+    GList *ptr;
+
+    if (ret == NULL)
+        g_string_append (out, "null");
+    else {
+        g_string_append_c (out, '[');
+        for (ptr = ret; ptr; ptr = ptr->next) {
+            if (ptr != ret)
+                g_string_append_c (out, ',');
+            json_gobject_serialize_to_buffer (ptr->data, out);
+            /* drop each object as soon as it is written */
+            g_object_unref (ptr->data);
+        }
+        g_string_append_c (out, ']');
+        g_list_free (ret);
+    }
+    return marshal_ret_end (out, error, len);
+}
+
+static int
+append_to_gstring (const char *buffer, size_t size, void *data)
+{
+    g_string_append_len ((GString *)data, buffer, size);
+    return 0;
+}
+
+char *
+rpcsyncwerk_marshal_json_ret (json_t *ret, GError *error, gsize *len)
+{
+    GString *out;
+
+    if (ret != NULL && !json_is_object (ret) && !json_is_array (ret)) {
+        /* json_dump_callback() only encodes objects and arrays */
+        json_t *object = json_object ();
+        rpcsyncwerk_set_json_to_ret_object (object, ret);
+        return rpcsyncwerk_marshal_set_ret_common (object, len, error);
+    }
+
+    out = marshal_ret_begin (256);
+    if (ret == NULL)
+        g_string_append (out, "null");
+    else {
+        json_dump_callback (ret, append_to_gstring, out, JSON_COMPACT);
+        json_decref (ret);
+    }
+    return marshal_ret_end (out, error, len);
+}
+
 char *
 error_to_json (int code, const char *msg, gsize *len)
 {
@@ -174,134 +578,1204 @@ error_to_json (int code, const char *msg, gsize *len)
     return data;
 }
 
-void
-rpcsyncwerk_server_init (RegisterMarshalFunc register_func)
+/* Condition variables timed on the monotonic clock, so that changing the
+ * system time doesn't stretch or cut the waits short. */
+static pthread_condattr_t monotonic_condattr;
+static pthread_once_t monotonic_condattr_once = PTHREAD_ONCE_INIT;
+
+static void
+create_monotonic_condattr (void)
 {
-    marshal_table = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                           NULL, (GDestroyNotify)marshal_item_free);
-    service_table = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                           NULL, (GDestroyNotify)service_free);
+    pthread_condattr_init (&monotonic_condattr);
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+    pthread_condattr_setclock (&monotonic_condattr, CLOCK_MONOTONIC);
+#endif
+}
 
-    register_func ();
+static void
+monotonic_cond_init (pthread_cond_t *cond)
+{
+    pthread_once (&monotonic_condattr_once, create_monotonic_condattr);
+    pthread_cond_init (cond, &monotonic_condattr);
 }
 
-void
-rpcsyncwerk_server_final()
+/* Wait on @cond, initialized with monotonic_cond_init(), until @deadline in
+ * g_get_monotonic_time() microseconds. Returns ETIMEDOUT once it has passed. */
+static int
+monotonic_cond_wait_until (pthread_cond_t *cond, pthread_mutex_t *lock,
+                           gint64 deadline)
 {
-    g_hash_table_destroy (service_table);
-    g_hash_table_destroy (marshal_table);
+    struct timespec ts;
+    gint64 left, abs_time;
+
+    left = deadline - g_get_monotonic_time ();
+    if (left <= 0)
+        return ETIMEDOUT;
+
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    abs_time = (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000 + left;
+#else
+    /* The wait can only be timed on the real time. */
+    abs_time = g_get_real_time () + left;
+#endif
+    ts.tv_sec = abs_time / G_USEC_PER_SEC;
+    ts.tv_nsec = (abs_time % G_USEC_PER_SEC) * 1000;
+    return pthread_cond_timedwait (cond, lock, &ts);
 }
 
-gboolean 
-rpcsyncwerk_server_register_marshal (gchar *signature, RpcsyncwerkMarshalFunc marshal)
+/* Object streams. The first chunk of a stream is returned by its function,
+ * the client pulls the following ones by sending {"stream": <id>}. */
+
+struct _RpcsyncwerkObjStream {
+    RpcsyncwerkObjStreamNext next;
+    void *data;
+    GDestroyNotify destroy;
+    gint64 id;
+    gint64 last_used;
+    /* Only calls to this service may pull from the stream, NULL if it was
+     * created outside of a call. */
+    char *svc_name;
+};
+
+/* Drop the streams the client hasn't pulled from for this long. */
+#define STREAM_IDLE_TIMEOUT (60 * G_USEC_PER_SEC)
+#define STREAM_DEFAULT_CHUNK_SIZE (64 * 1024)
+
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+/* The open streams that are not being read from, by id. */
+static GHashTable *stream_table;
+/* Stream ids are derived from a counter and a random key, so that a client
+ * can't guess the ids of the streams of other clients. */
+static guint64 stream_counter;
+static guint8 stream_id_key[32];
+static gboolean stream_id_key_set;
+/* Drops the idle streams. Started with the first stream, exits once there
+ * are none left. stream_sweeper_joinable is set until it is joined. */
+static pthread_t stream_sweeper;
+static gboolean stream_sweeper_running;
+static gboolean stream_sweeper_joinable;
+static pthread_cond_t stream_sweeper_cond;
+static pthread_once_t stream_sweeper_once = PTHREAD_ONCE_INIT;
+static gsize stream_chunk_size = STREAM_DEFAULT_CHUNK_SIZE;
+/* Points to the service of the function running on each thread, which
+ * owns the streams it returns. */
+static pthread_key_t call_service_key;
+static pthread_once_t call_service_once = PTHREAD_ONCE_INIT;
+
+RpcsyncwerkObjStream *
+rpcsyncwerk_obj_stream_new (RpcsyncwerkObjStreamNext next, void *data,
+                            GDestroyNotify destroy)
 {
-    MarshalItem *mitem;
+    RpcsyncwerkObjStream *stream;
 
-    g_assert (signature != NULL && marshal != NULL);
+    g_return_val_if_fail (next != NULL, NULL);
 
-    if (g_hash_table_lookup (marshal_table, signature) != NULL) {
-        g_warning ("[Sea RPC] cannot register duplicate marshal.\n");
-        g_free (signature);
-        return FALSE;
-    }
+    stream = g_new0 (RpcsyncwerkObjStream, 1);
+    stream->next = next;
+    stream->data = data;
+    stream->destroy = destroy;
+    return stream;
+}
+
+static void
+obj_stream_free (RpcsyncwerkObjStream *stream)
+{
+    if (stream->destroy)
+        stream->destroy (stream->data);
+    g_free (stream->svc_name);
+    g_free (stream);
+}
 
-    mitem = g_new0 (MarshalItem, 1);
-    mitem->mfunc = marshal;
-    mitem->signature = signature;
-    g_hash_table_insert (marshal_table, (gpointer)mitem->signature, mitem);
+void
+rpcsyncwerk_server_set_stream_chunk_size (gsize size)
+{
+    stream_chunk_size = size > 0 ? size : STREAM_DEFAULT_CHUNK_SIZE;
+}
 
-    return TRUE;
+static void
+create_call_service_key (void)
+{
+    pthread_key_create (&call_service_key, NULL);
 }
 
-gboolean 
-rpcsyncwerk_server_register_function (const char *svc_name,
-                                 void *func, const gchar *fname, gchar *signature)
+/* Make @svc_name the service of the function running on this thread,
+ * returns the previous one. */
+static const char *
+set_call_service (const char *svc_name)
 {
-    RpcsyncwerkService *service;
-    FuncItem *item;
-    MarshalItem *mitem;
+    const char *saved;
 
-    g_assert (svc_name != NULL && func != NULL && fname != NULL && signature != NULL);
+    pthread_once (&call_service_once, create_call_service_key);
+    saved = pthread_getspecific (call_service_key);
+    pthread_setspecific (call_service_key, svc_name);
+    return saved;
+}
 
-    service = g_hash_table_lookup (service_table, svc_name);
-    if (!service)
-        return FALSE;
+/* A new unique stream id, must hold stream_lock. */
+static gint64
+stream_new_id (void)
+{
+    GChecksum *cksum;
+    guint8 digest[32];
+    gsize digest_len;
+    gint64 id;
+    int i;
 
-    mitem = g_hash_table_lookup (marshal_table, signature);
-    if (!mitem) {
-        g_free (signature);
-        return FALSE;
+    if (!stream_id_key_set) {
+        GRand *rand = g_rand_new ();
+        for (i = 0; i < (int)sizeof(stream_id_key); i++)
+            stream_id_key[i] = g_rand_int (rand);
+        g_rand_free (rand);
+        stream_id_key_set = TRUE;
     }
 
-    item = g_new0 (FuncItem, 1);
-    item->marshal = mitem;
-    item->fname = g_strdup(fname);
-    item->func = func;
+    do {
+        stream_counter++;
+        cksum = g_checksum_new (G_CHECKSUM_SHA256);
+        g_checksum_update (cksum, stream_id_key, sizeof(stream_id_key));
+        g_checksum_update (cksum, (const guchar *)&stream_counter, sizeof(stream_counter));
+        digest_len = sizeof(digest);
+        g_checksum_get_digest (cksum, digest, &digest_len);
+        g_checksum_free (cksum);
 
-    g_hash_table_insert (service->func_table, (gpointer)item->fname, item);
+        memcpy (&id, digest, sizeof(id));
+        /* Positive, 0 means the stream is done. */
+        id &= G_MAXINT64;
+    } while (id == 0 || g_hash_table_lookup (stream_table, &id) != NULL);
 
-    g_free (signature);
-    return TRUE;
+    return id;
 }
 
-/* Called by RPC transport. */
-char* 
-rpcsyncwerk_server_call_function (const char *svc_name,
-                             gchar *func, gsize len, gsize *ret_len)
+/* Free the streams that have been idle for too long. Called with
+ * stream_lock held, releases it while freeing. */
+static void
+stream_sweep (void)
 {
-    RpcsyncwerkService *service;
-    json_t *array;
-    char* ret;
-    json_error_t jerror;
-    GError *error = NULL;
+    gint64 now = g_get_monotonic_time ();
+    GList *expired = NULL, *ptr;
+    GHashTableIter iter;
+    gpointer value;
 
-#ifdef PROFILE
-    struct timeval start, end, intv;
+    g_hash_table_iter_init (&iter, stream_table);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        RpcsyncwerkObjStream *stream = value;
+        if (now - stream->last_used >= STREAM_IDLE_TIMEOUT) {
+            g_hash_table_iter_steal (&iter);
+            expired = g_list_prepend (expired, stream);
+        }
+    }
+    if (!expired)
+        return;
 
-    gettimeofday(&start, NULL);
-#endif
+    /* The destroy functions may take their own locks. */
+    pthread_mutex_unlock (&stream_lock);
+    for (ptr = expired; ptr; ptr = ptr->next)
+        obj_stream_free (ptr->data);
+    g_list_free (expired);
+    pthread_mutex_lock (&stream_lock);
+}
 
-    service = g_hash_table_lookup (service_table, svc_name);
-    if (!service) {
-        char buf[256];
-        snprintf (buf, 255, "cannot find service %s.", svc_name);
-        return error_to_json (501, buf, ret_len);
-    }
-    
-    array = json_loadb (func, len, 0 ,&jerror);
-    
-    if (!array) {
-        char buf[512];
-        setjetoge(&jerror,&error);
-        snprintf (buf, 511, "failed to load RPC call: %s\n", error->message);
-        json_decref (array);        
-        g_error_free(error);
-        return error_to_json (511, buf, ret_len);
-    }
+/* When the next stream expires, or 0 if there are none. Must hold
+ * stream_lock. */
+static gint64
+stream_next_expiry (void)
+{
+    gint64 next = 0;
+    GHashTableIter iter;
+    gpointer value;
 
-    const char *fname = json_string_value (json_array_get(array, 0));
-    FuncItem *fitem = g_hash_table_lookup(service->func_table, fname);
-    if (!fitem) {
-        char buf[256];
-        snprintf (buf, 255, "cannot find function %s.", fname);
-        json_decref (array);
-        return error_to_json (500, buf, ret_len);
+    g_hash_table_iter_init (&iter, stream_table);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        RpcsyncwerkObjStream *stream = value;
+        if (next == 0 || stream->last_used + STREAM_IDLE_TIMEOUT < next)
+            next = stream->last_used + STREAM_IDLE_TIMEOUT;
     }
+    return next;
+}
 
-    ret = fitem->marshal->mfunc (fitem->func, array, ret_len);
-
-#ifdef PROFILE
+static void
+create_stream_sweeper_cond (void)
+{
+    monotonic_cond_init (&stream_sweeper_cond);
+}
+
+static void *
+stream_sweep_thread (void *arg)
+{
+    gint64 next;
+
+    pthread_mutex_lock (&stream_lock);
+    while (stream_sweeper_running) {
+        /* New streams expire after the ones already there, so sleeping
+         * until the first one expires is enough. */
+        next = stream_next_expiry ();
+        if (next == 0) {
+            stream_sweeper_running = FALSE;
+            break;
+        }
+        if (monotonic_cond_wait_until (&stream_sweeper_cond, &stream_lock,
+                                       next) == ETIMEDOUT)
+            stream_sweep ();
+    }
+    pthread_mutex_unlock (&stream_lock);
+
+    return NULL;
+}
+
+/* Keep @stream until the client pulls the next chunk, returns its id. */
+static gint64
+stream_put (RpcsyncwerkObjStream *stream)
+{
+    gint64 id;
+
+    if (stream->id == 0 && !stream->svc_name) {
+        pthread_once (&call_service_once, create_call_service_key);
+        stream->svc_name = g_strdup (pthread_getspecific (call_service_key));
+    }
+
+    pthread_mutex_lock (&stream_lock);
+    if (stream->id == 0)
+        stream->id = stream_new_id ();
+    stream->last_used = g_get_monotonic_time ();
+    g_hash_table_insert (stream_table, &stream->id, stream);
+    /* The stream may be freed once the lock is released. */
+    id = stream->id;
+
+    if (!stream_sweeper_running) {
+        /* The previous sweeper is done with the lock once it has cleared
+         * stream_sweeper_running. */
+        if (stream_sweeper_joinable) {
+            pthread_join (stream_sweeper, NULL);
+            stream_sweeper_joinable = FALSE;
+        }
+        pthread_once (&stream_sweeper_once, create_stream_sweeper_cond);
+        stream_sweeper_running = TRUE;
+        if (pthread_create (&stream_sweeper, NULL, stream_sweep_thread, NULL) != 0) {
+            g_warning ("failed to start the stream sweeper thread.\n");
+            stream_sweeper_running = FALSE;
+        } else {
+            stream_sweeper_joinable = TRUE;
+        }
+    }
+    pthread_mutex_unlock (&stream_lock);
+
+    return id;
+}
+
+static void
+stream_sweeper_stop (void)
+{
+    gboolean joinable;
+
+    pthread_mutex_lock (&stream_lock);
+    joinable = stream_sweeper_joinable;
+    stream_sweeper_joinable = FALSE;
+    if (stream_sweeper_running) {
+        stream_sweeper_running = FALSE;
+        pthread_cond_signal (&stream_sweeper_cond);
+    }
+    pthread_mutex_unlock (&stream_lock);
+
+    if (joinable)
+        pthread_join (stream_sweeper, NULL);
+}
+
+/* Take the stream @id of @svc_name out of the table, so that only one
+ * thread reads it. */
+static RpcsyncwerkObjStream *
+stream_take (gint64 id, const char *svc_name)
+{
+    RpcsyncwerkObjStream *stream;
+
+    pthread_mutex_lock (&stream_lock);
+    stream = g_hash_table_lookup (stream_table, &id);
+    /* The stream of another service is reported as missing. */
+    if (stream && stream->svc_name && g_strcmp0 (stream->svc_name, svc_name) != 0)
+        stream = NULL;
+    if (stream)
+        g_hash_table_steal (stream_table, &id);
+    pthread_mutex_unlock (&stream_lock);
+
+    return stream;
+}
+
+/* Write the next chunk of @stream to @out and finish the response. Frees
+ * @stream if it is done, keeps it for the next pull otherwise. */
+static char *
+stream_chunk_ret (RpcsyncwerkObjStream *stream, GString *out, gsize *len)
+{
+    gsize start = out->len;
+    gboolean done = FALSE;
+    GError *error = NULL;
+    GObject *obj;
+
+    g_string_append_c (out, '[');
+    while (out->len - start < stream_chunk_size) {
+        obj = stream->next (stream->data, &error);
+        if (!obj) {
+            done = TRUE;
+            break;
+        }
+        if (out->len - start > 1)
+            g_string_append_c (out, ',');
+        json_gobject_serialize_to_buffer (obj, out);
+        g_object_unref (obj);
+    }
+    g_string_append_c (out, ']');
+
+    if (error) {
+        g_string_truncate (out, start);
+        g_string_append (out, "null");
+    }
+
+    if (done) {
+        obj_stream_free (stream);
+    } else {
+        gint64 id = stream_put (stream);
+        g_string_append_printf (out, ",\"stream\":%" G_GINT64_FORMAT, id);
+    }
+    return marshal_ret_end (out, error, len);
+}
+
+char *
+rpcsyncwerk_marshal_objstream_ret (RpcsyncwerkObjStream *ret, GError *error, gsize *len)
+{
+    GString *out = marshal_ret_begin (4096);
+
+    if (ret == NULL || error != NULL) {
+        if (ret)
+            obj_stream_free (ret);
+        g_string_append (out, "null");
+        return marshal_ret_end (out, error, len);
+    }
+    return stream_chunk_ret (ret, out, len);
+}
+
+/* Answer a {"stream": <id>} request for the next chunk of a stream, or a
+ * {"stream": <id>, "close": true} one to drop it. */
+static char *
+call_stream_request (RpcsyncwerkService *service, json_t *request, gsize *ret_len)
+{
+    RpcsyncwerkObjStream *stream;
+    GString *out;
+
+    stream = stream_take (json_integer_value (json_object_get (request, "stream")),
+                          service->name);
+    if (!stream)
+        return error_to_json (500, "cannot find stream.", ret_len);
+
+    out = marshal_ret_begin (4096);
+    if (json_is_true (json_object_get (request, "close"))) {
+        obj_stream_free (stream);
+        g_string_append (out, "null");
+        return marshal_ret_end (out, NULL, ret_len);
+    }
+    return stream_chunk_ret (stream, out, ret_len);
+}
+
+void
+rpcsyncwerk_server_init (RegisterMarshalFunc register_func)
+{
+    marshal_table = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, (GDestroyNotify)marshal_item_free);
+    registry = registry_new ();
+    stream_table = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                          NULL, (GDestroyNotify)obj_stream_free);
+
+    /* Publish all the functions registered at startup at once. */
+    pthread_mutex_lock (&registry_lock);
+    registry_batch = TRUE;
+    pthread_mutex_unlock (&registry_lock);
+
+    register_func ();
+
+    pthread_mutex_lock (&registry_lock);
+    registry_batch = FALSE;
+    registry_edit_done ();
+    pthread_mutex_unlock (&registry_lock);
+}
+
+void
+rpcsyncwerk_server_final()
+{
+    if (batch_pool) {
+        g_thread_pool_free (batch_pool, FALSE, TRUE);
+        batch_pool = NULL;
+    }
+    stream_sweeper_stop ();
+    if (registry_pending) {
+        registry_unref (registry_pending);
+        registry_pending = NULL;
+    }
+    registry_pending_changed = FALSE;
+    registry_unref (registry);
+    registry = NULL;
+    g_hash_table_destroy (marshal_table);
+    g_hash_table_destroy (stream_table);
+}
+
+/* Set the synchronous or the asynchronous marshal of @signature. Unless
+ * @static_signature, takes ownership of @signature. */
+static gboolean
+register_marshal (const gchar *signature, gboolean static_signature,
+                  RpcsyncwerkMarshalFunc marshal,
+                  RpcsyncwerkAsyncMarshalFunc async_marshal)
+{
+    MarshalItem *mitem;
+    gboolean kept = FALSE;
+    gboolean ret = TRUE;
+
+    pthread_mutex_lock (&registry_lock);
+    mitem = g_hash_table_lookup (marshal_table, signature);
+    if (mitem && (marshal ? (void *)mitem->mfunc : (void *)mitem->amfunc)) {
+        g_warning ("[Sea RPC] cannot register duplicate marshal.\n");
+        ret = FALSE;
+        goto out;
+    }
+
+    if (!mitem) {
+        mitem = g_new0 (MarshalItem, 1);
+        mitem->signature = (gchar *)signature;
+        mitem->static_signature = static_signature;
+        g_hash_table_insert (marshal_table, (gpointer)mitem->signature, mitem);
+        kept = TRUE;
+    }
+    if (marshal)
+        mitem->mfunc = marshal;
+    else
+        mitem->amfunc = async_marshal;
+
+out:
+    pthread_mutex_unlock (&registry_lock);
+    if (!static_signature && !kept)
+        g_free ((gchar *)signature);
+    return ret;
+}
+
+gboolean 
+rpcsyncwerk_server_register_marshal (gchar *signature, RpcsyncwerkMarshalFunc marshal)
+{
+    g_assert (signature != NULL && marshal != NULL);
+
+    return register_marshal (signature, FALSE, marshal, NULL);
+}
+
+gboolean
+rpcsyncwerk_server_register_async_marshal (gchar *signature,
+                                           RpcsyncwerkAsyncMarshalFunc marshal)
+{
+    g_assert (signature != NULL && marshal != NULL);
+
+    return register_marshal (signature, FALSE, NULL, marshal);
+}
+
+gboolean
+rpcsyncwerk_server_register_marshal_static (const gchar *signature,
+                                            RpcsyncwerkMarshalFunc marshal)
+{
+    g_assert (signature != NULL && marshal != NULL);
+
+    return register_marshal (signature, TRUE, marshal, NULL);
+}
+
+gboolean
+rpcsyncwerk_server_register_async_marshal_static (const gchar *signature,
+                                                  RpcsyncwerkAsyncMarshalFunc marshal)
+{
+    g_assert (signature != NULL && marshal != NULL);
+
+    return register_marshal (signature, TRUE, NULL, marshal);
+}
+
+static gboolean
+register_function (const char *svc_name, void *func, const gchar *fname,
+                   const gchar *signature, gboolean async)
+{
+    RpcsyncwerkService *service;
+    FuncItem *item;
+    MarshalItem *mitem;
+    Registry *reg;
+    gboolean ret = FALSE;
+
+    g_assert (svc_name != NULL && func != NULL && fname != NULL && signature != NULL);
+
+    pthread_mutex_lock (&registry_lock);
+    reg = registry_edit ();
+    service = g_hash_table_lookup (reg->services, svc_name);
+    if (!service)
+        goto out;
+
+    mitem = g_hash_table_lookup (marshal_table, signature);
+    if (!mitem || !(async ? (void *)mitem->amfunc : (void *)mitem->mfunc))
+        goto out;
+
+    /* A function registered again gets a new handle. */
+    registry_clear_handles (reg, service, fname);
+    service = registry_edit_service (reg, service);
+
+    item = g_new0 (FuncItem, 1);
+    item->marshal = mitem;
+    item->fname = g_strdup(fname);
+    item->svc_name = g_strdup(svc_name);
+    item->func = func;
+    item->async = async;
+    item->handle = reg->func_items->len;
+    item->refcount = 1;
+    g_ptr_array_add (reg->func_items, item);
+    g_hash_table_replace (service->func_table, (gpointer)item->fname, func_item_ref (item));
+
+    registry_updated ();
+    ret = TRUE;
+
+out:
+    registry_edit_done ();
+    pthread_mutex_unlock (&registry_lock);
+    return ret;
+}
+
+gboolean 
+rpcsyncwerk_server_register_function (const char *svc_name,
+                                 void *func, const gchar *fname, gchar *signature)
+{
+    gboolean ret = register_function (svc_name, func, fname, signature, FALSE);
+    g_free (signature);
+    return ret;
+}
+
+gboolean
+rpcsyncwerk_server_register_async_function (const char *svc_name,
+                                            void *func, const gchar *fname,
+                                            gchar *signature)
+{
+    gboolean ret = register_function (svc_name, func, fname, signature, TRUE);
+    g_free (signature);
+    return ret;
+}
+
+gboolean
+rpcsyncwerk_server_register_function_static (const char *svc_name,
+                                             void *func, const gchar *fname,
+                                             const gchar *signature)
+{
+    return register_function (svc_name, func, fname, signature, FALSE);
+}
+
+gboolean
+rpcsyncwerk_server_register_async_function_static (const char *svc_name,
+                                                   void *func, const gchar *fname,
+                                                   const gchar *signature)
+{
+    return register_function (svc_name, func, fname, signature, TRUE);
+}
+
+static json_t *
+load_rpc_call (gchar *func, gsize len, char **err_ret, gsize *ret_len)
+{
+    json_t *array;
+    json_error_t jerror;
+    GError *error = NULL;
+
+    array = json_loadb (func, len, 0 ,&jerror);
+    
+    if (!array) {
+        char buf[512];
+        setjetoge(&jerror,&error);
+        snprintf (buf, 511, "failed to load RPC call: %s\n", error->message);
+        g_error_free(error);
+        *err_ret = error_to_json (511, buf, ret_len);
+    }
+
+    return array;
+}
+
+/* Waits for the reply of an asynchronous function called by a transport
+ * that can't take deferred responses. Shared by the waiting thread and the
+ * reply, the last one to let go frees it. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refcount;
+    gboolean done;
+    /* the waiting thread has given up, the reply is dropped */
+    gboolean abandoned;
+    char *ret;
+    gsize ret_len;
+} SyncReply;
+
+static void
+sync_reply_unref (SyncReply *sync)
+{
+    gboolean last;
+
+    pthread_mutex_lock (&sync->lock);
+    last = --sync->refcount == 0;
+    pthread_mutex_unlock (&sync->lock);
+    if (!last)
+        return;
+
+    pthread_mutex_destroy (&sync->lock);
+    pthread_cond_destroy (&sync->cond);
+    g_free (sync);
+}
+
+static void
+sync_reply_done (char *ret_str, gsize ret_len, void *user_data)
+{
+    SyncReply *sync = user_data;
+
+    pthread_mutex_lock (&sync->lock);
+    if (sync->abandoned) {
+        g_free (ret_str);
+    } else {
+        sync->ret = ret_str;
+        sync->ret_len = ret_len;
+        sync->done = TRUE;
+        pthread_cond_signal (&sync->cond);
+    }
+    pthread_mutex_unlock (&sync->lock);
+
+    sync_reply_unref (sync);
+}
+
+/* Wait for the reply, until @deadline unless it is 0. Returns NULL once the
+ * deadline has passed. */
+static char *
+sync_reply_wait (SyncReply *sync, gint64 deadline, gsize *ret_len)
+{
+    char *ret = NULL;
+
+    pthread_mutex_lock (&sync->lock);
+    while (!sync->done) {
+        if (deadline <= 0) {
+            pthread_cond_wait (&sync->cond, &sync->lock);
+            continue;
+        }
+        if (monotonic_cond_wait_until (&sync->cond, &sync->lock,
+                                       deadline) == ETIMEDOUT)
+            break;
+    }
+    if (sync->done) {
+        ret = sync->ret;
+        *ret_len = sync->ret_len;
+    } else {
+        sync->abandoned = TRUE;
+    }
+    pthread_mutex_unlock (&sync->lock);
+
+    return ret;
+}
+
+static void
+call_async_func_item (FuncItem *fitem, json_t *array,
+                      RpcsyncwerkReplyFunc reply_func, void *user_data)
+{
+    RpcsyncwerkReply *reply = g_new0 (RpcsyncwerkReply, 1);
+
+    reply->params = json_incref (array);
+    reply->deadline = rpcsyncwerk_server_get_call_deadline ();
+    reply->func = reply_func;
+    reply->user_data = user_data;
+    reply->svc_name = g_strdup (fitem->svc_name);
+
+    /* The function may reply before it returns. */
+    fitem->marshal->amfunc (fitem->func, array, reply);
+}
+
+static char *
+call_func_item (FuncItem *fitem, json_t *array, gsize *ret_len)
+{
+    char* ret;
+
+#ifdef PROFILE
+    struct timeval start, end, intv;
+
+    gettimeofday(&start, NULL);
+#endif
+
+    if (fitem->async) {
+        SyncReply *sync = g_new0 (SyncReply, 1);
+
+        pthread_mutex_init (&sync->lock, NULL);
+        monotonic_cond_init (&sync->cond);
+        /* one for the reply, one for this thread */
+        sync->refcount = 2;
+
+        call_async_func_item (fitem, array, sync_reply_done, sync);
+        ret = sync_reply_wait (sync, rpcsyncwerk_server_get_call_deadline (), ret_len);
+        sync_reply_unref (sync);
+        if (!ret)
+            ret = error_to_json (504, "deadline exceeded", ret_len);
+    } else {
+        const char *saved = set_call_service (fitem->svc_name);
+        ret = fitem->marshal->mfunc (fitem->func, array, ret_len);
+        set_call_service (saved);
+    }
+
+#ifdef PROFILE
     gettimeofday(&end, NULL);
     timersub(&end, &start, &intv);
     g_debug ("[rpcsyncwerk] Time spend in call %s: %ds %dus\n",
-             fname, intv.tv_sec, intv.tv_usec);
+             fitem->fname, intv.tv_sec, intv.tv_usec);
 #endif
 
+    return ret;
+}
+
+static void
+create_call_deadline_key (void)
+{
+    pthread_key_create (&call_deadline_key, NULL);
+}
+
+/* Make @deadline the one of the calls on this thread, returns the previous
+ * one. */
+static gint64 *
+set_call_deadline (gint64 *deadline)
+{
+    gint64 *saved;
+
+    pthread_once (&call_deadline_once, create_call_deadline_key);
+    saved = pthread_getspecific (call_deadline_key);
+    pthread_setspecific (call_deadline_key, deadline);
+    return saved;
+}
+
+/* The calls of a batch, taken in turn by the calling thread and the helpers
+ * from batch_pool. */
+typedef struct {
+    RpcsyncwerkService *service;
+    json_t *calls;
+    char **rets;
+    gsize *ret_lens;
+    gint64 deadline;
+    int next;
+    int n_done;
+    int refcount;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+} BatchRun;
+
+static void
+batch_run_unref (BatchRun *run)
+{
+    int refcount;
+
+    pthread_mutex_lock (&run->lock);
+    refcount = --run->refcount;
+    pthread_mutex_unlock (&run->lock);
+    if (refcount > 0)
+        return;
+
+    json_decref (run->calls);
+    g_free (run->rets);
+    g_free (run->ret_lens);
+    pthread_mutex_destroy (&run->lock);
+    pthread_cond_destroy (&run->done_cond);
+    g_free (run);
+}
+
+static char *
+call_batch_item (RpcsyncwerkService *service, json_t *call,
+                 gint64 deadline, gsize *ret_len)
+{
+    const char *fname = json_string_value (json_array_get (call, 0));
+    FuncItem *fitem;
+
+    /* Also rejects nested batches. */
+    if (!fname)
+        return error_to_json (500, "invalid call in batch.", ret_len);
+
+    if (deadline > 0 && g_get_monotonic_time () >= deadline)
+        return error_to_json (504, "deadline exceeded", ret_len);
+
+    fitem = g_hash_table_lookup (service->func_table, fname);
+    if (!fitem) {
+        char buf[256];
+        snprintf (buf, 255, "cannot find function %s.", fname);
+        return error_to_json (500, buf, ret_len);
+    }
+    /* Its reply could keep the whole batch, and the helpers running it,
+     * waiting for an unbounded time. */
+    if (fitem->async) {
+        char buf[256];
+        snprintf (buf, 255, "asynchronous function %s can't be called in a batch.", fname);
+        return error_to_json (500, buf, ret_len);
+    }
+
+    return call_func_item (fitem, call, ret_len);
+}
+
+static void
+batch_run_calls (BatchRun *run)
+{
+    int n = json_array_size (run->calls);
+    int i;
+
+    pthread_mutex_lock (&run->lock);
+    while (run->next < n) {
+        i = run->next++;
+        pthread_mutex_unlock (&run->lock);
+
+        run->rets[i] = call_batch_item (run->service, json_array_get (run->calls, i),
+                                        run->deadline, &run->ret_lens[i]);
+
+        pthread_mutex_lock (&run->lock);
+        if (++run->n_done == n)
+            pthread_cond_signal (&run->done_cond);
+    }
+    pthread_mutex_unlock (&run->lock);
+}
+
+static void
+batch_helper (gpointer data, gpointer user_data)
+{
+    BatchRun *run = data;
+    gint64 *saved;
+
+    saved = set_call_deadline (run->deadline > 0 ? &run->deadline : NULL);
+    batch_run_calls (run);
+    set_call_deadline (saved);
+
+    batch_run_unref (run);
+}
+
+/* Run the calls in @calls and return their responses in the "ret" array of
+ * one response. A failed call doesn't fail the others. */
+static char *
+call_batch (RpcsyncwerkService *service, json_t *calls, gsize *ret_len)
+{
+    BatchRun *run;
+    GString *buf;
+    int n = json_array_size (calls);
+    int i, n_helpers = 0;
+
+    run = g_new0 (BatchRun, 1);
+    run->service = service;
+    run->calls = json_incref (calls);
+    run->rets = g_new0 (char *, n);
+    run->ret_lens = g_new0 (gsize, n);
+    run->deadline = rpcsyncwerk_server_get_call_deadline ();
+    run->refcount = 1;
+    pthread_mutex_init (&run->lock, NULL);
+    pthread_cond_init (&run->done_cond, NULL);
+
+    if (batch_pool && n > 1) {
+        n_helpers = MIN(n - 1, batch_threads);
+        run->refcount += n_helpers;
+        for (i = 0; i < n_helpers; i++)
+            g_thread_pool_push (batch_pool, run, NULL);
+    }
+
+    /* Take part so that the batch makes progress even when the helpers are
+     * busy with other batches. */
+    batch_run_calls (run);
+
+    pthread_mutex_lock (&run->lock);
+    while (run->n_done < n)
+        pthread_cond_wait (&run->done_cond, &run->lock);
+    pthread_mutex_unlock (&run->lock);
+
+    /* The responses are JSON already, splice them instead of parsing them. */
+    buf = g_string_sized_new (64);
+    g_string_append (buf, "{\"ret\":[");
+    for (i = 0; i < n; i++) {
+        if (i > 0)
+            g_string_append_c (buf, ',');
+        g_string_append_len (buf, run->rets[i], run->ret_lens[i]);
+        g_free (run->rets[i]);
+    }
+    g_string_append (buf, "]}");
+
+    batch_run_unref (run);
+
+    *ret_len = buf->len;
+    return g_string_free (buf, FALSE);
+}
+
+void
+rpcsyncwerk_server_set_batch_threads (int n_threads)
+{
+    if (batch_pool) {
+        g_thread_pool_free (batch_pool, FALSE, TRUE);
+        batch_pool = NULL;
+    }
+
+    batch_threads = n_threads;
+    if (n_threads > 0)
+        batch_pool = g_thread_pool_new (batch_helper, NULL, n_threads, FALSE, NULL);
+}
+
+/* Call @fitem. With @reply_func, an asynchronous function replies through
+ * it and NULL is returned. */
+static char *
+call_item (FuncItem *fitem, json_t *array, gsize *ret_len,
+           RpcsyncwerkReplyFunc reply_func, void *user_data)
+{
+    if (fitem->async && reply_func) {
+        call_async_func_item (fitem, array, reply_func, user_data);
+        return NULL;
+    }
+    return call_func_item (fitem, array, ret_len);
+}
+
+static char *
+server_call_function (Registry *reg, const char *svc_name,
+                      gchar *func, gsize len, gsize *ret_len,
+                      RpcsyncwerkReplyFunc reply_func, void *user_data)
+{
+    RpcsyncwerkService *service;
+    json_t *array;
+    char* ret;
+
+    service = g_hash_table_lookup (reg->services, svc_name);
+    if (!service) {
+        char buf[256];
+        snprintf (buf, 255, "cannot find service %s.", svc_name);
+        return error_to_json (501, buf, ret_len);
+    }
+    
+    array = load_rpc_call (func, len, &ret, ret_len);
+    if (!array)
+        return ret;
+
+    if (json_is_array (json_array_get (array, 0))) {
+        ret = call_batch (service, array, ret_len);
+        json_decref (array);
+        return ret;
+    }
+
+    if (json_is_object (array)) {
+        ret = call_stream_request (service, array, ret_len);
+        json_decref (array);
+        return ret;
+    }
+
+    const char *fname = json_string_value (json_array_get(array, 0));
+    if (!fname) {
+        json_decref (array);
+        return error_to_json (500, "function name missing.", ret_len);
+    }
+
+    FuncItem *fitem = g_hash_table_lookup(service->func_table, fname);
+    if (!fitem) {
+        char buf[256];
+        snprintf (buf, 255, "cannot find function %s.", fname);
+        json_decref (array);
+        return error_to_json (500, buf, ret_len);
+    }
+
+    ret = call_item (fitem, array, ret_len, reply_func, user_data);
+
     json_decref(array);
 
     return ret;
 }
 
+/* Called by RPC transport. */
+char* 
+rpcsyncwerk_server_call_function (const char *svc_name,
+                             gchar *func, gsize len, gsize *ret_len)
+{
+    Registry *reg = registry_acquire ();
+    char *ret;
+
+    ret = server_call_function (reg, svc_name, func, len, ret_len, NULL, NULL);
+    registry_unref (reg);
+
+    return ret;
+}
+
+int
+rpcsyncwerk_server_resolve_function (const char *svc_name, const char *fname)
+{
+    Registry *reg = registry_acquire ();
+    RpcsyncwerkService *service;
+    FuncItem *fitem = NULL;
+    int handle = -1;
+
+    service = g_hash_table_lookup (reg->services, svc_name);
+    if (service)
+        fitem = g_hash_table_lookup (service->func_table, fname);
+    if (fitem)
+        handle = (int)fitem->handle;
+
+    registry_unref (reg);
+    return handle;
+}
+
+static char *
+server_call_function_by_handle (Registry *reg, const char *svc_name, int handle,
+                                gchar *func, gsize len, gsize *ret_len,
+                                RpcsyncwerkReplyFunc reply_func, void *user_data)
+{
+    FuncItem *fitem = NULL;
+    json_t *array;
+    char* ret;
+
+    if (handle >= 0 && (guint)handle < reg->func_items->len)
+        fitem = g_ptr_array_index (reg->func_items, handle);
+    /* A handle resolved for another service, which may have a function of
+     * the same name, is looked up by name in this one. */
+    if (!fitem || strcmp (fitem->svc_name, svc_name) != 0)
+        return server_call_function (reg, svc_name, func, len, ret_len,
+                                     reply_func, user_data);
+
+    array = load_rpc_call (func, len, &ret, ret_len);
+    if (!array)
+        return ret;
+
+    /* The handle may be stale, e.g. from before the server was
+     * re-initialized. Comparing the name is cheaper than looking it up. */
+    const char *fname = json_string_value (json_array_get(array, 0));
+    if (!fname || strcmp (fname, fitem->fname) != 0) {
+        json_decref (array);
+        return server_call_function (reg, svc_name, func, len, ret_len,
+                                     reply_func, user_data);
+    }
+
+    ret = call_item (fitem, array, ret_len, reply_func, user_data);
+
+    json_decref(array);
+
+    return ret;
+}
+
+char* 
+rpcsyncwerk_server_call_function_by_handle (const char *svc_name, int handle,
+                                       gchar *func, gsize len, gsize *ret_len)
+{
+    Registry *reg = registry_acquire ();
+    char *ret;
+
+    ret = server_call_function_by_handle (reg, svc_name, handle, func, len, ret_len,
+                                          NULL, NULL);
+    registry_unref (reg);
+
+    return ret;
+}
+
+char *
+rpcsyncwerk_server_call_function_deferred (const char *svc_name, int handle,
+                                           gchar *func, gsize len,
+                                           gsize *ret_len, gint64 deadline,
+                                           RpcsyncwerkReplyFunc reply_func,
+                                           void *user_data)
+{
+    Registry *reg;
+    gint64 *saved;
+    char *ret;
+
+    /* The client has given up, e.g. while the request was queued. */
+    if (deadline > 0 && g_get_monotonic_time () >= deadline)
+        return error_to_json (504, "deadline exceeded", ret_len);
+
+    reg = registry_acquire ();
+    if (deadline <= 0) {
+        ret = server_call_function_by_handle (reg, svc_name, handle, func, len,
+                                              ret_len, reply_func, user_data);
+    } else {
+        /* A function may call another one through a loopback client. */
+        saved = set_call_deadline (&deadline);
+        ret = server_call_function_by_handle (reg, svc_name, handle, func, len,
+                                              ret_len, reply_func, user_data);
+        set_call_deadline (saved);
+    }
+    registry_unref (reg);
+
+    return ret;
+}
+
+char *
+rpcsyncwerk_server_call_function_with_deadline (const char *svc_name, int handle,
+                                           gchar *func, gsize len,
+                                           gsize *ret_len, gint64 deadline)
+{
+    return rpcsyncwerk_server_call_function_deferred (svc_name, handle, func, len,
+                                                      ret_len, deadline, NULL, NULL);
+}
+
+/* Deferred replies */
+
+static void
+reply_send (RpcsyncwerkReply *reply, char *ret_str, gsize ret_len)
+{
+    reply->func (ret_str, ret_len, reply->user_data);
+    json_decref (reply->params);
+    g_free (reply->svc_name);
+    g_free (reply);
+}
+
+void
+rpcsyncwerk_reply_string (RpcsyncwerkReply *reply, char *ret, GError *error)
+{
+    gsize len;
+    char *ret_str = rpcsyncwerk_marshal_string_ret (ret, error, &len);
+    reply_send (reply, ret_str, len);
+}
+
+void
+rpcsyncwerk_reply_int (RpcsyncwerkReply *reply, json_int_t ret, GError *error)
+{
+    gsize len;
+    char *ret_str = rpcsyncwerk_marshal_int_ret (ret, error, &len);
+    reply_send (reply, ret_str, len);
+}
+
+void
+rpcsyncwerk_reply_object (RpcsyncwerkReply *reply, GObject *ret, GError *error)
+{
+    gsize len;
+    char *ret_str = rpcsyncwerk_marshal_object_ret (ret, error, &len);
+    reply_send (reply, ret_str, len);
+}
+
+void
+rpcsyncwerk_reply_objlist (RpcsyncwerkReply *reply, GList *ret, GError *error)
+{
+    gsize len;
+    char *ret_str = rpcsyncwerk_marshal_objlist_ret (ret, error, &len);
+    reply_send (reply, ret_str, len);
+}
+
+void
+rpcsyncwerk_reply_json (RpcsyncwerkReply *reply, json_t *ret, GError *error)
+{
+    gsize len;
+    char *ret_str = rpcsyncwerk_marshal_json_ret (ret, error, &len);
+    reply_send (reply, ret_str, len);
+}
+
+void
+rpcsyncwerk_reply_objstream (RpcsyncwerkReply *reply, RpcsyncwerkObjStream *ret,
+                             GError *error)
+{
+    gsize len;
+    char *ret_str;
+
+    /* May reply from any thread. */
+    if (ret && !ret->svc_name)
+        ret->svc_name = g_strdup (reply->svc_name);
+    ret_str = rpcsyncwerk_marshal_objstream_ret (ret, error, &len);
+    reply_send (reply, ret_str, len);
+}
+
+gint64
+rpcsyncwerk_reply_get_deadline (RpcsyncwerkReply *reply)
+{
+    return reply->deadline;
+}
+
+gint64
+rpcsyncwerk_server_get_call_deadline (void)
+{
+    gint64 *deadline;
+
+    pthread_once (&call_deadline_once, create_call_deadline_key);
+    deadline = pthread_getspecific (call_deadline_key);
+    return deadline ? *deadline : 0;
+}
+
 char* 
 rpcsyncwerk_compute_signature(const gchar *ret_type, int pnum, ...)
 {
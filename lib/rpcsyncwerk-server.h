@@ -13,6 +13,13 @@ typedef gchar* (*RpcsyncwerkMarshalFunc) (void *func, json_t *param_array,
     gsize *ret_len);
 typedef void (*RegisterMarshalFunc) (void);
 
+/* The pending response of an asynchronous function. */
+typedef struct _RpcsyncwerkReply RpcsyncwerkReply;
+typedef void (*RpcsyncwerkAsyncMarshalFunc) (void *func, json_t *param_array,
+    RpcsyncwerkReply *reply);
+/* Takes the response of a deferred call, and ownership of @ret_str. */
+typedef void (*RpcsyncwerkReplyFunc) (char *ret_str, gsize ret_len, void *user_data);
+
 void rpcsyncwerk_set_string_to_ret_object (json_t *object, char *ret);
 void rpcsyncwerk_set_int_to_ret_object (json_t *object, json_int_t ret);
 void rpcsyncwerk_set_object_to_ret_object (json_t *object, GObject *ret);
@@ -20,6 +27,36 @@ void rpcsyncwerk_set_objlist_to_ret_object (json_t *object, GList *ret);
 void rpcsyncwerk_set_json_to_ret_object (json_t *object, json_t *ret);
 char *rpcsyncwerk_marshal_set_ret_common (json_t *object, gsize *len, GError *error);
 
+/* Used by the generated marshals: serialize the whole response for @ret and
+ * @error straight into the returned buffer. They take ownership of @ret and
+ * @error like the functions above. */
+char *rpcsyncwerk_marshal_string_ret (char *ret, GError *error, gsize *len);
+char *rpcsyncwerk_marshal_int_ret (json_int_t ret, GError *error, gsize *len);
+char *rpcsyncwerk_marshal_object_ret (GObject *ret, GError *error, gsize *len);
+char *rpcsyncwerk_marshal_objlist_ret (GList *ret, GError *error, gsize *len);
+char *rpcsyncwerk_marshal_json_ret (json_t *ret, GError *error, gsize *len);
+
+/* Returned by functions of the "objstream" type, whose objects are sent in
+ * chunks while they are produced instead of in one list. @next returns the
+ * next object, or NULL at the end or with @error set. */
+typedef struct _RpcsyncwerkObjStream RpcsyncwerkObjStream;
+typedef GObject* (*RpcsyncwerkObjStreamNext) (void *data, GError **error);
+
+/* @destroy is called on @data when the stream is done, closed by the
+ * client or dropped after it hasn't been read from for a minute. A stream
+ * isn't tied to the connection it was returned on: it outlives a client that
+ * goes away by up to that minute, and any client of the service that
+ * returned it may pull from it with its id. */
+RpcsyncwerkObjStream *rpcsyncwerk_obj_stream_new (RpcsyncwerkObjStreamNext next,
+                                                  void *data,
+                                                  GDestroyNotify destroy);
+char *rpcsyncwerk_marshal_objstream_ret (RpcsyncwerkObjStream *ret, GError *error,
+                                         gsize *len);
+
+/* Start a new chunk of a stream once the current one has @size bytes, 64KB
+ * by default. 0 restores the default. */
+void rpcsyncwerk_server_set_stream_chunk_size (gsize size);
+
 /**
  * rpcsyncwerk_server_init:
  *
@@ -48,6 +85,10 @@ int rpcsyncwerk_create_service (const char *svc_name);
  * rpcsyncwerk_remove_service:
  *
  * Remove the service from the server.
+ *
+ * Services and functions may be created, registered and removed while calls
+ * are being served. Calls already running a removed function finish
+ * normally.
  */
 void rpcsyncwerk_remove_service (const char *svc_name);
 
@@ -62,6 +103,28 @@ void rpcsyncwerk_remove_service (const char *svc_name);
 gboolean rpcsyncwerk_server_register_marshal (gchar *signature,
                                          RpcsyncwerkMarshalFunc marshal);
 
+/**
+ * rpcsyncwerk_server_register_async_marshal:
+ *
+ * Like rpcsyncwerk_server_register_marshal(), for the marshal of the
+ * asynchronous functions of @signature.
+ */
+gboolean rpcsyncwerk_server_register_async_marshal (gchar *signature,
+                                               RpcsyncwerkAsyncMarshalFunc marshal);
+
+/**
+ * rpcsyncwerk_server_register_marshal_static:
+ *
+ * Like rpcsyncwerk_server_register_marshal(), for a constant signature such
+ * as the RPCSYNCWERK_SIGNATURE_* macros of the generated header. The
+ * signature is not copied, it must stay valid until rpcsyncwerk_server_final().
+ */
+gboolean rpcsyncwerk_server_register_marshal_static (const gchar *signature,
+                                                RpcsyncwerkMarshalFunc marshal);
+
+gboolean rpcsyncwerk_server_register_async_marshal_static (const gchar *signature,
+                                                      RpcsyncwerkAsyncMarshalFunc marshal);
+
 /**
  * rpcsyncwerk_server_register_function:
  *
@@ -75,6 +138,52 @@ gboolean rpcsyncwerk_server_register_function (const char *service,
                                           const gchar *fname,
                                           gchar *signature);
 
+/**
+ * rpcsyncwerk_server_register_async_function:
+ *
+ * Register a function that answers later instead of returning its result.
+ * Instead of a GError ** it takes a RpcsyncwerkReply *, and it must pass
+ * its result to the rpcsyncwerk_reply_*() function of its return type
+ * exactly once, from any thread. Its parameters stay valid until then.
+ *
+ * Transports that support it, like the named pipe server, don't hold a
+ * thread while the reply is pending. Others wait for the reply.
+ */
+gboolean rpcsyncwerk_server_register_async_function (const char *service,
+                                                void* func,
+                                                const gchar *fname,
+                                                gchar *signature);
+
+/**
+ * rpcsyncwerk_server_register_function_static:
+ *
+ * Like rpcsyncwerk_server_register_function(), for a constant signature
+ * such as RPCSYNCWERK_SIGNATURE_STRING__STRING_INT. Nothing is allocated or
+ * freed for the signature.
+ */
+gboolean rpcsyncwerk_server_register_function_static (const char *service,
+                                                 void* func,
+                                                 const gchar *fname,
+                                                 const gchar *signature);
+
+gboolean rpcsyncwerk_server_register_async_function_static (const char *service,
+                                                       void* func,
+                                                       const gchar *fname,
+                                                       const gchar *signature);
+
+/* Complete the call of an asynchronous function with its result. They
+ * take ownership of @ret and @error like the marshals. */
+void rpcsyncwerk_reply_string (RpcsyncwerkReply *reply, char *ret, GError *error);
+void rpcsyncwerk_reply_int (RpcsyncwerkReply *reply, json_int_t ret, GError *error);
+void rpcsyncwerk_reply_object (RpcsyncwerkReply *reply, GObject *ret, GError *error);
+void rpcsyncwerk_reply_objlist (RpcsyncwerkReply *reply, GList *ret, GError *error);
+void rpcsyncwerk_reply_json (RpcsyncwerkReply *reply, json_t *ret, GError *error);
+void rpcsyncwerk_reply_objstream (RpcsyncwerkReply *reply, RpcsyncwerkObjStream *ret,
+                                  GError *error);
+
+/* The deadline of the call, see rpcsyncwerk_server_get_call_deadline(). */
+gint64 rpcsyncwerk_reply_get_deadline (RpcsyncwerkReply *reply);
+
 /**
  * rpcsyncwerk_server_call_function:
  * @service: service name.
@@ -82,13 +191,105 @@ gboolean rpcsyncwerk_server_register_function (const char *service,
  * @len: length of @func.
  * @ret_len: the length of the returned string.
  *
- * Call a registered function @func of a service.
+ * Call a registered function @func of a service. @func may also be a batch,
+ * an array of serialized calls, whose responses are returned in the "ret"
+ * array of the response.
  *
  * Returns the serialized representatio of the returned value.
  */
 gchar *rpcsyncwerk_server_call_function (const char *service,
                                     gchar *func, gsize len, gsize *ret_len);
 
+/**
+ * rpcsyncwerk_server_set_batch_threads:
+ * @n_threads: max number of threads helping with batches, 0 for none.
+ *
+ * A batch, see rpcsyncwerk_client_call_batch(), is run by the thread that
+ * calls rpcsyncwerk_server_call_function(). With @n_threads > 0, up to
+ * @n_threads threads of a shared pool run its calls in parallel with it.
+ * The functions of a batch must then be safe to call concurrently.
+ * Asynchronous functions can't be called in a batch, such a call fails
+ * without affecting the others.
+ *
+ * Must be called before the server is started. The pool is replaced without
+ * synchronization, while no batch may be running.
+ */
+void rpcsyncwerk_server_set_batch_threads (int n_threads);
+
+/**
+ * rpcsyncwerk_server_resolve_function:
+ * @service: service name.
+ * @fname: function name.
+ *
+ * Resolve a registered function to a handle, which stays valid until the
+ * function is removed. Handles are never reused.
+ *
+ * Returns the handle, or -1 if there is no such function.
+ */
+int rpcsyncwerk_server_resolve_function (const char *service, const char *fname);
+
+/**
+ * rpcsyncwerk_server_call_function_by_handle:
+ * @service: service name.
+ * @handle: handle returned by rpcsyncwerk_server_resolve_function().
+ * @func: the serialized representation of the function to call.
+ * @len: length of @func.
+ * @ret_len: the length of the returned string.
+ *
+ * Like rpcsyncwerk_server_call_function(), but skips looking up the
+ * service and the function. Falls back to the lookup if @handle does not
+ * refer to the function named in @func.
+ */
+gchar *rpcsyncwerk_server_call_function_by_handle (const char *service, int handle,
+                                              gchar *func, gsize len,
+                                              gsize *ret_len);
+
+/**
+ * rpcsyncwerk_server_call_function_with_deadline:
+ * @service: service name.
+ * @handle: handle returned by rpcsyncwerk_server_resolve_function(), or -1
+ * to look the function up by name.
+ * @func: the serialized representation of the function to call.
+ * @len: length of @func.
+ * @ret_len: the length of the returned string.
+ * @deadline: when the caller stops waiting for the result, in
+ * g_get_monotonic_time() microseconds, or 0 for never.
+ *
+ * Like rpcsyncwerk_server_call_function_by_handle(), for callers that know
+ * how long the client waits. If @deadline has already passed, the function
+ * is not called and an error with code 504 is returned instead. Otherwise
+ * the function can get @deadline with rpcsyncwerk_server_get_call_deadline().
+ */
+gchar *rpcsyncwerk_server_call_function_with_deadline (const char *service, int handle,
+                                                  gchar *func, gsize len,
+                                                  gsize *ret_len, gint64 deadline);
+
+/**
+ * rpcsyncwerk_server_call_function_deferred:
+ * @reply_func: called with the response of an asynchronous function.
+ * @user_data: passed to @reply_func.
+ *
+ * Like rpcsyncwerk_server_call_function_with_deadline(), but doesn't wait
+ * for asynchronous functions. For those it returns NULL, and @reply_func
+ * is called with the response later, possibly from another thread or
+ * before this returns.
+ */
+gchar *rpcsyncwerk_server_call_function_deferred (const char *service, int handle,
+                                             gchar *func, gsize len,
+                                             gsize *ret_len, gint64 deadline,
+                                             RpcsyncwerkReplyFunc reply_func,
+                                             void *user_data);
+
+/**
+ * rpcsyncwerk_server_get_call_deadline:
+ *
+ * Returns the deadline of the rpc function running on the calling thread,
+ * or 0 if it has none. Long running functions can check it against
+ * g_get_monotonic_time() to give up on work whose result would be thrown
+ * away.
+ */
+gint64 rpcsyncwerk_server_get_call_deadline (void);
+
 /**
  * rpcsyncwerk_compute_signature:
  * @ret_type: the return type of the function.
@@ -0,0 +1,600 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+// memfd_create() is a GNU extension.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "rpcsyncwerk-shm-ring.h"
+
+#if defined(RPCSYNCWERK_USE_SHM)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+#define SHM_CACHE_LINE 64
+#define SHM_MAGIC 0x52505331        // "RPS1"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define SHM_CPU_RELAX() __builtin_ia32_pause()
+#else
+#define SHM_CPU_RELAX() do {} while (0)
+#endif
+
+// Positions are free running byte counters, the producer only moves head and
+// the consumer only moves tail. head - tail is the number of bytes in the
+// ring. They are kept on separate cache lines so the two sides don't keep
+// stealing each other's line.
+typedef struct {
+    volatile gint head;
+    char pad0[SHM_CACHE_LINE - sizeof(gint)];
+    volatile gint tail;
+    char pad1[SHM_CACHE_LINE - sizeof(gint)];
+    // Set by the consumer before sleeping on an empty ring, and by the
+    // producer before sleeping on a full one.
+    volatile gint reader_waiting;
+    volatile gint writer_waiting;
+    char pad2[SHM_CACHE_LINE - 2 * sizeof(gint)];
+} ShmRingControl;
+
+enum {
+    SHM_REQUEST_RING = 0,
+    SHM_RESPONSE_RING = 1,
+};
+
+// Start of the region, followed by the data of the two rings.
+typedef struct {
+    guint32 magic;
+    guint32 ring_size;
+    char pad[SHM_CACHE_LINE - 2 * sizeof(guint32)];
+    ShmRingControl rings[2];
+} ShmRegionHeader;
+
+typedef struct {
+    ShmRingControl *ctl;
+    char *data;
+} ShmRing;
+
+struct _RpcsyncwerkShmChannel {
+    void *map;
+    gsize map_len;
+    guint32 ring_size;
+
+    ShmRing tx;
+    ShmRing rx;
+
+    int memfd;
+    // Our doorbell, and the doorbell of the other side.
+    int wait_fd;
+    int wake_fd;
+    int sock;
+    int spin_us;
+    gint64 deadline;
+};
+
+static RpcsyncwerkShmChannel *
+channel_new (void *map, gsize map_len, gboolean server, int sock, int spin_us)
+{
+    RpcsyncwerkShmChannel *chan = g_new0 (RpcsyncwerkShmChannel, 1);
+    ShmRegionHeader *header = map;
+    char *data = (char *)map + sizeof(ShmRegionHeader);
+    int tx = server ? SHM_RESPONSE_RING : SHM_REQUEST_RING;
+    int rx = server ? SHM_REQUEST_RING : SHM_RESPONSE_RING;
+
+    chan->map = map;
+    chan->map_len = map_len;
+    chan->ring_size = header->ring_size;
+    chan->tx.ctl = &header->rings[tx];
+    chan->tx.data = data + (gsize)tx * chan->ring_size;
+    chan->rx.ctl = &header->rings[rx];
+    chan->rx.data = data + (gsize)rx * chan->ring_size;
+    chan->memfd = chan->wait_fd = chan->wake_fd = -1;
+    chan->sock = sock;
+    // Spinning only helps when the other side runs on another processor.
+    chan->spin_us = g_get_num_processors () > 1 ? spin_us : 0;
+    return chan;
+}
+
+RpcsyncwerkShmChannel *
+rpcsyncwerk_shm_channel_create (int sock, guint32 ring_size, int spin_us,
+                                int fds[RPCSYNCWERK_SHM_N_FDS])
+{
+    RpcsyncwerkShmChannel *chan;
+    ShmRegionHeader *header;
+    guint32 size = RPCSYNCWERK_SHM_MIN_RING_SIZE;
+    gsize map_len;
+    void *map;
+    int memfd, server_fd = -1, client_fd = -1;
+
+    while (size < ring_size && size < RPCSYNCWERK_SHM_MAX_RING_SIZE)
+        size <<= 1;
+    map_len = sizeof(ShmRegionHeader) + 2 * (gsize)size;
+
+    memfd = memfd_create ("rpcsyncwerk-shm", MFD_CLOEXEC);
+    if (memfd < 0) {
+        g_warning ("failed to create shared memory: %s\n", strerror(errno));
+        return NULL;
+    }
+    if (ftruncate (memfd, map_len) < 0) {
+        g_warning ("failed to size shared memory: %s\n", strerror(errno));
+        close (memfd);
+        return NULL;
+    }
+    map = mmap (NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED) {
+        g_warning ("failed to map shared memory: %s\n", strerror(errno));
+        close (memfd);
+        return NULL;
+    }
+
+    server_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    client_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server_fd < 0 || client_fd < 0) {
+        g_warning ("failed to create eventfd: %s\n", strerror(errno));
+        if (server_fd >= 0)
+            close (server_fd);
+        if (client_fd >= 0)
+            close (client_fd);
+        munmap (map, map_len);
+        close (memfd);
+        return NULL;
+    }
+
+    // A new memfd is zero filled, so the rings start out empty.
+    header = map;
+    header->magic = SHM_MAGIC;
+    header->ring_size = size;
+
+    chan = channel_new (map, map_len, TRUE, sock, spin_us);
+    chan->memfd = memfd;
+    chan->wait_fd = server_fd;
+    chan->wake_fd = client_fd;
+
+    fds[0] = memfd;
+    fds[1] = server_fd;
+    fds[2] = client_fd;
+    return chan;
+}
+
+RpcsyncwerkShmChannel *
+rpcsyncwerk_shm_channel_attach (int sock, int spin_us, int fds[RPCSYNCWERK_SHM_N_FDS])
+{
+    RpcsyncwerkShmChannel *chan;
+    ShmRegionHeader *header;
+    struct stat st;
+    void *map = MAP_FAILED;
+    guint32 size;
+
+    if (fstat (fds[0], &st) < 0 || st.st_size < (off_t)sizeof(ShmRegionHeader)) {
+        g_warning ("invalid shared memory from server\n");
+        goto failed;
+    }
+    map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (map == MAP_FAILED) {
+        g_warning ("failed to map shared memory: %s\n", strerror(errno));
+        goto failed;
+    }
+
+    header = map;
+    size = header->ring_size;
+    if (header->magic != SHM_MAGIC ||
+        size < RPCSYNCWERK_SHM_MIN_RING_SIZE || size > RPCSYNCWERK_SHM_MAX_RING_SIZE ||
+        (size & (size - 1)) != 0 ||
+        (gsize)st.st_size != sizeof(ShmRegionHeader) + 2 * (gsize)size) {
+        g_warning ("invalid shared memory from server\n");
+        goto failed;
+    }
+
+    // The mapping keeps the region alive.
+    close (fds[0]);
+
+    chan = channel_new (map, st.st_size, FALSE, sock, spin_us);
+    chan->wait_fd = fds[2];
+    chan->wake_fd = fds[1];
+    return chan;
+
+failed:
+    if (map != MAP_FAILED)
+        munmap (map, st.st_size);
+    close (fds[0]);
+    close (fds[1]);
+    close (fds[2]);
+    return NULL;
+}
+
+void
+rpcsyncwerk_shm_channel_free (RpcsyncwerkShmChannel *chan)
+{
+    if (!chan)
+        return;
+
+    munmap (chan->map, chan->map_len);
+    if (chan->memfd >= 0)
+        close (chan->memfd);
+    close (chan->wait_fd);
+    close (chan->wake_fd);
+    g_free (chan);
+}
+
+void
+rpcsyncwerk_shm_channel_set_deadline (RpcsyncwerkShmChannel *chan, gint64 deadline)
+{
+    chan->deadline = deadline;
+}
+
+guint32
+rpcsyncwerk_shm_channel_ring_size (RpcsyncwerkShmChannel *chan)
+{
+    return chan->ring_size;
+}
+
+static gboolean
+ring_ready (RpcsyncwerkShmChannel *chan, ShmRingControl *ctl, gboolean for_space)
+{
+    guint32 used = (guint32)g_atomic_int_get (&ctl->head) -
+                   (guint32)g_atomic_int_get (&ctl->tail);
+
+    return for_space ? used < chan->ring_size : used > 0;
+}
+
+// Ring the doorbell of the other side if it's waiting on @waiting.
+static void
+channel_wake (RpcsyncwerkShmChannel *chan, volatile gint *waiting)
+{
+    guint64 one = 1;
+
+    if (g_atomic_int_get (waiting) &&
+        write (chan->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        g_warning ("failed to wake up the other side of a shared memory channel: %s\n",
+                   strerror(errno));
+}
+
+// Wait for data (or space if @for_space) in the ring @ctl. Spin for
+// chan->spin_us first, then sleep on our doorbell.
+static int
+channel_wait (RpcsyncwerkShmChannel *chan, ShmRingControl *ctl, gboolean for_space)
+{
+    volatile gint *waiting = for_space ? &ctl->writer_waiting : &ctl->reader_waiting;
+    struct pollfd fds[2];
+    guint64 count;
+    guint i;
+
+    if (chan->spin_us > 0) {
+        gint64 deadline = g_get_monotonic_time () + chan->spin_us;
+        if (chan->deadline > 0)
+            deadline = MIN(deadline, chan->deadline);
+        for (i = 1; ; i++) {
+            if (ring_ready (chan, ctl, for_space))
+                return 0;
+            if ((i & 63) == 0 && g_get_monotonic_time () >= deadline)
+                break;
+            SHM_CPU_RELAX ();
+        }
+    }
+
+    while (1) {
+        int timeout = -1;
+
+        // The other side checks the flag after moving its position, so either
+        // it sees the flag or we see its progress.
+        g_atomic_int_set (waiting, 1);
+        if (ring_ready (chan, ctl, for_space))
+            break;
+
+        if (chan->deadline > 0) {
+            gint64 left = chan->deadline - g_get_monotonic_time ();
+            if (left <= 0) {
+                g_atomic_int_set (waiting, 0);
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            // Round up, so the deadline has passed when poll() times out.
+            timeout = (int)MIN((left + 999) / 1000, G_MAXINT);
+        }
+
+        fds[0].fd = chan->wait_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = chan->sock;
+        fds[1].events = POLLIN;
+        fds[0].revents = fds[1].revents = 0;
+        if (poll (fds, 2, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning ("failed to wait on shared memory channel: %s\n", strerror(errno));
+            g_atomic_int_set (waiting, 0);
+            return -1;
+        }
+        if (fds[1].revents) {
+            g_debug ("other side of the shared memory channel is gone\n");
+            g_atomic_int_set (waiting, 0);
+            return -1;
+        }
+        if (fds[0].revents & POLLIN) {
+            if (read (chan->wait_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                g_warning ("failed to read eventfd: %s\n", strerror(errno));
+        }
+    }
+
+    g_atomic_int_set (waiting, 0);
+    return 0;
+}
+
+int
+rpcsyncwerk_shm_channel_write (RpcsyncwerkShmChannel *chan,
+                               const void *vbuf, gsize len, gboolean more)
+{
+    ShmRingControl *ctl = chan->tx.ctl;
+    const char *buf = vbuf;
+    guint32 mask = chan->ring_size - 1;
+    guint32 head = (guint32)ctl->head;
+
+    while (len > 0) {
+        guint32 used = head - (guint32)g_atomic_int_get (&ctl->tail);
+        guint32 space = used < chan->ring_size ? chan->ring_size - used : 0;
+        if (space == 0) {
+            // The reader may be waiting for what was written so far.
+            channel_wake (chan, &ctl->reader_waiting);
+            if (channel_wait (chan, ctl, TRUE) < 0)
+                return -1;
+            continue;
+        }
+
+        guint32 n = (guint32)MIN((gsize)space, len);
+        guint32 off = head & mask;
+        guint32 first = MIN(n, chan->ring_size - off);
+        memcpy (chan->tx.data + off, buf, first);
+        memcpy (chan->tx.data, buf + first, n - first);
+
+        head += n;
+        buf += n;
+        len -= n;
+        g_atomic_int_set (&ctl->head, (gint)head);
+    }
+
+    if (!more)
+        channel_wake (chan, &ctl->reader_waiting);
+    return 0;
+}
+
+int
+rpcsyncwerk_shm_channel_read (RpcsyncwerkShmChannel *chan, void *vbuf, gsize len)
+{
+    ShmRingControl *ctl = chan->rx.ctl;
+    char *buf = vbuf;
+    guint32 mask = chan->ring_size - 1;
+    guint32 tail = (guint32)ctl->tail;
+
+    while (len > 0) {
+        guint32 avail = (guint32)g_atomic_int_get (&ctl->head) - tail;
+        if (avail == 0) {
+            if (channel_wait (chan, ctl, FALSE) < 0)
+                return -1;
+            continue;
+        }
+
+        // Don't trust the other side to keep head within the ring.
+        guint32 n = (guint32)MIN((gsize)MIN(avail, chan->ring_size), len);
+        guint32 off = tail & mask;
+        guint32 first = MIN(n, chan->ring_size - off);
+        memcpy (buf, chan->rx.data + off, first);
+        memcpy (buf + first, chan->rx.data, n - first);
+
+        tail += n;
+        buf += n;
+        len -= n;
+        g_atomic_int_set (&ctl->tail, (gint)tail);
+        channel_wake (chan, &ctl->writer_waiting);
+    }
+
+    return 0;
+}
+
+// Max descriptors passed with one message.
+#define SHM_MAX_FDS RPCSYNCWERK_SHM_N_FDS
+
+gssize
+rpcsyncwerk_shm_send_some (int sock, const void *buf, gsize len,
+                           const int *fds, int n_fds)
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * SHM_MAX_FDS)];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t n;
+
+    g_return_val_if_fail (n_fds > 0 && n_fds <= SHM_MAX_FDS, -1);
+
+    memset (&msg, 0, sizeof(msg));
+    memset (&control, 0, sizeof(control));
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+    memcpy (CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+
+    do {
+        n = sendmsg (sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+int
+rpcsyncwerk_shm_send_fds (int sock, const void *buf, gsize len,
+                          const int *fds, int n_fds)
+{
+    gssize n = rpcsyncwerk_shm_send_some (sock, buf, len, fds, n_fds);
+
+    // The message is small enough for the socket buffer of a new connection,
+    // a short write is treated as an error.
+    if (n != (gssize)len) {
+        if (n >= 0)
+            errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+gssize
+rpcsyncwerk_shm_recv_some (int sock, void *buf, gsize len,
+                           int *fds, int max_fds, int *n_fds)
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * SHM_MAX_FDS)];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t n;
+    int i;
+
+    memset (&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        n = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *)CMSG_DATA(cmsg);
+        for (i = 0; i < count; i++) {
+            if (*n_fds < max_fds)
+                fds[(*n_fds)++] = received[i];
+            else
+                close (received[i]);
+        }
+    }
+
+    return n;
+}
+
+int
+rpcsyncwerk_shm_recv_fds (int sock, void *vbuf, gsize len, int *fds, int max_fds)
+{
+    char *buf = vbuf;
+    gssize n;
+    int n_fds = 0;
+    int i;
+
+    n = rpcsyncwerk_shm_recv_some (sock, buf, len, fds, max_fds, &n_fds);
+    if (n <= 0)
+        return -1;
+
+    // The descriptors come with the first bytes, read the rest as usual.
+    while ((gsize)n < len) {
+        ssize_t r = read (sock, buf + n, len - n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            for (i = 0; i < n_fds; i++)
+                close (fds[i]);
+            return -1;
+        }
+        n += r;
+    }
+
+    return n_fds;
+}
+
+// Seals a payload must carry, so the sender can't change it under the
+// receiver's mapping.
+#define SHM_PAYLOAD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+int
+rpcsyncwerk_shm_payload_create (const void *buf, gsize len)
+{
+    void *map;
+    int fd;
+
+    fd = memfd_create ("rpcsyncwerk-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        g_warning ("failed to create shared memory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate (fd, len) < 0)
+        goto failed;
+    if (len > 0) {
+        map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            goto failed;
+        memcpy (map, buf, len);
+        // F_SEAL_WRITE fails while a writable mapping exists.
+        munmap (map, len);
+    }
+
+    if (fcntl (fd, F_ADD_SEALS, SHM_PAYLOAD_SEALS | F_SEAL_SEAL) < 0)
+        goto failed;
+    return fd;
+
+failed:
+    g_warning ("failed to write payload to shared memory: %s\n", strerror(errno));
+    close (fd);
+    return -1;
+}
+
+char *
+rpcsyncwerk_shm_payload_read (int fd, gsize len)
+{
+    struct stat st;
+    int seals;
+    void *map;
+    char *ret;
+
+    seals = fcntl (fd, F_GET_SEALS);
+    if (seals < 0 || (seals & SHM_PAYLOAD_SEALS) != SHM_PAYLOAD_SEALS ||
+        fstat (fd, &st) < 0 || (guint64)st.st_size < len) {
+        g_warning ("invalid shared memory payload\n");
+        return NULL;
+    }
+
+    ret = g_malloc (len + 1);
+    if (len > 0) {
+        map = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            g_warning ("failed to map shared memory payload: %s\n", strerror(errno));
+            g_free (ret);
+            return NULL;
+        }
+        // The caller owns the result and frees it with g_free(), so the
+        // payload can't be handed out as the mapping itself.
+        memcpy (ret, map, len);
+        munmap (map, len);
+    }
+    ret[len] = '\0';
+    return ret;
+}
+
+#endif // defined(RPCSYNCWERK_USE_SHM)
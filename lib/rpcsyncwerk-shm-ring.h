@@ -0,0 +1,103 @@
+#ifndef RPCSYNCWERK_SHM_RING_H
+#define RPCSYNCWERK_SHM_RING_H
+
+#include <glib.h>
+
+// Shared memory channel used by the named pipe transport, see
+// rpcsyncwerk_named_pipe_client_set_shared_memory(). This header is not
+// installed.
+//
+// A channel is a memfd backed region holding two single-producer/single-
+// consumer byte rings, one for the requests and one for the responses. Each
+// side has an eventfd as its doorbell. Before sleeping on an empty or full
+// ring a side raises a waiting flag in the ring, and the other side rings the
+// doorbell after making progress if the flag is raised. Both sides also watch
+// the unix socket the channel was set up on, which carries no data afterwards,
+// to notice when the other side goes away.
+
+#if !defined(WIN32) && defined(HAVE_SYS_EPOLL_H) && defined(HAVE_MEMFD_CREATE)
+#define RPCSYNCWERK_USE_SHM 1
+#endif
+
+#if defined(RPCSYNCWERK_USE_SHM)
+
+#define RPCSYNCWERK_SHM_MIN_RING_SIZE (4 * 1024)
+#define RPCSYNCWERK_SHM_MAX_RING_SIZE (16 * 1024 * 1024)
+// Longest spin before sleeping the server accepts from a client.
+#define RPCSYNCWERK_SHM_MAX_SPIN_US 1000
+
+// The region and the doorbells of the server and the client, sent from the
+// server to the client.
+#define RPCSYNCWERK_SHM_N_FDS 3
+
+typedef struct _RpcsyncwerkShmChannel RpcsyncwerkShmChannel;
+
+// Create a channel on the server side of the connection @sock. @ring_size is
+// rounded up to a power of two within the limits above. @fds is filled with
+// the descriptors to send to the client, which stay owned by the channel.
+RpcsyncwerkShmChannel *rpcsyncwerk_shm_channel_create (int sock, guint32 ring_size,
+                                                       int spin_us,
+                                                       int fds[RPCSYNCWERK_SHM_N_FDS]);
+
+// Map a channel received from the server on the client side of @sock. Takes
+// ownership of @fds.
+RpcsyncwerkShmChannel *rpcsyncwerk_shm_channel_attach (int sock, int spin_us,
+                                                       int fds[RPCSYNCWERK_SHM_N_FDS]);
+
+void rpcsyncwerk_shm_channel_free (RpcsyncwerkShmChannel *chan);
+
+guint32 rpcsyncwerk_shm_channel_ring_size (RpcsyncwerkShmChannel *chan);
+
+// Stop waiting on the channel at @deadline, in g_get_monotonic_time()
+// microseconds, or never if 0. Reads and writes that would wait longer fail
+// with errno set to ETIMEDOUT, and may have moved part of their data.
+void rpcsyncwerk_shm_channel_set_deadline (RpcsyncwerkShmChannel *chan, gint64 deadline);
+
+// Write @len bytes to the outgoing ring, waiting for space as needed. With
+// @more set the other side is not woken up, as the message continues with
+// another write. Returns -1 if the other side is gone.
+int rpcsyncwerk_shm_channel_write (RpcsyncwerkShmChannel *chan,
+                                   const void *buf, gsize len, gboolean more);
+
+// Read exactly @len bytes from the incoming ring. Returns -1 if the other
+// side is gone.
+int rpcsyncwerk_shm_channel_read (RpcsyncwerkShmChannel *chan, void *buf, gsize len);
+
+// Send @len bytes on the unix socket @sock with @n_fds descriptors attached.
+int rpcsyncwerk_shm_send_fds (int sock, const void *buf, gsize len,
+                              const int *fds, int n_fds);
+
+// Like send(), with @n_fds descriptors attached to the first byte sent.
+// Returns the number of bytes sent, or -1 on error.
+gssize rpcsyncwerk_shm_send_some (int sock, const void *buf, gsize len,
+                                  const int *fds, int n_fds);
+
+// Read exactly @len bytes from the unix socket @sock, along with the
+// descriptors attached to them. Returns the number of descriptors received,
+// at most @max_fds, or -1 on error.
+int rpcsyncwerk_shm_recv_fds (int sock, void *buf, gsize len,
+                              int *fds, int max_fds);
+
+// Like read(), appending the descriptors received to @fds, up to @max_fds in
+// total counting the @n_fds already there. Extra descriptors are closed.
+gssize rpcsyncwerk_shm_recv_some (int sock, void *buf, gsize len,
+                                  int *fds, int max_fds, int *n_fds);
+
+// Large payloads are passed as a sealed memfd instead of through the socket.
+// This is not zero-copy: the sender copies the payload into the memfd and the
+// receiver copies it out again, because responses are handed to the caller in
+// a g_malloc()ed buffer (see TransportCB). What it saves is moving the payload
+// through the socket buffer in many small chunks.
+
+// Create a memfd holding the @len bytes of @buf, copied through a shared
+// mapping, and sealed against changes. Returns the descriptor, or -1 on error.
+int rpcsyncwerk_shm_payload_create (const void *buf, gsize len);
+
+// Map the payload memfd @fd read-only and return its first @len bytes in a
+// NUL terminated buffer. Returns NULL if @fd isn't a sealed memfd of at least
+// @len bytes. Doesn't close @fd.
+char *rpcsyncwerk_shm_payload_read (int fd, gsize len);
+
+#endif // defined(RPCSYNCWERK_USE_SHM)
+
+#endif // RPCSYNCWERK_SHM_RING_H
@@ -1,4 +1,6 @@
 #include <errno.h>
+#include <math.h>
+#include <string.h>
 #include <unistd.h>
 #include <glib.h>
 #include <glib-object.h>
@@ -61,35 +63,275 @@ static json_t *json_serialize_pspec (const GValue *value)
     return json_null();
 }
 
-json_t *json_gobject_serialize (GObject *gobject)
+/* The readable properties of a type, looked up once and cached for the
+ * life of the process. */
+typedef struct {
+    GParamSpec *pspec;
+    /* class whose get_property handles the property, NULL to go through
+     * g_object_get_property() */
+    GObjectClass *owner_class;
+    /* escaped "name": for json_gobject_serialize_to_buffer() */
+    char *key;
+    gsize key_len;
+} SerializeProp;
+
+typedef struct {
+    guint n_props;
+    SerializeProp *props;
+} SerializePlan;
+
+/* Plans are attached to their type, so that looking one up doesn't take a
+ * lock of ours. The lock only serializes creating them. */
+G_LOCK_DEFINE_STATIC (serialize_plans);
+static GQuark serialize_plan_quark;
+
+static SerializePlan *serialize_plan_new (GType gtype)
 {
-    json_t *object = json_object();
+    SerializePlan *plan = g_new0 (SerializePlan, 1);
+    /* keep the class, and so its pspecs, alive with the plan */
+    GObjectClass *klass = g_type_class_ref (gtype);
     GParamSpec **pspecs;
     guint n_pspecs, i;
 
-    pspecs = g_object_class_list_properties (G_OBJECT_GET_CLASS (gobject), &n_pspecs);
+    pspecs = g_object_class_list_properties (klass, &n_pspecs);
+    plan->props = g_new0 (SerializeProp, n_pspecs);
 
     for (i=0; i!=n_pspecs; ++i) {
-        json_t *node;
         GParamSpec *pspec = pspecs[i];
+        SerializeProp *prop;
+        GString *key;
+
+        if (!(pspec->flags & G_PARAM_READABLE))
+            continue;
+
+        prop = &plan->props[plan->n_props++];
+        prop->pspec = pspec;
+        if (!g_param_spec_get_redirect_target (pspec)) {
+            prop->owner_class = g_type_class_peek (pspec->owner_type);
+            if (prop->owner_class && !prop->owner_class->get_property)
+                prop->owner_class = NULL;
+        }
+
+        key = g_string_new (NULL);
+        json_buffer_append_string (key, pspec->name);
+        g_string_append_c (key, ':');
+        prop->key_len = key->len;
+        prop->key = g_string_free (key, FALSE);
+    }
+
+    g_free (pspecs);
+    return plan;
+}
+
+static const SerializePlan *get_serialize_plan (GType gtype)
+{
+    SerializePlan *plan;
+
+    if (serialize_plan_quark) {
+        plan = g_type_get_qdata (gtype, serialize_plan_quark);
+        if (plan)
+            return plan;
+    }
+
+    G_LOCK (serialize_plans);
+    if (!serialize_plan_quark)
+        serialize_plan_quark = g_quark_from_static_string ("rpcsyncwerk-serialize-plan");
+    plan = g_type_get_qdata (gtype, serialize_plan_quark);
+    if (!plan) {
+        plan = serialize_plan_new (gtype);
+        g_type_set_qdata (gtype, serialize_plan_quark, plan);
+    }
+    G_UNLOCK (serialize_plans);
+
+    return plan;
+}
+
+/* Same as g_object_get_property(), minus looking up the property by name. */
+static void serialize_prop_get (GObject *gobject, const SerializeProp *prop,
+                                GValue *value)
+{
+    g_value_init (value, G_PARAM_SPEC_VALUE_TYPE (prop->pspec));
+    if (prop->owner_class)
+        prop->owner_class->get_property (gobject, prop->pspec->param_id,
+                                         value, prop->pspec);
+    else
+        g_object_get_property (gobject, prop->pspec->name, value);
+}
+
+json_t *json_gobject_serialize (GObject *gobject)
+{
+    json_t *object = json_object();
+    const SerializePlan *plan = get_serialize_plan (G_OBJECT_TYPE (gobject));
+    guint i;
+
+    for (i=0; i!=plan->n_props; ++i) {
+        json_t *node;
+        const SerializeProp *prop = &plan->props[i];
         GValue value = { 0, };
 
-        g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
-        g_object_get_property(gobject, pspec->name, &value);
+        serialize_prop_get (gobject, prop, &value);
         node=json_serialize_pspec (&value);
 
         if (node)
-            json_object_set_new (object, pspec->name, node);
+            json_object_set_new (object, prop->pspec->name, node);
 
         g_value_unset (&value);
     }
 
-    g_free (pspecs);
-
     return object;
 
 }
 
+/* Append @str to @out as a JSON string, escaped the same way json_dumps()
+ * does. Returns FALSE, without appending anything, if @str is not valid
+ * UTF-8, for which jansson refuses to create a string. */
+gboolean json_buffer_append_string (GString *out, const char *str)
+{
+    /* uppercase, like the "\\u%04X" of jansson */
+    static const char hex[] = "0123456789ABCDEF";
+    const char *p, *run;
+
+    if (!g_utf8_validate (str, -1, NULL))
+        return FALSE;
+
+    g_string_append_c (out, '"');
+    for (p = run = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        g_string_append_len (out, run, p - run);
+        run = p + 1;
+        switch (c) {
+            case '"':  g_string_append (out, "\\\""); break;
+            case '\\': g_string_append (out, "\\\\"); break;
+            case '\b': g_string_append (out, "\\b"); break;
+            case '\f': g_string_append (out, "\\f"); break;
+            case '\n': g_string_append (out, "\\n"); break;
+            case '\r': g_string_append (out, "\\r"); break;
+            case '\t': g_string_append (out, "\\t"); break;
+            default:
+                g_string_append (out, "\\u00");
+                g_string_append_c (out, hex[c >> 4]);
+                g_string_append_c (out, hex[c & 0xf]);
+        }
+    }
+    g_string_append_len (out, run, p - run);
+    g_string_append_c (out, '"');
+
+    return TRUE;
+}
+
+static void json_buffer_append_integer (GString *out, json_int_t value)
+{
+    g_string_append_printf (out, "%" JSON_INTEGER_FORMAT, value);
+}
+
+/* Reals always get a '.' or an exponent, like in json_dumps(), so that they
+ * are loaded back as reals. Returns FALSE for values jansson rejects. */
+static gboolean json_buffer_append_real (GString *out, double value)
+{
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    if (isnan (value) || isinf (value))
+        return FALSE;
+
+    g_ascii_formatd (buf, sizeof(buf), "%.17g", value);
+    g_string_append (out, buf);
+    if (!strpbrk (buf, ".eE"))
+        g_string_append (out, ".0");
+
+    return TRUE;
+}
+
+/* Buffer counterpart of json_serialize_pspec(). Returns FALSE if the
+ * property must be left out. */
+static gboolean json_buffer_append_pspec (GString *out, const GValue *value)
+{
+    switch (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value))) {
+        case G_TYPE_STRING:
+            if (!g_value_get_string (value))
+                break;
+            return json_buffer_append_string (out, g_value_get_string (value));
+        case G_TYPE_BOOLEAN:
+            g_string_append (out, g_value_get_boolean (value) ? "true" : "false");
+            return TRUE;
+        case G_TYPE_INT:
+            json_buffer_append_integer (out, g_value_get_int (value));
+            return TRUE;
+        case G_TYPE_UINT:
+            json_buffer_append_integer (out, g_value_get_uint (value));
+            return TRUE;
+        case G_TYPE_LONG:
+            json_buffer_append_integer (out, g_value_get_long (value));
+            return TRUE;
+        case G_TYPE_ULONG:
+            json_buffer_append_integer (out, g_value_get_ulong (value));
+            return TRUE;
+        case G_TYPE_INT64:
+            json_buffer_append_integer (out, g_value_get_int64 (value));
+            return TRUE;
+        case G_TYPE_FLOAT:
+            return json_buffer_append_real (out, g_value_get_float (value));
+        case G_TYPE_DOUBLE:
+            return json_buffer_append_real (out, g_value_get_double (value));
+        case G_TYPE_CHAR:
+            json_buffer_append_integer (out, g_value_get_schar (value));
+            return TRUE;
+        case G_TYPE_UCHAR:
+            json_buffer_append_integer (out, g_value_get_uchar (value));
+            return TRUE;
+        case G_TYPE_ENUM:
+            json_buffer_append_integer (out, g_value_get_enum (value));
+            return TRUE;
+        case G_TYPE_FLAGS:
+            json_buffer_append_integer (out, g_value_get_flags (value));
+            return TRUE;
+        case G_TYPE_NONE:
+            break;
+        case G_TYPE_OBJECT:
+            {
+            GObject *object = g_value_get_object (value);
+            if (object) {
+                json_gobject_serialize_to_buffer (object, out);
+                return TRUE;
+            }
+            }
+            break;
+        default:
+            g_warning("Unsuppoted type `%s'",g_type_name (G_VALUE_TYPE (value)));
+    }
+    g_string_append (out, "null");
+    return TRUE;
+}
+
+void json_gobject_serialize_to_buffer (GObject *gobject, GString *out)
+{
+    const SerializePlan *plan = get_serialize_plan (G_OBJECT_TYPE (gobject));
+    guint i;
+    gboolean first = TRUE;
+
+    g_string_append_c (out, '{');
+    for (i=0; i!=plan->n_props; ++i) {
+        const SerializeProp *prop = &plan->props[i];
+        GValue value = { 0, };
+        gsize start = out->len;
+
+        if (!first)
+            g_string_append_c (out, ',');
+        g_string_append_len (out, prop->key, prop->key_len);
+
+        serialize_prop_get (gobject, prop, &value);
+        if (json_buffer_append_pspec (out, &value))
+            first = FALSE;
+        else
+            g_string_truncate (out, start);
+
+        g_value_unset (&value);
+    }
+    g_string_append_c (out, '}');
+}
+
 static gboolean json_deserialize_pspec (GValue *value, GParamSpec *pspec, json_t *node)
 {
     switch (json_typeof(node)) {
@@ -186,27 +428,82 @@ static gboolean json_deserialize_pspec (GValue *value, GParamSpec *pspec, json_t
 
 }
 
+/* Properties of a type by name, to avoid g_object_class_find_property()
+ * for every member of every object. Like serialize plans, they are kept for
+ * the life of the process and attached to their type. */
+typedef struct {
+    GObjectClass *klass;
+    GHashTable *pspecs;
+} DeserializePlan;
+
+G_LOCK_DEFINE_STATIC (deserialize_plans);
+static GQuark deserialize_plan_quark;
+
+static const DeserializePlan *get_deserialize_plan (GType gtype)
+{
+    DeserializePlan *plan;
+    GParamSpec **pspecs;
+    guint n_pspecs, i;
+
+    if (deserialize_plan_quark) {
+        plan = g_type_get_qdata (gtype, deserialize_plan_quark);
+        if (plan)
+            return plan;
+    }
+
+    G_LOCK (deserialize_plans);
+    if (!deserialize_plan_quark)
+        deserialize_plan_quark = g_quark_from_static_string ("rpcsyncwerk-deserialize-plan");
+    plan = g_type_get_qdata (gtype, deserialize_plan_quark);
+    if (!plan) {
+        plan = g_new0 (DeserializePlan, 1);
+        plan->klass = g_type_class_ref (gtype);
+        /* keys are the pspec names, which live as long as the class */
+        plan->pspecs = g_hash_table_new (g_str_hash, g_str_equal);
+
+        pspecs = g_object_class_list_properties (plan->klass, &n_pspecs);
+        for (i=0; i!=n_pspecs; ++i)
+            g_hash_table_insert (plan->pspecs, (gpointer)pspecs[i]->name, pspecs[i]);
+        g_free (pspecs);
+
+        g_type_set_qdata (gtype, deserialize_plan_quark, plan);
+    }
+    G_UNLOCK (deserialize_plans);
+
+    return plan;
+}
+
+#define DESERIALIZE_STACK_PROPS 16
+
 GObject *json_gobject_deserialize (GType gtype, json_t *object)
 {
-    GObjectClass *klass;
+    const DeserializePlan *plan = get_deserialize_plan (gtype);
     GObject *ret;
-    guint n_members, i;
-    json_t *head, *member;
-    const char *member_name;
-    GArray *construct_params;
+    guint n_members, n_props = 0, i;
+    json_t *member;
+    const char *stack_names[DESERIALIZE_STACK_PROPS];
+    GValue stack_values[DESERIALIZE_STACK_PROPS];
+    const char **names = stack_names;
+    GValue *values = stack_values;
 
-    klass = g_type_class_ref (gtype);
     n_members = json_object_size (object);
-    construct_params = g_array_sized_new (FALSE, FALSE, sizeof (GParameter), n_members);
-    head = json_object_iter (object);
+    if (n_members > DESERIALIZE_STACK_PROPS) {
+        names = g_new (const char *, n_members);
+        values = g_new (GValue, n_members);
+    }
 
-    for (member=head; member; member=json_object_iter_next (object, member)) {
+    for (member = json_object_iter (object); member && n_props < n_members;
+         member = json_object_iter_next (object, member)) {
         GParamSpec *pspec;
-        GParameter param = { NULL, };
+        GValue *value = &values[n_props];
         const char *member_name = json_object_iter_key (member);
         json_t *val = json_object_iter_value(member);
 
-        pspec = g_object_class_find_property (klass, member_name);
+        pspec = g_hash_table_lookup (plan->pspecs, member_name);
+        if (!pspec) {
+            /* not a canonical name, e.g. "papa_number" */
+            pspec = g_object_class_find_property (plan->klass, member_name);
+        }
 
         if (!pspec)
             continue;
@@ -217,27 +514,43 @@ GObject *json_gobject_deserialize (GType gtype, json_t *object)
         if (!(pspec->flags & G_PARAM_WRITABLE))
             continue;
 
-        g_value_init(&param.value, G_PARAM_SPEC_VALUE_TYPE (pspec));
+        memset (value, 0, sizeof(GValue));
+        g_value_init(value, G_PARAM_SPEC_VALUE_TYPE (pspec));
 
-        if (json_deserialize_pspec (&param.value, pspec, val)) {
-            param.name = g_strdup (pspec->name);
-            g_array_append_val (construct_params, param);
-        }
-        else
+        if (json_deserialize_pspec (value, pspec, val)) {
+            names[n_props++] = pspec->name;
+        } else {
             g_warning ("Failed to deserialize \"%s\" property of type \"%s\" for an object of type \"%s\"",
-                       pspec->name, g_type_name (G_VALUE_TYPE (&param.value)), g_type_name (gtype));
+                       pspec->name, g_type_name (G_VALUE_TYPE (value)), g_type_name (gtype));
+            g_value_unset (value);
+        }
     }
 
-    ret = g_object_newv (gtype, construct_params->len, (GParameter *) construct_params->data);
+#if GLIB_CHECK_VERSION(2, 54, 0)
+    ret = g_object_new_with_properties (gtype, n_props, names, values);
+#else
+    {
+        GParameter stack_params[DESERIALIZE_STACK_PROPS];
+        GParameter *params = n_props > DESERIALIZE_STACK_PROPS ?
+            g_new (GParameter, n_props) : stack_params;
 
-    for (i=0; i!= construct_params->len; ++i) {
-        GParameter *param = &g_array_index (construct_params, GParameter, i);
-        g_free ((gchar *) param->name);
-        g_value_unset (&param->value);
+        for (i=0; i!=n_props; ++i) {
+            params[i].name = names[i];
+            params[i].value = values[i];
+        }
+        ret = g_object_newv (gtype, n_props, params);
+        if (params != stack_params)
+            g_free (params);
     }
+#endif
+
+    for (i=0; i!=n_props; ++i)
+        g_value_unset (&values[i]);
 
-    g_array_free(construct_params, TRUE);
-    g_type_class_unref(klass);
+    if (names != stack_names) {
+        g_free (names);
+        g_free (values);
+    }
 
     return ret;
 
@@ -13,6 +13,11 @@ typedef enum {
 json_t *json_gobject_serialize (GObject *);
 GObject *json_gobject_deserialize (GType , json_t *);
 
+/* Serialize straight into a buffer, producing the same JSON as
+ * json_dumps (json_gobject_serialize (obj), JSON_COMPACT). */
+void json_gobject_serialize_to_buffer (GObject *, GString *);
+gboolean json_buffer_append_string (GString *, const char *);
+
 inline static void setjetoge(const json_error_t *jerror, GError **error)
 {
     /* Load is the only function I use which reports errors */
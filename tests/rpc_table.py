@@ -7,6 +7,7 @@ func_table = [
     [ "string", ["string", "int"] ],
     [ "object", ["string"] ],
     [ "objlist", ["string", "int"] ],
+    [ "objstream", ["string", "int"] ],
     [ "json", ["string", "int"] ],
     [ "json", ["json"]],
 ]
@@ -1,5 +1,15 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#if !defined(WIN32)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 #include <glib.h>
 #include <glib-object.h>
@@ -10,12 +20,34 @@
 #include "rpcsyncwerk-server.h"
 #include "rpcsyncwerk-client.h"
 #include "rpcsyncwerk-named-pipe-transport.h"
+#include "rpcsyncwerk-loopback-transport.h"
+#include "rpcsyncwerk-shm-ring.h"
 #include "clar.h"
 
 #if !defined(WIN32)
 static const char *pipe_path = "/tmp/.rpcsyncwerk-test";
+static const char *epoll_pipe_path = "/tmp/.rpcsyncwerk-test-epoll";
+static const char *pool_pipe_path = "/tmp/.rpcsyncwerk-test-pool";
+static const char *epoll_pool_pipe_path = "/tmp/.rpcsyncwerk-test-epoll-pool";
+static const char *pipelined_pipe_path = "/tmp/.rpcsyncwerk-test-pipelined";
+static const char *shm_epoll_pipe_path = "/tmp/.rpcsyncwerk-test-shm-epoll";
+static const char *uring_pipe_path = "/tmp/.rpcsyncwerk-test-io-uring";
+static const char *memfd_pipe_path = "/tmp/.rpcsyncwerk-test-memfd";
+static const char *memfd_epoll_pipe_path = "/tmp/.rpcsyncwerk-test-memfd-epoll";
+static const char *reconnect_pipe_path = "/tmp/.rpcsyncwerk-test-reconnect";
+static const char *dropped_pipe_path = "/tmp/.rpcsyncwerk-test-dropped";
+static const char *deferred_pipe_path = "/tmp/.rpcsyncwerk-test-deferred";
 #else
 static const char *pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test";
+static const char *epoll_pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test-epoll";
+static const char *pool_pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test-pool";
+static const char *epoll_pool_pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test-epoll-pool";
+static const char *pipelined_pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test-pipelined";
+static const char *uring_pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test-io-uring";
+static const char *memfd_pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test-memfd";
+static const char *memfd_epoll_pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test-memfd-epoll";
+static const char *reconnect_pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test-reconnect";
+static const char *deferred_pipe_path = "\\\\.\\pipe\\librpcsyncwerk-test-deferred";
 #endif
 
 /* sample class */
@@ -201,14 +233,72 @@ get_substring (const gchar *orig_str, int sub_len, GError **error)
     return ret;
 }
 
+// Returns @orig_str after @sleep_ms.
+static gchar *
+slow_echo (const gchar *orig_str, int sleep_ms, GError **error)
+{
+    g_usleep ((gulong)sleep_ms * 1000);
+    return g_strdup (orig_str);
+}
+
+typedef struct {
+    char *str;
+    int sleep_ms;
+    RpcsyncwerkReply *reply;
+} DeferredEcho;
+
+static void *
+deferred_echo_thread (void *arg)
+{
+    DeferredEcho *echo = arg;
+
+    g_usleep ((gulong)echo->sleep_ms * 1000);
+    rpcsyncwerk_reply_string (echo->reply, echo->str, NULL);
+    g_free (echo);
+    return NULL;
+}
+
+// Replies @orig_str after @sleep_ms, from another thread.
+static void
+deferred_echo (const gchar *orig_str, int sleep_ms, RpcsyncwerkReply *reply)
+{
+    DeferredEcho *echo = g_new0 (DeferredEcho, 1);
+    pthread_t thread;
+
+    echo->str = g_strdup (orig_str);
+    echo->sleep_ms = sleep_ms;
+    echo->reply = reply;
+    pthread_create (&thread, NULL, deferred_echo_thread, echo);
+    pthread_detach (thread);
+}
+
+// Returns @orig_str if the call has a deadline at least @min_ms away.
+static gchar *
+deadline_echo (const gchar *orig_str, int min_ms, GError **error)
+{
+    gint64 deadline = rpcsyncwerk_server_get_call_deadline ();
+
+    if (deadline - g_get_monotonic_time () < (gint64)min_ms * 1000) {
+        g_set_error (error, DFT_DOMAIN, 100, "no deadline");
+        return NULL;
+    }
+    return g_strdup (orig_str);
+}
+
 static RpcsyncwerkClient *
-do_create_client_with_pipe_transport()
+do_create_client_with_pipe_path(const char *path)
 {
-    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(pipe_path);
+    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(path);
     cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
     return rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
 }
 
+static RpcsyncwerkClient *
+do_create_client_with_pipe_transport()
+{
+    return do_create_client_with_pipe_path(pipe_path);
+}
+
 
 void
 test_rpcsyncwerk__simple_call (void)
@@ -242,6 +332,12 @@ test_rpcsyncwerk__invalid_call (void)
     cl_assert (error != NULL);
     g_free (result);
     g_error_free (error);
+
+    char no_name[] = "[1, 2]";
+    gsize ret_len;
+    char *ret = rpcsyncwerk_server_call_function ("test", no_name, strlen(no_name), &ret_len);
+    cl_assert (strstr (ret, "function name missing") != NULL);
+    g_free (ret);
 }
 
 GObject *
@@ -313,6 +409,238 @@ test_rpcsyncwerk__objlist_call (void)
     g_list_free (result);
 }
 
+static void
+check_batch_call (RpcsyncwerkClient *batch_client)
+{
+    RpcsyncwerkBatch *batch = rpcsyncwerk_batch_new ();
+    char *sub = NULL, *bad = NULL;
+    GObject *obj = NULL;
+    GList *list = NULL, *ptr;
+    GError *sub_error = NULL, *obj_error = NULL, *bad_error = NULL, *list_error = NULL;
+    GError *error = NULL;
+
+    cl_must_pass (rpcsyncwerk_batch_add (batch, "get_substring", "string", 0, &sub, &sub_error,
+                                         2, "string", "hello", "int", 2));
+    cl_must_pass (rpcsyncwerk_batch_add (batch, "get_maman_bar", "object", MAMAN_TYPE_BAR,
+                                         &obj, &obj_error, 1, "string", "kitty"));
+    cl_must_pass (rpcsyncwerk_batch_add (batch, "get_substring", "string", 0, &bad, &bad_error,
+                                         2, "string", "hello", "int", 10));
+    cl_must_pass (rpcsyncwerk_batch_add (batch, "get_maman_bar_list", "objlist", MAMAN_TYPE_BAR,
+                                         &list, &list_error, 2, "string", "kitty", "int", 5));
+
+    cl_must_pass (rpcsyncwerk_client_call_batch (batch_client, batch, &error));
+    cl_assert (error == NULL);
+
+    cl_assert (sub_error == NULL);
+    cl_assert_equal_s (sub, "he");
+    g_free (sub);
+
+    cl_assert (obj_error == NULL);
+    cl_assert (obj != NULL);
+    g_object_unref (obj);
+
+    // A failed call doesn't fail the others.
+    cl_assert (bad == NULL);
+    cl_assert (bad_error != NULL);
+    cl_assert_equal_i (bad_error->code, 100);
+    g_error_free (bad_error);
+
+    cl_assert (list_error == NULL);
+    cl_assert_equal_i (g_list_length (list), 5);
+    for (ptr = list; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (list);
+
+    rpcsyncwerk_batch_free (batch);
+}
+
+void
+test_rpcsyncwerk__batch_call (void)
+{
+    check_batch_call (client);
+
+    RpcsyncwerkClient *pipe_client = do_create_client_with_pipe_path(pipe_path);
+    check_batch_call (pipe_client);
+
+    rpcsyncwerk_server_set_batch_threads (4);
+    check_batch_call (pipe_client);
+    rpcsyncwerk_server_set_batch_threads (0);
+
+    rpcsyncwerk_free_client_with_pipe_transport(pipe_client);
+}
+
+void
+test_rpcsyncwerk__batch_call_async_function (void)
+{
+    RpcsyncwerkBatch *batch = rpcsyncwerk_batch_new ();
+    char *sub = NULL, *echo = NULL;
+    GError *sub_error = NULL, *echo_error = NULL;
+    GError *error = NULL;
+
+    cl_must_pass (rpcsyncwerk_batch_add (batch, "deferred_echo", "string", 0, &echo, &echo_error,
+                                         2, "string", "hello", "int", 10));
+    cl_must_pass (rpcsyncwerk_batch_add (batch, "get_substring", "string", 0, &sub, &sub_error,
+                                         2, "string", "hello", "int", 2));
+
+    cl_must_pass (rpcsyncwerk_client_call_batch (client, batch, &error));
+    cl_assert (error == NULL);
+
+    // Asynchronous functions are rejected, the other calls still run.
+    cl_assert (echo == NULL);
+    cl_assert (echo_error != NULL);
+    g_error_free (echo_error);
+
+    cl_assert (sub_error == NULL);
+    cl_assert_equal_s (sub, "he");
+    g_free (sub);
+
+    rpcsyncwerk_batch_free (batch);
+}
+
+typedef struct {
+    char *name;
+    int i;
+    int num;
+} BarIter;
+
+static int n_bar_iters;
+
+static GObject *
+bar_iter_next (void *data, GError **error)
+{
+    BarIter *iter = data;
+    char buf[256];
+
+    if (iter->i >= iter->num)
+        return NULL;
+    sprintf (buf, "%s%d", iter->name, iter->i++);
+    return g_object_new (MAMAN_TYPE_BAR, "name", buf, NULL);
+}
+
+static void
+bar_iter_free (void *data)
+{
+    BarIter *iter = data;
+
+    g_free (iter->name);
+    g_free (iter);
+    n_bar_iters--;
+}
+
+RpcsyncwerkObjStream *
+get_maman_bar_stream (const char *name, int num, GError **error)
+{
+    BarIter *iter;
+
+    if (num < 0) {
+        g_set_error (error, DFT_DOMAIN, 100, "num must be positive.");
+        return NULL;
+    }
+
+    iter = g_new0 (BarIter, 1);
+    iter->name = g_strdup (name);
+    iter->num = num;
+    n_bar_iters++;
+    return rpcsyncwerk_obj_stream_new (bar_iter_next, iter, bar_iter_free);
+}
+
+static void
+check_objstream_call (RpcsyncwerkClient *stream_client)
+{
+    RpcsyncwerkClientObjStream *stream;
+    GError *error = NULL;
+    GObject *obj;
+    char *name, buf[64];
+    int n = 0;
+
+    stream = rpcsyncwerk_client_call__objstream (stream_client, "get_maman_bar_stream",
+                                            MAMAN_TYPE_BAR, &error,
+                                            2, "string", "kitty", "int", 100);
+    cl_assert (error == NULL);
+    while ((obj = rpcsyncwerk_client_obj_stream_next (stream, &error)) != NULL) {
+        g_object_get (obj, "name", &name, NULL);
+        sprintf (buf, "kitty%d", n++);
+        cl_assert_equal_s (name, buf);
+        g_free (name);
+        g_object_unref (obj);
+    }
+    cl_assert (error == NULL);
+    cl_assert_equal_i (n, 100);
+    rpcsyncwerk_client_obj_stream_free (stream);
+    cl_assert_equal_i (n_bar_iters, 0);
+
+    // Stop reading early, the server drops the rest.
+    stream = rpcsyncwerk_client_call__objstream (stream_client, "get_maman_bar_stream",
+                                            MAMAN_TYPE_BAR, &error,
+                                            2, "string", "kitty", "int", 100);
+    obj = rpcsyncwerk_client_obj_stream_next (stream, &error);
+    cl_assert (obj != NULL);
+    g_object_unref (obj);
+    cl_assert_equal_i (n_bar_iters, 1);
+    rpcsyncwerk_client_obj_stream_free (stream);
+    cl_assert_equal_i (n_bar_iters, 0);
+
+    stream = rpcsyncwerk_client_call__objstream (stream_client, "get_maman_bar_stream",
+                                            MAMAN_TYPE_BAR, &error,
+                                            2, "string", "kitty", "int", -1);
+    cl_assert (stream == NULL);
+    cl_assert (error != NULL);
+    g_error_free (error);
+}
+
+void
+test_rpcsyncwerk__objstream_call (void)
+{
+    // Small chunks, so that the objects take several.
+    rpcsyncwerk_server_set_stream_chunk_size (256);
+
+    check_objstream_call (client);
+
+    RpcsyncwerkClient *pipe_client = do_create_client_with_pipe_path(pipe_path);
+    check_objstream_call (pipe_client);
+    rpcsyncwerk_free_client_with_pipe_transport(pipe_client);
+
+    rpcsyncwerk_server_set_stream_chunk_size (0);
+}
+
+void
+test_rpcsyncwerk__objstream_other_service (void)
+{
+    char call[] = "[\"get_maman_bar_stream\", \"kitty\", 100]";
+    char request[128];
+    json_t *resp;
+    gsize ret_len;
+    gint64 id;
+    char *ret;
+
+    rpcsyncwerk_server_set_stream_chunk_size (256);
+    rpcsyncwerk_create_service ("other");
+
+    ret = rpcsyncwerk_server_call_function ("test", call, strlen(call), &ret_len);
+    resp = json_loadb (ret, ret_len, 0, NULL);
+    g_free (ret);
+    cl_assert (resp != NULL);
+    id = json_integer_value (json_object_get (resp, "stream"));
+    json_decref (resp);
+    cl_assert (id != 0);
+
+    // Another service can't pull from or close the stream.
+    snprintf (request, sizeof(request),
+              "{\"stream\": %" G_GINT64_FORMAT ", \"close\": true}", id);
+    ret = rpcsyncwerk_server_call_function ("other", request, strlen(request), &ret_len);
+    cl_assert (strstr (ret, "cannot find stream") != NULL);
+    g_free (ret);
+    cl_assert_equal_i (n_bar_iters, 1);
+
+    ret = rpcsyncwerk_server_call_function ("test", request, strlen(request), &ret_len);
+    cl_assert (strstr (ret, "cannot find stream") == NULL);
+    g_free (ret);
+    cl_assert_equal_i (n_bar_iters, 0);
+
+    rpcsyncwerk_remove_service ("other");
+    rpcsyncwerk_server_set_stream_chunk_size (0);
+}
+
 json_t *
 simple_json_rpc (const char *name, int num, GError **error)
 {
@@ -416,6 +744,214 @@ test_rpcsyncwerk__simple_call_async_json (void)
                                     2, "string", "hello", "int", 10);
 }
 
+void
+test_rpcsyncwerk__serialize_to_buffer (void)
+{
+    GObject *obj = g_object_new (MAMAN_TYPE_BAR, "name", "quote\" tab\t \xc3\xa9", NULL);
+    json_t *tree = json_gobject_serialize (obj);
+    GString *out = g_string_new (NULL);
+    json_error_t jerror;
+
+    json_gobject_serialize_to_buffer (obj, out);
+    json_t *loaded = json_loads (out->str, 0, &jerror);
+    cl_assert_ (loaded != NULL, out->str);
+    cl_assert (json_equal (tree, loaded));
+
+    json_decref (loaded);
+    json_decref (tree);
+    g_string_free (out, TRUE);
+    g_object_unref (obj);
+
+    /* control characters are escaped byte for byte like jansson does */
+    const char *ctl = "ctl \x01\x1f\x7f \n end";
+    json_t *str = json_string (ctl);
+    char *dumped = json_dumps (str, JSON_ENCODE_ANY);
+    out = g_string_new (NULL);
+    cl_assert (json_buffer_append_string (out, ctl));
+    cl_assert_equal_s (out->str, dumped);
+    cl_assert (strstr (out->str, "\\u001F") != NULL);
+    free (dumped);
+    json_decref (str);
+    g_string_free (out, TRUE);
+
+    gsize len;
+    char *ret = rpcsyncwerk_marshal_string_ret (g_strdup ("a\"b"), NULL, &len);
+    cl_assert (strcmp (ret, "{\"ret\":\"a\\\"b\"}") == 0);
+    cl_assert (len == strlen (ret));
+    g_free (ret);
+}
+
+void
+test_rpcsyncwerk__serialize_plan_cache (void)
+{
+    GObject *bar = g_object_new (MAMAN_TYPE_BAR, "name", "kitty", NULL);
+    /* a type without properties */
+    GObject *plain = g_object_new (G_TYPE_OBJECT, NULL);
+    json_t *tree;
+    GObject *obj;
+    int i;
+
+    /* the second round uses the cached plans */
+    for (i = 0; i < 2; i++) {
+        GString *out = g_string_new (NULL);
+        json_gobject_serialize_to_buffer (plain, out);
+        cl_assert_equal_s (out->str, "{}");
+        g_string_truncate (out, 0);
+        json_gobject_serialize_to_buffer (bar, out);
+        cl_assert (strstr (out->str, "\"name\":\"kitty\"") != NULL);
+        g_string_free (out, TRUE);
+
+        tree = json_gobject_serialize (plain);
+        cl_assert (json_object_size (tree) == 0);
+        obj = json_gobject_deserialize (G_TYPE_OBJECT, tree);
+        cl_assert (obj != NULL && G_OBJECT_TYPE (obj) == G_TYPE_OBJECT);
+        g_object_unref (obj);
+        json_decref (tree);
+
+        tree = json_gobject_serialize (bar);
+        obj = json_gobject_deserialize (MAMAN_TYPE_BAR, tree);
+        cl_assert (obj != NULL);
+        cl_assert_equal_s (MAMAN_BAR (obj)->name, "kitty");
+        g_object_unref (obj);
+        json_decref (tree);
+    }
+
+    g_object_unref (plain);
+    g_object_unref (bar);
+}
+
+void
+test_rpcsyncwerk__function_handle (void)
+{
+    char call[] = "[\"get_substring\",\"hello\",2]";
+    char other_call[] = "[\"count_json_kvs\",{}]";
+    gsize ret_len;
+    char *ret;
+
+    int handle = rpcsyncwerk_server_resolve_function ("test", "get_substring");
+    cl_assert (handle >= 0);
+    cl_assert (rpcsyncwerk_server_resolve_function ("test", "nonexistent") == -1);
+    cl_assert (rpcsyncwerk_server_resolve_function ("nonexistent", "get_substring") == -1);
+
+    ret = rpcsyncwerk_server_call_function_by_handle ("test", handle, call,
+                                                      strlen(call), &ret_len);
+    cl_assert (strcmp (ret, "{\"ret\":\"he\"}") == 0);
+    g_free (ret);
+
+    /* a handle that does not match the call falls back to the name */
+    ret = rpcsyncwerk_server_call_function_by_handle ("test", handle, other_call,
+                                                      strlen(other_call), &ret_len);
+    cl_assert (strstr (ret, "number_of_kvs") != NULL);
+    g_free (ret);
+
+    ret = rpcsyncwerk_server_call_function_by_handle ("test", 100000, call,
+                                                      strlen(call), &ret_len);
+    cl_assert (strcmp (ret, "{\"ret\":\"he\"}") == 0);
+    g_free (ret);
+
+    /* a handle of the function of the same name in another service */
+    rpcsyncwerk_create_service ("other");
+    cl_assert (rpcsyncwerk_server_register_function (
+                   "other", deadline_echo, "get_substring",
+                   rpcsyncwerk_compute_signature ("string", 2, "string", "int")));
+    int other_handle = rpcsyncwerk_server_resolve_function ("other", "get_substring");
+    cl_assert (other_handle >= 0 && other_handle != handle);
+    ret = rpcsyncwerk_server_call_function_by_handle ("test", other_handle, call,
+                                                      strlen(call), &ret_len);
+    cl_assert (strcmp (ret, "{\"ret\":\"he\"}") == 0);
+    g_free (ret);
+    rpcsyncwerk_remove_service ("other");
+}
+
+static volatile gint registry_updates_done;
+
+static void *
+do_calls_during_registry_updates (void *arg)
+{
+    RpcsyncwerkClient *loopback = rpcsyncwerk_client_with_loopback_transport (arg);
+    GError *error = NULL;
+    gchar *result;
+
+    while (!g_atomic_int_get (&registry_updates_done)) {
+        result = rpcsyncwerk_client_call__string (loopback, "get_substring", &error,
+                                                  2, "string", "hello", "int", 2);
+        /* "tmp" comes and goes, "test" is always there. */
+        if (strcmp (arg, "test") == 0) {
+            cl_assert_ (error == NULL, error ? error->message : "");
+            cl_assert (strcmp (result, "he") == 0);
+        }
+        g_clear_error (&error);
+        g_free (result);
+    }
+
+    rpcsyncwerk_free_client_with_loopback_transport (loopback);
+    return NULL;
+}
+
+void
+test_rpcsyncwerk__registry_update_while_serving (void)
+{
+    pthread_t threads[4];
+    int i;
+
+    registry_updates_done = 0;
+    for (i = 0; i < 4; i++)
+        pthread_create (&threads[i], NULL, do_calls_during_registry_updates,
+                        i % 2 ? "tmp" : "test");
+
+    for (i = 0; i < 200; i++) {
+        cl_assert (rpcsyncwerk_create_service ("tmp") == 0);
+        cl_assert (rpcsyncwerk_server_register_function (
+                       "tmp", get_substring, "get_substring",
+                       rpcsyncwerk_compute_signature ("string", 2, "string", "int")));
+        cl_assert (rpcsyncwerk_server_resolve_function ("tmp", "get_substring") >= 0);
+        rpcsyncwerk_remove_service ("tmp");
+    }
+
+    g_atomic_int_set (&registry_updates_done, 1);
+    for (i = 0; i < 4; i++)
+        pthread_join (threads[i], NULL);
+
+    cl_assert (rpcsyncwerk_server_resolve_function ("tmp", "get_substring") == -1);
+}
+
+void
+test_rpcsyncwerk__loopback_call (void)
+{
+    RpcsyncwerkClient *loopback = rpcsyncwerk_client_with_loopback_transport ("test");
+    GError *error = NULL;
+    GList *list, *ptr;
+    gchar *result;
+
+    result = rpcsyncwerk_client_call__string (loopback, "get_substring", &error,
+                                              2, "string", "hello", "int", 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (strcmp(result, "he") == 0);
+    g_free (result);
+
+    result = rpcsyncwerk_client_call__string (loopback, "get_substring", &error,
+                                              2, "string", "hello", "int", 10);
+    cl_assert (result == NULL);
+    cl_assert (error != NULL && error->code == 100);
+    g_clear_error (&error);
+
+    list = rpcsyncwerk_client_call__objlist (loopback, "get_maman_bar_list",
+                                             MAMAN_TYPE_BAR, &error,
+                                             2, "string", "kitty", "int", 3);
+    cl_assert (error == NULL);
+    cl_assert (g_list_length (list) == 3);
+    for (ptr = list; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (list);
+
+    /* asynchronous calls complete before returning */
+    cl_assert (rpcsyncwerk_client_async_call__string (loopback, "get_substring",
+                                                      simple_callback, NULL,
+                                                      2, "string", "hello", "int", 2) == 0);
+
+    rpcsyncwerk_free_client_with_loopback_transport (loopback);
+}
+
 void
 test_rpcsyncwerk__pipe_simple_call (void)
 {
@@ -517,6 +1053,786 @@ test_rpcsyncwerk__pipe_concurrent_clients (void)
     }
 }
 
+static void * do_pipe_connect_and_request_n(void *arg)
+{
+    RpcsyncwerkClient *client = do_create_client_with_pipe_path((const char *)arg);
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        gchar* result;
+        GError *error = NULL;
+        result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                             2, "string", "hello", "int", 3);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_ (strcmp(result, "hel") == 0, result);
+        g_free (result);
+    }
+
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+    return NULL;
+}
+
+static void
+run_concurrent_pipe_clients (const char *path, int m_clients)
+{
+    pthread_t *threads = g_new0(pthread_t, m_clients);
+    int j;
+    void *ret;
+
+    for (j = 0; j < m_clients; j++) {
+        pthread_create(&threads[j], NULL, do_pipe_connect_and_request_n, (void *)path);
+    }
+    for (j = 0; j < m_clients; j++) {
+        pthread_join(threads[j], &ret);
+    }
+    g_free (threads);
+}
+
+static void * do_shared_client_requests(void *arg);
+
+static void
+do_io_loop_server_requests (const char *path)
+{
+    RpcsyncwerkClient *client = do_create_client_with_pipe_path(path);
+    gchar* result;
+    GError *error = NULL;
+
+    // 1MB, larger than the socket buffers, so reads and writes are partial.
+    int size = 1024 * 1024;
+    GString *large_string = g_string_sized_new(size);
+    while (large_string->len < size) {
+        g_string_append(large_string, "aaaa");
+    }
+
+    result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                         2, "string", large_string->str, "int", size - 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (strlen(result) == size - 2);
+    g_free (result);
+    g_string_free (large_string, TRUE);
+
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+
+    // More clients than I/O threads.
+    run_concurrent_pipe_clients (path, 8);
+}
+
+void
+test_rpcsyncwerk__pipe_epoll_server (void)
+{
+    RpcsyncwerkNamedPipeServer *epoll_server = rpcsyncwerk_create_named_pipe_server(epoll_pipe_path);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start_with_mode(epoll_server,
+                                                                RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL,
+                                                                2),
+                  "epoll named pipe server failed to start");
+#if defined(WIN32)
+    Sleep(1000);
+#endif
+
+    do_io_loop_server_requests (epoll_pipe_path);
+}
+
+// Runs on epoll or threads where io_uring isn't available.
+void
+test_rpcsyncwerk__pipe_io_uring_server (void)
+{
+    RpcsyncwerkNamedPipeServer *uring_server = rpcsyncwerk_create_named_pipe_server(uring_pipe_path);
+    rpcsyncwerk_named_pipe_server_set_dispatch_pool(uring_server, 2, 0);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start_with_mode(uring_server,
+                                                                RPCSYNCWERK_NAMED_PIPE_SERVER_IO_URING,
+                                                                2),
+                  "io_uring named pipe server failed to start");
+#if defined(WIN32)
+    Sleep(1000);
+#endif
+
+    do_io_loop_server_requests (uring_pipe_path);
+
+    // Pipelined requests, so responses are queued while a write is in flight.
+    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(uring_pipe_path);
+    rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, TRUE);
+    cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+    RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+
+    int m_threads = 8;
+    pthread_t *threads = g_new0(pthread_t, m_threads);
+    int j;
+    void *ret;
+    for (j = 0; j < m_threads; j++)
+        pthread_create(&threads[j], NULL, do_shared_client_requests, client);
+    for (j = 0; j < m_threads; j++)
+        pthread_join(threads[j], &ret);
+    g_free (threads);
+
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+}
+
+static void
+do_shared_memory_requests (const char *path)
+{
+    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(path);
+    // Small rings, so large requests and responses wrap around and wait for
+    // the other side.
+    rpcsyncwerk_named_pipe_client_set_shared_memory(pipe_client, 4096, 10);
+    cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+#if defined(RPCSYNCWERK_USE_SHM)
+    cl_assert (pipe_client->shm != NULL);
+#endif
+    RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+    gchar* result;
+    GError *error = NULL;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                             2, "string", "hello", "int", 3);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_ (strcmp(result, "hel") == 0, result);
+        g_free (result);
+    }
+
+    int size = 100 * 1024;
+    GString *large_string = g_string_sized_new(size);
+    while (large_string->len < size) {
+        g_string_append(large_string, "aaaa");
+    }
+    result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                         2, "string", large_string->str, "int", size - 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (strlen(result) == size - 2);
+    g_free (result);
+    g_string_free (large_string, TRUE);
+
+    // Errors still come back as such.
+    result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                         2, "string", "hello", "int", 10);
+    cl_assert (result == NULL);
+    cl_assert (error != NULL);
+    g_clear_error (&error);
+
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+}
+
+void
+test_rpcsyncwerk__pipe_shared_memory (void)
+{
+    do_shared_memory_requests (pipe_path);
+
+    RpcsyncwerkNamedPipeServer *epoll_server = rpcsyncwerk_create_named_pipe_server(shm_epoll_pipe_path);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start_with_mode(epoll_server,
+                                                                RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL,
+                                                                1),
+                  "epoll named pipe server failed to start");
+    do_shared_memory_requests (shm_epoll_pipe_path);
+}
+
+static void
+do_memfd_requests (const char *path)
+{
+    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(path);
+    rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, TRUE);
+    cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+    RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+    gchar* result;
+    GError *error = NULL;
+    int i;
+
+    int size = 256 * 1024;
+    GString *large_string = g_string_sized_new(size);
+    while (large_string->len < size) {
+        g_string_append(large_string, "abcd");
+    }
+
+    // Responses below and above the threshold, interleaved.
+    for (i = 0; i < 10; i++) {
+        int len = (i % 2) ? size - i : 3;
+        result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                             2, "string", large_string->str, "int", len);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert (strlen(result) == len);
+        cl_assert (strncmp(result, large_string->str, len) == 0);
+        g_free (result);
+    }
+
+    g_string_free (large_string, TRUE);
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+}
+
+void
+test_rpcsyncwerk__pipe_memfd_responses (void)
+{
+    RpcsyncwerkNamedPipeServer *server = rpcsyncwerk_create_named_pipe_server(memfd_pipe_path);
+    rpcsyncwerk_named_pipe_server_set_memfd_threshold(server, 64 * 1024);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start(server),
+                  "named pipe server failed to start");
+
+    RpcsyncwerkNamedPipeServer *epoll_server = rpcsyncwerk_create_named_pipe_server(memfd_epoll_pipe_path);
+    rpcsyncwerk_named_pipe_server_set_memfd_threshold(epoll_server, 64 * 1024);
+    rpcsyncwerk_named_pipe_server_set_dispatch_pool(epoll_server, 2, 0);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start_with_mode(epoll_server,
+                                                                RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL,
+                                                                1),
+                  "epoll named pipe server failed to start");
+#if defined(WIN32)
+    Sleep(1000);
+#endif
+
+    do_memfd_requests (memfd_pipe_path);
+    do_memfd_requests (memfd_epoll_pipe_path);
+
+    // Legacy clients get large responses through the socket.
+    RpcsyncwerkClient *client = do_create_client_with_pipe_path(memfd_pipe_path);
+    gchar* result;
+    GError *error = NULL;
+    int size = 128 * 1024;
+    GString *large_string = g_string_sized_new(size);
+    while (large_string->len < size) {
+        g_string_append(large_string, "aaaa");
+    }
+    result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                         2, "string", large_string->str, "int", size - 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (strlen(result) == size - 2);
+    g_free (result);
+    g_string_free (large_string, TRUE);
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+}
+
+void
+test_rpcsyncwerk__pipe_dispatch_pool (void)
+{
+    RpcsyncwerkNamedPipeServer *pool_server = rpcsyncwerk_create_named_pipe_server(pool_pipe_path);
+    rpcsyncwerk_named_pipe_server_set_dispatch_pool(pool_server, 2, 0);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start(pool_server),
+                  "named pipe server with dispatch pool failed to start");
+
+    RpcsyncwerkNamedPipeServer *epoll_pool_server = rpcsyncwerk_create_named_pipe_server(epoll_pool_pipe_path);
+    rpcsyncwerk_named_pipe_server_set_dispatch_pool(epoll_pool_server, 2, 0);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start_with_mode(epoll_pool_server,
+                                                                RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL,
+                                                                1),
+                  "epoll named pipe server with dispatch pool failed to start");
+#if defined(WIN32)
+    Sleep(1000);
+#endif
+
+    run_concurrent_pipe_clients (pool_pipe_path, 8);
+    run_concurrent_pipe_clients (epoll_pool_pipe_path, 8);
+}
+
+static void * do_shared_client_requests(void *arg)
+{
+    RpcsyncwerkClient *client = arg;
+    int i;
+
+    for (i = 0; i < 20; i++) {
+        gchar* result;
+        GError *error = NULL;
+        result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                             2, "string", "hello", "int", i % 5);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_ (strlen(result) == i % 5, result);
+        g_free (result);
+    }
+
+    return NULL;
+}
+
+// A pool of two connections shared by more threads, with both connection
+// types.
+void
+test_rpcsyncwerk__pipe_client_pool (void)
+{
+    gboolean pipelined;
+
+    for (pipelined = FALSE; pipelined <= TRUE; pipelined++) {
+        RpcsyncwerkNamedPipeClientPool *pool = rpcsyncwerk_create_named_pipe_client_pool(pipe_path, 2);
+        rpcsyncwerk_named_pipe_client_pool_set_pipelined(pool, pipelined);
+        RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_pool(pool, "test");
+
+        int m_threads = 8;
+        pthread_t *threads = g_new0(pthread_t, m_threads);
+        int j;
+        void *ret;
+        for (j = 0; j < m_threads; j++)
+            pthread_create(&threads[j], NULL, do_shared_client_requests, client);
+        for (j = 0; j < m_threads; j++)
+            pthread_join(threads[j], &ret);
+        g_free (threads);
+
+        cl_assert (pool->n_connections >= 1 && pool->n_connections <= 2);
+        cl_assert (g_queue_get_length (&pool->idle) == pool->n_connections);
+
+        rpcsyncwerk_free_client_with_pipe_transport(client);
+        rpcsyncwerk_named_pipe_client_pool_free(pool);
+    }
+}
+
+// A client set to reconnect comes back once the server is up, but doesn't
+// try again before its backoff delay.
+void
+test_rpcsyncwerk__pipe_client_reconnect (void)
+{
+    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(reconnect_pipe_path);
+    rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, TRUE);
+    // The first retry is at least a second away.
+    rpcsyncwerk_named_pipe_client_set_reconnect(pipe_client, 2000, 4000);
+    cl_assert (rpcsyncwerk_named_pipe_client_connect(pipe_client) < 0);
+    RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+    rpcsyncwerk_named_pipe_transport_set_idempotent(client, "get_substring");
+
+    RpcsyncwerkNamedPipeServer *server = rpcsyncwerk_create_named_pipe_server(reconnect_pipe_path);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start(server),
+                  "named pipe server failed to start");
+#if defined(WIN32)
+    Sleep(1000);
+#endif
+
+    gchar* result;
+    GError *error = NULL;
+    // Within the backoff delay of the failed connect, the client doesn't
+    // try to reconnect.
+    cl_assert (pipe_client->next_reconnect_time - g_get_monotonic_time () > 500 * 1000);
+    result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    cl_assert (result == NULL);
+    cl_assert (error != NULL);
+    g_error_free (error);
+    error = NULL;
+    cl_assert (pipe_client->broken);
+
+    // Once it has passed, it does.
+    pipe_client->next_reconnect_time = 0;
+    result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (result, "he");
+    g_free (result);
+    cl_assert (!pipe_client->broken);
+
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+}
+
+#if !defined(WIN32)
+// Reads the first request of the first client, then closes the connection
+// as if the server died during the call.
+static void *
+drop_first_call_thread (void *arg)
+{
+    int listen_fd = GPOINTER_TO_INT (arg);
+    char buf[4096];
+    int fd;
+
+    fd = accept (listen_fd, NULL, NULL);
+    if (fd >= 0) {
+        if (read (fd, buf, sizeof(buf)) < 0)
+            g_warning ("failed to read request: %s", strerror(errno));
+        close (fd);
+    }
+    close (listen_fd);
+    return NULL;
+}
+#endif
+
+// The server closes a live connection during a call. The call fails, and
+// the client reconnects for the next one.
+void
+test_rpcsyncwerk__pipe_server_closes_connection (void)
+{
+#if !defined(WIN32)
+    gboolean pipelined;
+
+    for (pipelined = FALSE; pipelined <= TRUE; pipelined++) {
+        char *path = g_strdup_printf ("%s-%d", dropped_pipe_path, pipelined);
+        struct sockaddr_un addr;
+        int listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+        pthread_t thread;
+
+        cl_assert (listen_fd >= 0);
+        unlink (path);
+        memset (&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        g_strlcpy (addr.sun_path, path, sizeof(addr.sun_path));
+        cl_must_pass (bind (listen_fd, (struct sockaddr *)&addr, sizeof(addr)));
+        cl_must_pass (listen (listen_fd, 1));
+        pthread_create (&thread, NULL, drop_first_call_thread, GINT_TO_POINTER (listen_fd));
+
+        RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(path);
+        rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, pipelined);
+        rpcsyncwerk_named_pipe_client_set_reconnect(pipe_client, 0, 0);
+        cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+        RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+
+        gchar* result;
+        GError *error = NULL;
+        result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                             2, "string", "hello", "int", 2);
+        cl_assert (result == NULL);
+        cl_assert (error != NULL);
+        cl_assert_equal_i (error->code, TRANSPORT_ERROR_CODE);
+        g_error_free (error);
+        error = NULL;
+        cl_assert (pipe_client->broken);
+        pthread_join (thread, NULL);
+
+        // The server is back.
+        RpcsyncwerkNamedPipeServer *server = rpcsyncwerk_create_named_pipe_server(path);
+        cl_must_pass_(rpcsyncwerk_named_pipe_server_start(server),
+                      "named pipe server failed to start");
+        result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                             2, "string", "hello", "int", 2);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_s (result, "he");
+        g_free (result);
+        cl_assert (!pipe_client->broken);
+
+        rpcsyncwerk_free_client_with_pipe_transport(client);
+        g_free (path);
+    }
+#endif
+}
+
+// A call to a hung function fails with a timeout. A pipelined connection
+// drops the late response and goes on, a legacy one is reopened.
+void
+test_rpcsyncwerk__pipe_call_timeout (void)
+{
+    gboolean pipelined;
+
+    for (pipelined = FALSE; pipelined <= TRUE; pipelined++) {
+        RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(pipe_path);
+        rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, pipelined);
+        rpcsyncwerk_named_pipe_client_set_reconnect(pipe_client, 0, 0);
+        cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+        RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+        rpcsyncwerk_client_set_timeout (client, 100);
+
+        gchar* result;
+        GError *error = NULL;
+        gint64 start = g_get_monotonic_time ();
+        result = rpcsyncwerk_client_call__string (client, "slow_echo", &error,
+                                             2, "string", "hello", "int", 1000);
+        cl_assert (result == NULL);
+        cl_assert (error != NULL);
+        cl_assert_equal_i (error->code, TIMEOUT_ERROR_CODE);
+        cl_assert (g_get_monotonic_time () - start < 900 * 1000);
+        g_error_free (error);
+        error = NULL;
+        cl_assert (pipe_client->broken == !pipelined);
+
+        rpcsyncwerk_client_call_with_timeout (client, "get_substring", "string", 0,
+                                              &result, 5000, &error,
+                                              2, "string", "hello", "int", 2);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_s (result, "he");
+        g_free (result);
+
+        rpcsyncwerk_free_client_with_pipe_transport(client);
+    }
+}
+
+// Without reconnect, a legacy connection broken by a timeout fails the
+// following calls instead of returning the late response.
+void
+test_rpcsyncwerk__pipe_call_timeout_no_reconnect (void)
+{
+    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(pipe_path);
+    cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+    RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+    rpcsyncwerk_client_set_timeout (client, 100);
+
+    gchar* result;
+    GError *error = NULL;
+    result = rpcsyncwerk_client_call__string (client, "slow_echo", &error,
+                                         2, "string", "hello", "int", 300);
+    cl_assert (result == NULL);
+    cl_assert (error != NULL);
+    cl_assert_equal_i (error->code, TIMEOUT_ERROR_CODE);
+    g_clear_error (&error);
+    cl_assert (pipe_client->broken);
+
+    // The response of slow_echo has arrived by now.
+    g_usleep (400 * 1000);
+    result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    cl_assert (result == NULL);
+    cl_assert (error != NULL);
+    cl_assert_equal_i (error->code, TRANSPORT_ERROR_CODE);
+    g_clear_error (&error);
+
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+}
+
+void
+test_rpcsyncwerk__pipe_call_deadline (void)
+{
+    char fcall[] = "[\"get_substring\", \"hello\", 2]";
+    gsize ret_len;
+    gchar *ret;
+
+    // The client has given up already.
+    ret = rpcsyncwerk_server_call_function_with_deadline ("test", -1, fcall, strlen(fcall),
+                                                     &ret_len, g_get_monotonic_time () - 1);
+    cl_assert (strstr (ret, "504") != NULL);
+    g_free (ret);
+
+    ret = rpcsyncwerk_server_call_function_with_deadline ("test", -1, fcall, strlen(fcall),
+                                                     &ret_len, g_get_monotonic_time () + G_USEC_PER_SEC);
+    cl_assert (strstr (ret, "\"he\"") != NULL);
+    g_free (ret);
+
+    // An asynchronous function that replies too late. The late reply is
+    // dropped.
+    char deferred_call[] = "[\"deferred_echo\", \"hello\", 300]";
+    ret = rpcsyncwerk_server_call_function_with_deadline ("test", -1, deferred_call,
+                                                     strlen(deferred_call), &ret_len,
+                                                     g_get_monotonic_time () + 50000);
+    cl_assert (strstr (ret, "504") != NULL);
+    g_free (ret);
+    g_usleep (400000);
+
+    gboolean pipelined;
+    for (pipelined = FALSE; pipelined <= TRUE; pipelined++) {
+        RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(pipe_path);
+        rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, pipelined);
+        cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+        RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+        GError *error = NULL;
+        gchar *result = NULL;
+
+        rpcsyncwerk_client_call_with_timeout (client, "deadline_echo", "string", 0,
+                                              &result, 5000, &error,
+                                              2, "string", "hello", "int", 1000);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_s (result, "hello");
+        g_free (result);
+
+        result = rpcsyncwerk_client_call__string (client, "deadline_echo", &error,
+                                             2, "string", "hello", "int", 0);
+        cl_assert (result == NULL);
+        cl_assert (error != NULL);
+        g_error_free (error);
+
+        rpcsyncwerk_free_client_with_pipe_transport(client);
+    }
+}
+
+// One pipelined client shared by several threads, talking to both server
+// modes.
+void
+test_rpcsyncwerk__pipe_pipelined_client (void)
+{
+    RpcsyncwerkNamedPipeServer *server = rpcsyncwerk_create_named_pipe_server(pipelined_pipe_path);
+    rpcsyncwerk_named_pipe_server_set_dispatch_pool(server, 4, 0);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start_with_mode(server,
+                                                                RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL,
+                                                                1),
+                  "epoll named pipe server failed to start");
+#if defined(WIN32)
+    Sleep(1000);
+#endif
+
+    const char *paths[] = { pipelined_pipe_path, pipe_path };
+    int p;
+    for (p = 0; p < G_N_ELEMENTS(paths); p++) {
+        RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(paths[p]);
+        rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, TRUE);
+        cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+        RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+
+        int m_threads = 8;
+        pthread_t *threads = g_new0(pthread_t, m_threads);
+        int j;
+        void *ret;
+        for (j = 0; j < m_threads; j++) {
+            pthread_create(&threads[j], NULL, do_shared_client_requests, client);
+        }
+        for (j = 0; j < m_threads; j++) {
+            pthread_join(threads[j], &ret);
+        }
+        g_free (threads);
+
+        GError *error = NULL;
+        char *result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                                   2, "string", "hello", "int", 10);
+        cl_assert (error != NULL);
+        cl_assert (result == NULL);
+        g_error_free (error);
+
+        rpcsyncwerk_free_client_with_pipe_transport(client);
+    }
+}
+
+static void * do_deferred_echo(void *arg)
+{
+    RpcsyncwerkClient *client = arg;
+    GError *error = NULL;
+    gchar *result;
+
+    result = rpcsyncwerk_client_call__string (client, "deferred_echo", &error,
+                                         2, "string", "hello", "int", 300);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (result, "hello");
+    g_free (result);
+
+    return NULL;
+}
+
+// Asynchronous functions don't hold a dispatch thread while their replies
+// are pending.
+void
+test_rpcsyncwerk__pipe_deferred_reply (void)
+{
+    GError *error = NULL;
+    gchar *result;
+
+    // Transports that can't defer wait for the reply.
+    result = rpcsyncwerk_client_call__string (client, "deferred_echo", &error,
+                                         2, "string", "hello", "int", 0);
+    cl_assert (error == NULL);
+    cl_assert_equal_s (result, "hello");
+    g_free (result);
+
+    RpcsyncwerkNamedPipeServer *server = rpcsyncwerk_create_named_pipe_server(deferred_pipe_path);
+    rpcsyncwerk_named_pipe_server_set_dispatch_pool(server, 1, 0);
+    cl_must_pass_(rpcsyncwerk_named_pipe_server_start_with_mode(server,
+                                                                RPCSYNCWERK_NAMED_PIPE_SERVER_EPOLL,
+                                                                1),
+                  "epoll named pipe server failed to start");
+#if defined(WIN32)
+    Sleep(1000);
+#endif
+
+    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(deferred_pipe_path);
+    rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, TRUE);
+    cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+    RpcsyncwerkClient *deferred_client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+
+    int m_threads = 4;
+    pthread_t threads[4];
+    gint64 start = g_get_monotonic_time ();
+    int j;
+    for (j = 0; j < m_threads; j++)
+        pthread_create(&threads[j], NULL, do_deferred_echo, deferred_client);
+    for (j = 0; j < m_threads; j++)
+        pthread_join(threads[j], NULL);
+    // With the single dispatch thread held, the calls would take 1.2s.
+    cl_assert (g_get_monotonic_time () - start < 1000 * 1000);
+
+    rpcsyncwerk_free_client_with_pipe_transport(deferred_client);
+}
+
+// Pipelined requests carry the service name in the frame header.
+void
+test_rpcsyncwerk__pipe_pipelined_service_header (void)
+{
+    RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(pipe_path);
+    rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, TRUE);
+    cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+    RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "nonexistent");
+
+    GError *error = NULL;
+    char *result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                               2, "string", "hello", "int", 2);
+    cl_assert (result == NULL);
+    cl_assert (error != NULL);
+    cl_assert (error->code == 501);
+    g_error_free (error);
+
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+
+    /* quotes in the call body travel verbatim */
+    pipe_client = rpcsyncwerk_create_named_pipe_client(pipe_path);
+    rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, TRUE);
+    cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+    client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+
+    json_t *object = json_object ();
+    json_object_set_new (object, "\"quoted\"", json_string ("\"value\""));
+    json_t *ret = rpcsyncwerk_client_call__json (client, "count_json_kvs", &error,
+                                               1, "json", object);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (json_integer_value (json_object_get (ret, "number_of_kvs")) == 1);
+    json_decref (ret);
+    json_decref (object);
+
+    rpcsyncwerk_free_client_with_pipe_transport(client);
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n_done;
+    int n_errors;
+    int n_wrong;
+} AsyncPipeResults;
+
+static void
+async_pipe_callback (void *result, void *user_data, GError *error)
+{
+    AsyncPipeResults *results = user_data;
+
+    pthread_mutex_lock (&results->lock);
+    if (error)
+        results->n_errors++;
+    else if (!result || strcmp ((char *)result, "he") != 0)
+        results->n_wrong++;
+    results->n_done++;
+    pthread_cond_signal (&results->cond);
+    pthread_mutex_unlock (&results->lock);
+}
+
+// Many asynchronous calls outstanding on one connection, completed on the
+// reader thread and on a main context.
+void
+test_rpcsyncwerk__pipe_async_call (void)
+{
+    const int n_calls = 100;
+    int use_context;
+
+    for (use_context = 0; use_context < 2; use_context++) {
+        AsyncPipeResults results = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+        GMainContext *context = use_context ? g_main_context_new () : NULL;
+        int i;
+
+        RpcsyncwerkNamedPipeClient *pipe_client = rpcsyncwerk_create_named_pipe_client(pipe_path);
+        rpcsyncwerk_named_pipe_client_set_pipelined(pipe_client, TRUE);
+        rpcsyncwerk_named_pipe_client_set_async_context(pipe_client, context);
+        cl_must_pass_(rpcsyncwerk_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
+        RpcsyncwerkClient *client = rpcsyncwerk_client_with_named_pipe_transport(pipe_client, "test");
+
+        for (i = 0; i < n_calls; i++) {
+            cl_must_pass (rpcsyncwerk_client_async_call__string (client, "get_substring",
+                                                                 async_pipe_callback, &results,
+                                                                 2, "string", "hello", "int", 2));
+        }
+
+        /* synchronous calls still work while the reader thread runs */
+        GError *error = NULL;
+        char *result = rpcsyncwerk_client_call__string (client, "get_substring", &error,
+                                                   2, "string", "hello", "int", 2);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert (strcmp (result, "he") == 0);
+        g_free (result);
+
+        if (context) {
+            while (results.n_done < n_calls)
+                g_main_context_iteration (context, TRUE);
+        } else {
+            pthread_mutex_lock (&results.lock);
+            while (results.n_done < n_calls)
+                pthread_cond_wait (&results.cond, &results.lock);
+            pthread_mutex_unlock (&results.lock);
+        }
+        cl_assert (results.n_errors == 0);
+        cl_assert (results.n_wrong == 0);
+
+        rpcsyncwerk_free_client_with_pipe_transport(client);
+        if (context)
+            g_main_context_unref (context);
+    }
+}
+
 
 #include "rpcsyncwerk-signature.h"
 #include "rpcsyncwerk-marshal.h"
@@ -532,10 +1848,21 @@ test_rpcsyncwerk__initialize (void)
                                      rpcsyncwerk_signature_object__string());
     rpcsyncwerk_server_register_function ("test", get_maman_bar_list, "get_maman_bar_list",
                                      rpcsyncwerk_signature_objlist__string_int());
+    rpcsyncwerk_server_register_function ("test", get_maman_bar_stream, "get_maman_bar_stream",
+                                     rpcsyncwerk_signature_objstream__string_int());
     rpcsyncwerk_server_register_function ("test", simple_json_rpc, "simple_json_rpc",
                                      rpcsyncwerk_signature_json__string_int());
     rpcsyncwerk_server_register_function ("test", count_json_kvs, "count_json_kvs",
                                      rpcsyncwerk_signature_json__json());
+    rpcsyncwerk_server_register_function ("test", slow_echo, "slow_echo",
+                                     rpcsyncwerk_signature_string__string_int());
+    rpcsyncwerk_server_register_function ("test", deadline_echo, "deadline_echo",
+                                     rpcsyncwerk_signature_string__string_int());
+    rpcsyncwerk_server_register_async_function ("test", deferred_echo, "deferred_echo",
+                                           rpcsyncwerk_signature_string__string_int());
+    /* registered again with the precomputed signature */
+    rpcsyncwerk_server_register_function_static ("test", get_substring, "get_substring_static",
+                                                 RPCSYNCWERK_SIGNATURE_STRING__STRING_INT);
 
     /* sample client */
     client = rpcsyncwerk_client_new();
@@ -563,3 +1890,22 @@ test_rpcsyncwerk__cleanup (void)
     /* free memory for memory debug with valgrind */
     rpcsyncwerk_server_final();
 }
+
+void
+test_rpcsyncwerk__precomputed_signature (void)
+{
+    char *sig = rpcsyncwerk_compute_signature ("string", 2, "string", "int");
+
+    cl_assert (strcmp (sig, RPCSYNCWERK_SIGNATURE_STRING__STRING_INT) == 0);
+    g_free (sig);
+
+    sig = rpcsyncwerk_compute_signature ("json", 1, "json");
+    cl_assert (strcmp (sig, RPCSYNCWERK_SIGNATURE_JSON__JSON) == 0);
+    g_free (sig);
+
+    char call[] = "[\"get_substring_static\",\"hello\",2]";
+    gsize ret_len;
+    char *ret = rpcsyncwerk_server_call_function ("test", call, strlen(call), &ret_len);
+    cl_assert (strcmp (ret, "{\"ret\":\"he\"}") == 0);
+    g_free (ret);
+}